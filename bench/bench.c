@@ -0,0 +1,529 @@
+#include <dirent.h>
+#include <time.h>
+
+#include "parse.h"
+
+// The number of times each measurement is repeated. The fastest run is kept.
+#define BENCH_RUNS 5
+
+// The size of each of the generated corpora.
+#define BENCH_SIZE (16 * 1024 * 1024)
+
+// The directory of slow inputs found by the performance fuzzer, and the most
+// of them that are replayed.
+#define BENCH_REPLAY "fuzz/corpus"
+#define BENCH_REPLAY_MAXIMUM 256
+
+// The budget for each replayed input, as a multiple of the time per byte of
+// the slowest large corpus in the same run. Measuring against this machine's
+// own throughput keeps the budget meaningful anywhere. The worst inputs found
+// so far are small enough that the fixed cost of a parse shows, and take up
+// to about five times as long per byte as the large corpora, while anything
+// that grows worse than linearly is far beyond that.
+#define BENCH_REPLAY_BUDGET 10.0
+
+typedef struct {
+  const char *name;
+  char *source;
+  size_t size;
+} corpus_t;
+
+// The hardware counts are only there when the counters could be opened (see
+// counters_open). Otherwise they're reported as unavailable.
+typedef struct {
+  double seconds;
+  size_t tokens;
+  counts_t counts;
+} measurement_t;
+
+static double now(void) {
+  struct timespec spec;
+  clock_gettime(CLOCK_MONOTONIC, &spec);
+  return spec.tv_sec + spec.tv_nsec / 1e9;
+}
+
+// A tiny deterministic generator so that the corpora are the same every run.
+static unsigned int next_random(unsigned int *state) {
+  *state = *state * 1103515245 + 12345;
+  return (*state >> 16) & 0x7fff;
+}
+
+// Generates a corpus by appending statements built from the given pieces until
+// it reaches the target size.
+static corpus_t corpus_generate(const char *name, const char **pieces, size_t count, size_t per_line) {
+  corpus_t corpus = { .name = name, .source = calloc(1, BENCH_SIZE + 256 + PARSE_PADDING), .size = 0 };
+  unsigned int state = 1;
+
+  while (corpus.size < BENCH_SIZE) {
+    corpus.size += sprintf(corpus.source + corpus.size, "foo%u", next_random(&state) % 100);
+
+    for (size_t index = 0; index < per_line; index++) {
+      const char *piece = pieces[next_random(&state) % count];
+      corpus.size += sprintf(corpus.source + corpus.size, " %s bar%u", piece, next_random(&state) % 100);
+    }
+
+    corpus.source[corpus.size++] = '\n';
+  }
+
+  return corpus;
+}
+
+static corpus_t corpus_read(const char *path) {
+  corpus_t corpus = { .name = path };
+  FILE *file = fopen(path, "rb");
+
+  if (file == NULL) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+
+  fseek(file, 0, SEEK_END);
+  corpus.size = (size_t) ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  corpus.source = calloc(1, corpus.size + PARSE_PADDING);
+  if (fread(corpus.source, 1, corpus.size, file) != corpus.size) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+
+  fclose(file);
+  return corpus;
+}
+
+static void count_token(void *data, __attribute__((unused)) token_t *token) {
+  (*(size_t *) data)++;
+}
+
+// The tokens of the corpus being measured, along with their packed encoding.
+typedef struct {
+  const char *source;
+  packed_token_t *tokens;
+  size_t count;
+  uint8_t *packed;
+  size_t size;
+} packing_t;
+
+static packing_t packing;
+
+static void pack_token(void *data, token_t *token) {
+  packing_t *packing = data;
+
+  packing->tokens[packing->count++] = (packed_token_t) {
+    .start = (uint32_t) (token->start - packing->source),
+    .end = (uint32_t) (token->end - packing->source),
+    .type = (uint8_t) token->type
+  };
+}
+
+// Decodes every block of the packed tokens, returning how many there were.
+static size_t unpack_tokens(void) {
+  packed_reader_t reader;
+  packed_token_t tokens[PACKED_BLOCK];
+  size_t count = 0;
+
+  if (!packed_open(&reader, packing.packed, packing.size)) return 0;
+
+  for (size_t block = 0; block < reader.blocks; block++) {
+    count += packed_decode(&reader, block, tokens);
+  }
+
+  return count;
+}
+
+#define UNUSED __attribute__((unused))
+static void noop_pair(UNUSED void *data, UNUSED token_t *opening, UNUSED token_t *closing) {}
+static void noop_array(UNUSED void *data, UNUSED token_t *opening, UNUSED token_t *closing, UNUSED size_t size) {}
+static void noop_token(UNUSED void *data, UNUSED token_t *token) {}
+static void noop_ternary(UNUSED void *data) {}
+#undef UNUSED
+
+// A visitor that does nothing, so that parsing can be measured on its own.
+static const visitor_t noop = {
+  .array = noop_array,
+  .assign = noop_token,
+  .begin = noop_pair,
+  .binary = noop_token,
+  .defined = noop_token,
+  .group = noop_pair,
+  .index_call = noop_pair,
+  .index_expr = noop_pair,
+  .literal = noop_token,
+  .not = noop_token,
+  .ternary = noop_ternary,
+  .unary = noop_token,
+  .until_block = noop_token,
+  .while_block = noop_token
+};
+
+// A visitor that only listens for assignments and literals, counting them into
+// the size_t given as its data. Every other node is skipped by the parser.
+static void count_node(void *data, __attribute__((unused)) token_t *token) {
+  (*(size_t *) data)++;
+}
+
+static size_t selected;
+
+static const visitor_t selective = {
+  .data = &selected,
+  .assign = count_node,
+  .literal = count_node
+};
+
+// The printer from the CLI, writing to /dev/null.
+static visitor_t printing;
+
+typedef enum {
+  PHASE_ENCODE,
+  PHASE_DECODE,
+  PHASE_INDEX,
+  PHASE_TOKENIZE,
+  PHASE_PARSE,
+  PHASE_CHECK,
+  PHASE_PRINT,
+  PHASE_SELECT,
+  PHASE_SCAN,
+  PHASE_RECORD,
+  PHASE_SPLIT,
+  PHASE_CHECKPOINTS,
+  PHASE_STATEMENT
+} phase_t;
+
+// The number of threads that split parses use.
+#define BENCH_SPLIT 4
+
+static index_t structure;
+static statements_t statements;
+static checkpoints_t checkpoints;
+
+static measurement_t measure(parser_t *parser, counters_t *counters, corpus_t *corpus, phase_t phase) {
+  measurement_t best = { .seconds = -1 };
+
+  for (int run = 0; run < BENCH_RUNS; run++) {
+    measurement_t measurement = { .tokens = 0 };
+    double start = now();
+    counters_start(counters);
+
+    switch (phase) {
+      case PHASE_ENCODE:
+        packing.size = packed_encode(packing.tokens, packing.count, packing.packed);
+        break;
+      case PHASE_DECODE:
+        measurement.tokens = unpack_tokens();
+        break;
+      case PHASE_INDEX:
+        index_build(&structure, corpus->size, corpus->source);
+        break;
+      case PHASE_TOKENIZE:
+        parser_tokenize(parser, corpus->size, corpus->source, count_token, &measurement.tokens);
+        break;
+      case PHASE_PARSE:
+        parser_parse(parser, corpus->size, corpus->source, &noop);
+        break;
+      case PHASE_CHECK:
+        parser_check(parser, corpus->size, corpus->source);
+        break;
+      case PHASE_PRINT:
+        parser_parse(parser, corpus->size, corpus->source, &printing);
+        break;
+      case PHASE_SELECT:
+        parser_parse(parser, corpus->size, corpus->source, &selective);
+        break;
+      case PHASE_SCAN:
+        statements_scan(&statements, corpus->size, corpus->source);
+        break;
+      case PHASE_RECORD: {
+        size_t count;
+        parser_record(parser, corpus->size, corpus->source, &count);
+        break;
+      }
+      case PHASE_SPLIT: {
+        size_t count;
+        parser_record_split(parser, corpus->size, corpus->source, BENCH_SPLIT, &count);
+        break;
+      }
+      case PHASE_CHECKPOINTS:
+        checkpoints_build(&checkpoints, corpus->size, corpus->source);
+        break;
+      case PHASE_STATEMENT: {
+        size_t count;
+        parser_record_statement(parser, corpus->size, corpus->source, &checkpoints, corpus->size / 2, &count);
+        break;
+      }
+    }
+
+    counters_stop(counters, &measurement.counts);
+    measurement.seconds = now() - start;
+
+    if (best.seconds < 0 || measurement.seconds < best.seconds) best = measurement;
+  }
+
+  return best;
+}
+
+static void report(const char *phase, corpus_t *corpus, measurement_t *measurement, size_t tokens) {
+  printf(
+    "%-10s %-12s %10zu %10zu %9.1f %9.2f",
+    phase,
+    corpus->name,
+    corpus->size,
+    tokens,
+    corpus->size / measurement->seconds / 1e6,
+    measurement->seconds * 1e9 / tokens
+  );
+
+  // Cycles are per byte, and everything else is per token.
+  const long long *values = measurement->counts.values;
+
+  if (values[COUNTER_CYCLES] >= 0) {
+    printf(" %9.3f", (double) values[COUNTER_CYCLES] / corpus->size);
+  } else {
+    printf(" %9s", "n/a");
+  }
+
+  for (counter_type_t type = COUNTER_INSTRUCTIONS; type < COUNTER_MAXIMUM; type++) {
+    if (values[type] >= 0) {
+      printf(" %10.3f", (double) values[type] / tokens);
+    } else {
+      printf(" %10s", "n/a");
+    }
+  }
+
+  printf("\n");
+}
+
+static int compare_names(const void *left, const void *right) {
+  return strcmp(((const corpus_t *) left)->name, ((const corpus_t *) right)->name);
+}
+
+// Replays the slowest inputs that the performance fuzzer has found (see
+// fuzz/perf_fuzz.c), each against a budget of BENCH_REPLAY_BUDGET times the
+// given time per byte. Returns the number of inputs that went over, which are
+// flagged in the output.
+static size_t replay(parser_t *parser, counters_t *counters, double baseline) {
+  DIR *dir = opendir(BENCH_REPLAY);
+  if (dir == NULL) return 0;
+
+  corpus_t corpora[BENCH_REPLAY_MAXIMUM];
+  size_t count = 0;
+  struct dirent *entry;
+
+  while (count < BENCH_REPLAY_MAXIMUM && (entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.') continue;
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", BENCH_REPLAY, entry->d_name);
+
+    corpora[count] = corpus_read(path);
+    corpora[count++].name = strdup(entry->d_name);
+  }
+
+  closedir(dir);
+  qsort(corpora, count, sizeof(corpus_t), compare_names);
+
+  // Most of these inputs are full of syntax errors, which the parser reports
+  // on stderr.
+  if (freopen("/dev/null", "w", stderr) == NULL) return 0;
+
+  double budget = baseline * BENCH_REPLAY_BUDGET;
+  size_t over = 0;
+
+  for (size_t index = 0; index < count; index++) {
+    measurement_t parsed = measure(parser, counters, &corpora[index], PHASE_PARSE);
+    double nanoseconds = parsed.seconds * 1e9 / corpora[index].size;
+
+    printf(
+      "%-10s %-24s %10zu %9.1f %9.2f ns/byte %9.2f budget%s\n",
+      "replay",
+      corpora[index].name,
+      corpora[index].size,
+      corpora[index].size / parsed.seconds / 1e6,
+      nanoseconds,
+      budget,
+      nanoseconds > budget ? " OVER" : ""
+    );
+
+    if (nanoseconds > budget) over++;
+
+    free((char *) corpora[index].name);
+    free(corpora[index].source);
+  }
+
+  return over;
+}
+
+int main(int argc, char **argv) {
+  static const char *operators[] = {
+    "+", "-", "*", "/", "%", "**", "<<", ">>", "&", "|", "^", "&&", "||",
+    "==", "!=", "===", "=~", "!~", "<=>", "<", "<=", ">", ">=", "..", "...",
+    "+=", "-=", "*=", "/=", "%=", "**=", "<<=", ">>=", "&=", "|=", "^=",
+    "&&=", "||="
+  };
+
+  static const char *mixed[] = {
+    "+ [1, 2, $x] -", "* (baz + 1) /", "&& not", "|| defined?", "== 12345 +",
+    "if", "rescue", "? 1 :"
+  };
+
+  corpus_t corpora[16];
+  size_t count = 0;
+
+  if (argc > 1) {
+    for (int index = 1; index < argc && count < 16; index++) {
+      corpora[count++] = corpus_read(argv[index]);
+    }
+  } else {
+    corpora[count++] = corpus_generate("operators", operators, sizeof(operators) / sizeof(const char *), 8);
+    corpora[count++] = corpus_generate("mixed", mixed, sizeof(mixed) / sizeof(const char *), 4);
+  }
+
+  counters_t counters;
+  if (!counters_open(&counters)) {
+    fprintf(stderr, "Hardware counters are unavailable: %s\n", strerror(counters.error));
+  }
+
+  printing = printer;
+  printing.data = fopen("/dev/null", "w");
+  if (printing.data == NULL) {
+    perror("/dev/null");
+    return EXIT_FAILURE;
+  }
+
+  // The corpora are padded, so the copy rows show what the checked path for
+  // unpadded sources costs.
+  parser_t *parser = parser_create(NULL, PARSER_OPTION_PADDED);
+  parser_t *copied = parser_create(NULL, PARSER_OPTION_NONE);
+  parser_t *indexed = parser_create(NULL, PARSER_OPTION_PADDED | PARSER_OPTION_INDEX);
+  parser_t *pipelined = parser_create(NULL, PARSER_OPTION_PADDED | PARSER_OPTION_PIPELINED);
+
+  // A deadline that's never reached, to show what checking for it costs.
+  parser_t *deadlined = parser_create(NULL, PARSER_OPTION_PADDED);
+  parser_set_deadline(deadlined, UINT64_MAX);
+
+  printf(
+    "%-10s %-12s %10s %10s %9s %9s %9s %10s %10s %10s %10s\n",
+    "phase", "corpus", "bytes", "tokens", "MB/s", "ns/token", "cyc/byte", "insns/tok", "bmiss/tok", "l1dm/tok", "llcm/tok"
+  );
+
+  // The slowest time per byte of the large corpora, which the replayed inputs
+  // are budgeted against.
+  double baseline = 0;
+
+  for (size_t index = 0; index < count; index++) {
+    measurement_t lexed = measure(parser, &counters, &corpora[index], PHASE_TOKENIZE);
+    report("tokenize", &corpora[index], &lexed, lexed.tokens);
+
+    measurement_t parsed = measure(parser, &counters, &corpora[index], PHASE_PARSE);
+    report("parse", &corpora[index], &parsed, lexed.tokens);
+
+    double nanoseconds = parsed.seconds * 1e9 / corpora[index].size;
+    if (nanoseconds > baseline) baseline = nanoseconds;
+
+    measurement_t parsed_deadlined = measure(deadlined, &counters, &corpora[index], PHASE_PARSE);
+    report("parse+d", &corpora[index], &parsed_deadlined, lexed.tokens);
+
+    // The copy of the grammar that doesn't build nodes, against parsing with
+    // a visitor that does nothing.
+    measurement_t checked = measure(parser, &counters, &corpora[index], PHASE_CHECK);
+    report("check", &corpora[index], &checked, lexed.tokens);
+
+    // The full printer against a visitor that only wants two kinds of node.
+    measurement_t printed = measure(parser, &counters, &corpora[index], PHASE_PRINT);
+    report("print", &corpora[index], &printed, lexed.tokens);
+
+    measurement_t selected = measure(parser, &counters, &corpora[index], PHASE_SELECT);
+    report("select", &corpora[index], &selected, lexed.tokens);
+
+    // Recording with the top-level statements split across threads, against
+    // recording in one go, along with the scan that finds the statements.
+    measurement_t scanned = measure(parser, &counters, &corpora[index], PHASE_SCAN);
+    report("scan", &corpora[index], &scanned, lexed.tokens);
+
+    measurement_t recorded = measure(parser, &counters, &corpora[index], PHASE_RECORD);
+    report("record", &corpora[index], &recorded, lexed.tokens);
+
+    measurement_t split = measure(parser, &counters, &corpora[index], PHASE_SPLIT);
+    report("split", &corpora[index], &split, lexed.tokens);
+
+    // Building the checkpoints, and then recording only the statement in the
+    // middle from them. The rates for the statement are against the whole
+    // corpus, so they grow with its size instead of staying flat.
+    measurement_t checkpointed = measure(parser, &counters, &corpora[index], PHASE_CHECKPOINTS);
+    report("checkpoint", &corpora[index], &checkpointed, lexed.tokens);
+
+    measurement_t statement = measure(parser, &counters, &corpora[index], PHASE_STATEMENT);
+    report("statement", &corpora[index], &statement, lexed.tokens);
+
+    measurement_t lexed_copied = measure(copied, &counters, &corpora[index], PHASE_TOKENIZE);
+    report("tokenize+c", &corpora[index], &lexed_copied, lexed.tokens);
+
+    measurement_t parsed_copied = measure(copied, &counters, &corpora[index], PHASE_PARSE);
+    report("parse+c", &corpora[index], &parsed_copied, lexed.tokens);
+
+    // Lexing on its own thread. Tokenizing never hands off to another thread,
+    // so its row is the floor that the pipelined parse works toward on
+    // machines with a spare core (with one core, the parse only gets slower).
+    measurement_t lexed_pipelined = measure(pipelined, &counters, &corpora[index], PHASE_TOKENIZE);
+    report("tokenize+p", &corpora[index], &lexed_pipelined, lexed.tokens);
+
+    measurement_t parsed_pipelined = measure(pipelined, &counters, &corpora[index], PHASE_PARSE);
+    report("parse+p", &corpora[index], &parsed_pipelined, lexed.tokens);
+
+    // Encoding and decoding the packed token format, from and to an array of
+    // tokens that has already been lexed.
+    packing = (packing_t) {
+      .source = corpora[index].source,
+      .tokens = malloc(lexed.tokens * sizeof(packed_token_t)),
+      .packed = malloc(packed_bound(lexed.tokens))
+    };
+    parser_tokenize(parser, corpora[index].size, corpora[index].source, pack_token, &packing);
+
+    measurement_t encoded = measure(parser, &counters, &corpora[index], PHASE_ENCODE);
+    report("encode", &corpora[index], &encoded, lexed.tokens);
+
+    measurement_t decoded = measure(parser, &counters, &corpora[index], PHASE_DECODE);
+    report("decode", &corpora[index], &decoded, lexed.tokens);
+
+    printf(
+      "%-10s %-12s %10zu %10zu %9.1f %9.2f bytes/token\n",
+      "packed",
+      corpora[index].name,
+      packing.size,
+      decoded.tokens,
+      packing.size / decoded.seconds / 1e6,
+      (double) packing.size / lexed.tokens
+    );
+
+    free(packing.tokens);
+    free(packing.packed);
+
+    // The structural index on its own, and then lexing and parsing with it
+    // built up front (the times include building it).
+    measurement_t built = measure(parser, &counters, &corpora[index], PHASE_INDEX);
+    report("index", &corpora[index], &built, lexed.tokens);
+
+    measurement_t lexed_indexed = measure(indexed, &counters, &corpora[index], PHASE_TOKENIZE);
+    report("tokenize+i", &corpora[index], &lexed_indexed, lexed.tokens);
+
+    measurement_t parsed_indexed = measure(indexed, &counters, &corpora[index], PHASE_PARSE);
+    report("parse+i", &corpora[index], &parsed_indexed, lexed.tokens);
+  }
+
+  size_t over = replay(parser, &counters, baseline);
+  if (over > 0) printf("replay: %zu inputs over budget\n", over);
+
+  counters_close(&counters);
+  fclose(printing.data);
+
+  index_free(&structure);
+  statements_free(&statements);
+  checkpoints_free(&checkpoints);
+  parser_destroy(deadlined);
+  parser_destroy(pipelined);
+  parser_destroy(indexed);
+  parser_destroy(copied);
+  parser_destroy(parser);
+  for (size_t index = 0; index < count; index++) free(corpora[index].source);
+
+  return over > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
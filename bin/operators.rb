@@ -0,0 +1,212 @@
+# frozen_string_literal: true
+
+# This script generates src/operators.h, which contains the lexer for operators
+# and punctuation. Everything is derived from the table below, so to add a new
+# operator add it here and rerun `make src/operators.h`.
+#
+# The operators form a trie where every prefix of an operator is itself an
+# operator, so the trie is already a DFA that finds the longest match without
+# ever backtracking. It's emitted twice: once as a threaded state machine that
+# dispatches with computed gotos (for compilers that support them), and once as
+# nested switch statements as a fallback.
+
+OPERATORS = {
+  "," => "COMMA",
+  ";" => "SEMICOLON",
+  ":" => "COLON",
+  "?" => "QUESTION_MARK",
+  "(" => "LEFT_PARENTHESIS",
+  ")" => "RIGHT_PARENTHESIS",
+  "[" => "LEFT_BRACKET",
+  "]" => "RIGHT_BRACKET",
+  "~" => "TILDE",
+  "=" => "EQUAL",
+  "=~" => "EQUAL_TILDE",
+  "==" => "DOUBLE_EQUAL",
+  "===" => "TRIPLE_EQUAL",
+  "<" => "LESS",
+  "<<" => "SHIFT_LEFT",
+  "<<=" => "SHIFT_LEFT_EQUAL",
+  "<=" => "LESS_EQUAL",
+  "<=>" => "COMPARE",
+  ">" => "GREATER",
+  ">>" => "SHIFT_RIGHT",
+  ">>=" => "SHIFT_RIGHT_EQUAL",
+  ">=" => "GREATER_EQUAL",
+  "+" => "PLUS",
+  "+=" => "PLUS_EQUAL",
+  "-" => "MINUS",
+  "-=" => "MINUS_EQUAL",
+  "*" => "STAR",
+  "**" => "DOUBLE_STAR",
+  "**=" => "DOUBLE_STAR_EQUAL",
+  "*=" => "STAR_EQUAL",
+  "/" => "SLASH",
+  "/=" => "SLASH_EQUAL",
+  "%" => "PERCENT",
+  "%=" => "PERCENT_EQUAL",
+  "&" => "AMPERSAND",
+  "&&" => "DOUBLE_AMPERSAND",
+  "&&=" => "DOUBLE_AMPERSAND_EQUAL",
+  "&=" => "AMPERSAND_EQUAL",
+  "|" => "PIPE",
+  "||" => "DOUBLE_PIPE",
+  "||=" => "DOUBLE_PIPE_EQUAL",
+  "|=" => "PIPE_EQUAL",
+  "^" => "CARET",
+  "^=" => "CARET_EQUAL",
+  "." => "EOF", # this is temporary
+  ".." => "DOUBLE_DOT",
+  "..." => "TRIPLE_DOT",
+  "!" => "BANG",
+  "!~" => "BANG_TILDE",
+  "!=" => "BANG_EQUAL"
+}
+
+OPERATORS.each_key do |operator|
+  1.upto(operator.length - 1) do |length|
+    next if OPERATORS.key?(operator[0, length])
+    abort "#{operator[0, length]} must be an operator for #{operator} to be lexed"
+  end
+end
+
+# State 0 is the start state and never accepts. Every other state corresponds
+# to the operator that has been read to get there.
+states = [""] + OPERATORS.keys
+state_ids = states.each_with_index.to_h
+
+# Bytes that lead to exactly the same transitions from every state share a
+# class, and bytes that never appear in an operator are all in class 0.
+columns = Hash.new { |hash, key| hash[key] = [] }
+(0..255).each do |byte|
+  column = states.map { |state| state_ids.fetch(state + byte.chr, 0) }
+  columns[column] << byte
+end
+
+zero = Array.new(states.length, 0)
+classes = [zero] + (columns.keys - [zero])
+class_ids = classes.each_with_index.to_h
+byte_classes = (0..255).map do |byte|
+  class_ids.fetch(columns.find { |_, bytes| bytes.include?(byte) }.first)
+end
+
+def literal(byte)
+  case byte
+  when "'" then "'\\''"
+  when "\\" then "'\\\\'"
+  else "'#{byte}'"
+  end
+end
+
+# Emits the fallback as nested switch statements, one level per byte.
+def emit_switch(output, prefix, depth)
+  children = OPERATORS.keys.select { |key| key.length == prefix.length + 1 && key.start_with?(prefix) }
+  indent = "  " * depth
+  token = "TOKEN_#{OPERATORS.fetch(prefix)}"
+
+  if children.empty?
+    output << "#{indent}return #{token};\n"
+    return
+  end
+
+  output << "#{indent}switch (*parser->current.end) {\n"
+  children.each do |child|
+    output << "#{indent}  case #{literal(child[-1])}:\n"
+    output << "#{indent}    parser->current.end++;\n"
+    emit_switch(output, child, depth + 2)
+  end
+  output << "#{indent}  default:\n"
+  output << "#{indent}    return #{token};\n"
+  output << "#{indent}}\n"
+end
+
+output = +""
+output << <<~C
+  // This file is generated by bin/operators.rb. Do not edit it directly.
+
+  // Use the threaded state machine wherever computed gotos are supported,
+  // unless the switch has been asked for explicitly.
+  #if defined(__GNUC__) && !defined(PARSE_OPERATOR_SWITCH)
+  #define OPERATOR_THREADED
+  #endif
+
+  #ifdef OPERATOR_THREADED
+  #define OPERATOR_STATES #{states.length}
+  #define OPERATOR_CLASSES #{classes.length}
+
+  // The byte class of every byte, where class 0 never continues an operator.
+  static const uint8_t operator_classes[256] = {
+C
+
+byte_classes.each_slice(16) { |slice| output << "  #{slice.join(", ")},\n" }
+output << "};\n\n"
+
+output << "// The state to move to from each state on each byte class, or 0 if the\n"
+output << "// operator ends before the byte.\n"
+output << "static const uint8_t operator_transitions[OPERATOR_STATES][OPERATOR_CLASSES] = {\n"
+states.each_with_index do |state, id|
+  row = classes.map { |column| column[id] }
+  output << "  { #{row.join(", ")} }, // #{state.empty? ? "start" : state}\n"
+end
+output << "};\n\n"
+
+output << "// The token that is returned when the operator ends in each state.\n"
+output << "static const uint8_t operator_tokens[OPERATOR_STATES] = {\n"
+output << "  TOKEN_EOF,\n"
+OPERATORS.each { |operator, name| output << "  TOKEN_#{name}, // #{operator}\n" }
+output << "};\n"
+output << "#endif\n\n"
+
+first = OPERATORS.keys.select { |key| key.length == 1 }
+output << "// The case labels for every byte that starts an operator.\n"
+output << "#define OPERATOR_CASES \\\n"
+first.each_slice(8).with_index do |slice, index|
+  separator = index == (first.length - 1) / 8 ? "\n" : " \\\n"
+  output << "  #{slice.map { |byte| "case #{literal(byte)}:" }.join(" ")}#{separator}"
+end
+output << "\n"
+
+output << <<~C
+  // Lexes the rest of an operator whose first byte has already been consumed
+  // and returns its type.
+  static inline token_type_t lex_operator(parser_t *parser) {
+  #ifdef OPERATOR_THREADED
+    // Each state consumes the next byte and jumps straight to the state for its
+    // class. When there's no transition, we land on accept, which gives the
+    // byte back and returns the token for the last state we were in. Having an
+    // indirect jump per state (instead of one shared one) gives the branch
+    // predictor a separate history for each.
+    static void *const labels[OPERATOR_STATES] = {
+      &&accept,
+C
+(1...states.length).each { |id| output << "    &&state_#{id},\n" }
+output << "  };\n\n"
+output << "  uint8_t state = 0;\n"
+output << "  goto *labels[operator_transitions[0][operator_classes[(unsigned char) parser->current.end[-1]]]];\n\n"
+(1...states.length).each do |id|
+  output << "state_#{id}: // #{states[id]}\n"
+
+  # States that can't be extended any further return right away.
+  if OPERATORS.keys.none? { |key| key.length == states[id].length + 1 && key.start_with?(states[id]) }
+    output << "  return TOKEN_#{OPERATORS.fetch(states[id])};\n"
+  else
+    output << "  state = #{id};\n"
+    output << "  goto *labels[operator_transitions[#{id}][operator_classes[(unsigned char) *parser->current.end++]]];\n"
+  end
+end
+output << "accept:\n"
+output << "  parser->current.end--;\n"
+output << "  return operator_tokens[state];\n"
+output << "#else\n"
+output << "  switch (parser->current.end[-1]) {\n"
+first.each do |byte|
+  output << "    case #{literal(byte)}:\n"
+  emit_switch(output, byte, 3)
+end
+output << "    default:\n"
+output << "      return TOKEN_EOF;\n"
+output << "  }\n"
+output << "#endif\n"
+output << "}\n"
+
+print output
@@ -0,0 +1,601 @@
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+begin
+a
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
+end
@@ -0,0 +1,342 @@
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "parse.h"
+
+// Inputs shorter than this are dominated by the fixed cost of a parse, so
+// their time per byte isn't meaningful and they're never kept as slow.
+#define PERF_FUZZ_MINIMUM 64
+
+// The largest input that the offline driver will build.
+#define PERF_FUZZ_MAXIMUM 4096
+
+// The number of times each input is parsed. The fastest run is kept.
+#define PERF_FUZZ_RUNS 3
+
+// The number of slowest inputs the offline driver keeps and writes out.
+#define PERF_FUZZ_KEEP 16
+
+// When linked with the GNU linker's --wrap (see the perf-fuzz target in the
+// Makefile), every allocation the parser makes goes through these so that
+// they can be counted. Otherwise allocations are reported as unavailable.
+#ifdef PERF_FUZZ_WRAP
+static size_t allocations;
+
+void * __real_malloc(size_t size);
+void * __real_calloc(size_t count, size_t size);
+void * __real_realloc(void *pointer, size_t size);
+
+void * __wrap_malloc(size_t size) {
+  allocations++;
+  return __real_malloc(size);
+}
+
+void * __wrap_calloc(size_t count, size_t size) {
+  allocations++;
+  return __real_calloc(count, size);
+}
+
+void * __wrap_realloc(void *pointer, size_t size) {
+  allocations++;
+  return __real_realloc(pointer, size);
+}
+#endif
+
+typedef struct {
+  double nanoseconds;   // the time per byte of input
+  double allocations;   // the allocations per byte of input, or -1
+} cost_t;
+
+// Parses the input with a fresh handle (so that every allocation it needs is
+// counted) and returns what it cost per byte. The input is copied into a
+// padded buffer up front so that the copy isn't part of the measurement.
+static cost_t perf_measure(const uint8_t *data, size_t size) {
+  char *source = calloc(1, size + PARSE_PADDING);
+  if (source == NULL) return (cost_t) { .nanoseconds = 0, .allocations = -1 };
+  if (size > 0) memcpy(source, data, size);
+
+  uint64_t best = UINT64_MAX;
+  cost_t cost = { .allocations = -1 };
+
+  for (int run = 0; run < PERF_FUZZ_RUNS; run++) {
+#ifdef PERF_FUZZ_WRAP
+    allocations = 0;
+#endif
+    uint64_t start = trace_now();
+
+    parser_t *parser = parser_create(NULL, PARSER_OPTION_PADDED);
+    if (parser != NULL) {
+      size_t count;
+      parser_record(parser, (off_t) size, source, &count);
+      parser_destroy(parser);
+    }
+
+    uint64_t elapsed = trace_now() - start;
+    if (elapsed < best) best = elapsed;
+
+#ifdef PERF_FUZZ_WRAP
+    cost.allocations = (double) allocations / (size == 0 ? 1 : size);
+#endif
+  }
+
+  free(source);
+  cost.nanoseconds = (double) best / (size == 0 ? 1 : size);
+  return cost;
+}
+
+// Writes an input into the given directory, named by a hash of its contents
+// so that the same input always gets the same name (its cost depends on the
+// machine it was measured on, so that's left out).
+static void perf_save(const char *directory, const uint8_t *data, size_t size) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t index = 0; index < size; index++) {
+    hash = (hash ^ data[index]) * 0x100000001b3ULL;
+  }
+
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/slow-%016llx.rb", directory, (unsigned long long) hash);
+
+  FILE *file = fopen(path, "wb");
+  if (file == NULL) return;
+
+  fwrite(data, 1, size, file);
+  fclose(file);
+}
+
+// The libFuzzer entry point. libFuzzer steers by coverage, so alongside that
+// this keeps its own record of the worst time per byte it has seen and saves
+// each input that beats it into $PERF_FUZZ_OUTPUT (if it's set).
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  static double record = 0;
+
+  cost_t cost = perf_measure(data, size);
+  const char *output = getenv("PERF_FUZZ_OUTPUT");
+
+  if (size >= PERF_FUZZ_MINIMUM && cost.nanoseconds > record) {
+    record = cost.nanoseconds;
+    if (output != NULL) perf_save(output, data, size);
+  }
+
+  return 0;
+}
+
+#ifdef PERF_FUZZ_MAIN
+
+// An input in the offline driver's population, along with what it costs.
+typedef struct {
+  uint8_t *data;
+  size_t size;
+  cost_t cost;
+} entry_t;
+
+// Pieces of Ruby that the mutator splices in. They're biased toward the
+// constructs that recurse: groups, arrays, unary operators, and blocks.
+static const char *pieces[] = {
+  "(", ")", "[", "]", "[]", ", ", "\n", ";", " ", "-", "!", "not ", "defined? ",
+  "begin\n", "ensure\n", "end\n", "while a\n", "until a\n", " ? ", " : ", " = ",
+  " + ", " ** ", " && ", " if ", " rescue ", "foo", "$1", "$_", "1", "a[", "..."
+};
+
+// A small deterministic generator so that runs can be reproduced.
+static uint64_t next_random(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+// Produces a new input from an existing one, either by splicing in a piece,
+// deleting a slice, or repeating a slice (which is what finds inputs whose
+// cost grows with nesting or length).
+static size_t mutate(uint64_t *state, const entry_t *entry, uint8_t *output) {
+  size_t size = entry->size;
+  memcpy(output, entry->data, size);
+
+  size_t position = size == 0 ? 0 : next_random(state) % (size + 1);
+
+  switch (next_random(state) % 4) {
+    case 0: {
+      const char *piece = pieces[next_random(state) % (sizeof(pieces) / sizeof(pieces[0]))];
+      size_t length = strlen(piece);
+      if (size + length > PERF_FUZZ_MAXIMUM) break;
+
+      memmove(output + position + length, output + position, size - position);
+      memcpy(output + position, piece, length);
+      size += length;
+      break;
+    }
+    case 1: {
+      size_t length = size - position == 0 ? 0 : next_random(state) % (size - position) + 1;
+      memmove(output + position, output + position + length, size - position - length);
+      size -= length;
+      break;
+    }
+    default: {
+      size_t length = size - position == 0 ? 0 : next_random(state) % (size - position) + 1;
+      if (length > 64) length = 64;
+
+      while (size + length <= PERF_FUZZ_MAXIMUM) {
+        memmove(output + position + length, output + position, size - position);
+        memcpy(output + position, output + position + length, length);
+        size += length;
+        if (next_random(state) % 4 == 0) break;
+      }
+      break;
+    }
+  }
+
+  return size;
+}
+
+// Reads every file in the directory as a seed. Returns the number of seeds,
+// which are left in a newly allocated array.
+static size_t load(const char *directory, entry_t **entries) {
+  *entries = NULL;
+
+  DIR *dir = opendir(directory);
+  if (dir == NULL) return 0;
+
+  size_t count = 0;
+  size_t capacity = 0;
+  struct dirent *entry;
+
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.') continue;
+
+    if (count == capacity) {
+      capacity = capacity == 0 ? 64 : capacity * 2;
+      entry_t *resized = realloc(*entries, capacity * sizeof(entry_t));
+      if (resized == NULL) break;
+      *entries = resized;
+    }
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) continue;
+
+    uint8_t *data = malloc(PERF_FUZZ_MAXIMUM);
+    if (data == NULL) {
+      fclose(file);
+      break;
+    }
+
+    size_t size = fread(data, 1, PERF_FUZZ_MAXIMUM, file);
+    fclose(file);
+
+    (*entries)[count++] = (entry_t) { .data = data, .size = size, .cost = perf_measure(data, size) };
+  }
+
+  closedir(dir);
+  return count;
+}
+
+// Returns the index of the cheapest entry that's eligible to be replaced.
+static size_t cheapest(const entry_t *entries, size_t count) {
+  size_t result = 0;
+
+  for (size_t index = 1; index < count; index++) {
+    if (entries[index].cost.nanoseconds < entries[result].cost.nanoseconds) result = index;
+  }
+
+  return result;
+}
+
+// The offline driver. It runs a simple search that doesn't need libFuzzer:
+// starting from every input in the corpus directory, it mutates them and
+// keeps the PERF_FUZZ_KEEP new inputs with the highest time per byte, writing
+// them into the output directory when it's done. The corpus itself is only
+// read, so that the inputs checked in as regression cases stay put. Anything
+// worth keeping is copied into it by hand.
+//
+//     perf-fuzz <corpus directory> <output directory> [iterations]
+//
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    fprintf(stderr, "Usage: %s <corpus> <output> [iterations]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  const char *output = argv[2];
+  unsigned long iterations = argc > 3 ? strtoul(argv[3], NULL, 10) : 20000;
+
+  if (mkdir(output, 0777) != 0 && errno != EEXIST) {
+    perror(output);
+    return EXIT_FAILURE;
+  }
+
+  // The parser reports syntax errors on stderr, which most of these inputs
+  // are full of.
+  if (freopen("/dev/null", "w", stderr) == NULL) return EXIT_FAILURE;
+
+  entry_t *seeds;
+  size_t seed_count = load(argv[1], &seeds);
+
+  if (seed_count == 0) {
+    static const char seed[] = "foo = [1, 2, $x] + (bar - 1) if baz\n";
+    uint8_t *data = malloc(PERF_FUZZ_MAXIMUM);
+    seeds = malloc(sizeof(entry_t));
+    if (data == NULL || seeds == NULL) return EXIT_FAILURE;
+
+    memcpy(data, seed, sizeof(seed) - 1);
+    seeds[seed_count++] = (entry_t) { .data = data, .size = sizeof(seed) - 1, .cost = perf_measure(data, sizeof(seed) - 1) };
+  }
+
+  // The seeds are only ever parents. New inputs go into the kept entries,
+  // where the cheapest is replaced once they're full.
+  entry_t kept[PERF_FUZZ_KEEP];
+  size_t count = 0;
+
+  uint64_t state = 0x9e3779b97f4a7c15ULL;
+  uint8_t *candidate = malloc(PERF_FUZZ_MAXIMUM);
+  if (candidate == NULL) return EXIT_FAILURE;
+
+  for (unsigned long iteration = 0; iteration < iterations; iteration++) {
+    size_t choice = next_random(&state) % (seed_count + count);
+    const entry_t *parent = choice < seed_count ? &seeds[choice] : &kept[choice - seed_count];
+    size_t size = mutate(&state, parent, candidate);
+
+    // Inputs that are too small to judge are still worth growing from.
+    cost_t cost = size < PERF_FUZZ_MINIMUM ? (cost_t) { 0, -1 } : perf_measure(candidate, size);
+
+    if (count < PERF_FUZZ_KEEP) {
+      uint8_t *data = malloc(PERF_FUZZ_MAXIMUM);
+      if (data == NULL) break;
+
+      memcpy(data, candidate, size);
+      kept[count++] = (entry_t) { .data = data, .size = size, .cost = cost };
+    } else if (size >= PERF_FUZZ_MINIMUM) {
+      entry_t *replaced = &kept[cheapest(kept, count)];
+
+      if (cost.nanoseconds > replaced->cost.nanoseconds) {
+        memcpy(replaced->data, candidate, size);
+        replaced->size = size;
+        replaced->cost = cost;
+      }
+    }
+  }
+
+  for (size_t index = 0; index < count; index++) {
+    if (kept[index].size < PERF_FUZZ_MINIMUM) continue;
+
+    perf_save(output, kept[index].data, kept[index].size);
+    printf("%8zu bytes %9.2f ns/byte", kept[index].size, kept[index].cost.nanoseconds);
+
+    if (kept[index].cost.allocations >= 0) {
+      printf(" %9.3f allocs/byte\n", kept[index].cost.allocations);
+    } else {
+      printf(" %9s allocs/byte\n", "n/a");
+    }
+  }
+
+  for (size_t index = 0; index < seed_count; index++) free(seeds[index].data);
+  for (size_t index = 0; index < count; index++) free(kept[index].data);
+  free(seeds);
+  free(candidate);
+
+  return EXIT_SUCCESS;
+}
+
+#endif
@@ -0,0 +1,4 @@
+// The syntax checker is a second copy of the parser in which every node that
+// would be visited or recorded compiles away (see PARSE_BUILDING in parse.c).
+#define PARSE_CHECK
+#include "parse.c"
@@ -0,0 +1,315 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include "cli.h"
+
+// The size of a tar header, and the unit that the data of each member is
+// padded out to.
+#define ARCHIVE_BLOCK 512
+
+// A regular .rb file in the archive. Its contents are read in place from the
+// mapping.
+typedef struct {
+  char *path;     // the path of the member, including the ustar prefix
+  size_t offset;  // the offset of the contents in the mapping
+  size_t size;    // the number of bytes in the contents
+  bool padded;    // whether the contents are followed by PARSE_PADDING zero bytes
+} member_t;
+
+struct archive {
+  char *mapping;        // the whole archive, mapped read-only
+  size_t size;          // the number of bytes in the mapping
+  member_t *members;    // the members that are parsed, in archive order
+  size_t count;         // the number of members
+  size_t capacity;      // the number of members allocated
+  atomic_size_t next;   // the next member to be handed out
+};
+
+// Parses a numeric header field. These are octal digits terminated by a space
+// or a NUL, unless the high bit of the first byte is set, in which case the
+// rest of the field is a big-endian binary number (a GNU extension for sizes
+// of 8GB and up).
+static uint64_t archive_number(const char *field, size_t length) {
+  uint64_t value = 0;
+
+  if ((unsigned char) field[0] & 0x80) {
+    for (size_t index = 1; index < length; index++) {
+      value = (value << 8) | (unsigned char) field[index];
+    }
+    return value;
+  }
+
+  size_t index = 0;
+  while (index < length && field[index] == ' ') index++;
+
+  for (; index < length && field[index] >= '0' && field[index] <= '7'; index++) {
+    value = (value << 3) | (uint64_t) (field[index] - '0');
+  }
+
+  return value;
+}
+
+// Checks the header's checksum, which is the sum of its bytes with the
+// checksum field itself counted as spaces.
+static bool archive_valid(const char *header) {
+  uint64_t sum = 0;
+
+  for (size_t index = 0; index < ARCHIVE_BLOCK; index++) {
+    sum += (index >= 148 && index < 156) ? ' ' : (unsigned char) header[index];
+  }
+
+  return sum == archive_number(header + 148, 8);
+}
+
+static bool archive_zeroed(const char *bytes, size_t length) {
+  for (size_t index = 0; index < length; index++) {
+    if (bytes[index] != '\0') return false;
+  }
+  return true;
+}
+
+// Finds the path record in a pax extended header. Records look like
+// "<length> <key>=<value>\n", where the length covers the whole record.
+static char * archive_pax_path(const char *data, size_t size) {
+  size_t offset = 0;
+
+  while (offset < size) {
+    size_t length = 0;
+    size_t index = offset;
+
+    while (index < size && data[index] >= '0' && data[index] <= '9') {
+      length = length * 10 + (size_t) (data[index++] - '0');
+    }
+
+    if (length == 0 || offset + length > size || index >= size || data[index] != ' ') return NULL;
+
+    const char *record = data + index + 1;
+    size_t remaining = offset + length - (index + 1);
+
+    if (remaining > 5 && strncmp(record, "path=", 5) == 0) {
+      return strndup(record + 5, remaining - 6);
+    }
+
+    offset += length;
+  }
+
+  return NULL;
+}
+
+// Builds the path of a member out of the ustar prefix and name fields, which
+// are each NUL terminated unless they fill the field.
+static char * archive_header_path(const char *header) {
+  size_t prefix = strnlen(header + 345, 155);
+  size_t name = strnlen(header, 100);
+
+  // The prefix field is only meaningful in ustar headers.
+  if (strncmp(header + 257, "ustar", 5) != 0) prefix = 0;
+
+  char *path = malloc(prefix + name + 2);
+  if (path == NULL) return NULL;
+
+  if (prefix > 0) {
+    memcpy(path, header + 345, prefix);
+    path[prefix++] = '/';
+  }
+
+  memcpy(path + prefix, header, name);
+  path[prefix + name] = '\0';
+  return path;
+}
+
+static bool archive_ruby(const char *path) {
+  size_t length = strlen(path);
+  return length > 3 && strcmp(path + length - 3, ".rb") == 0;
+}
+
+static bool archive_push(archive_t *archive, member_t member) {
+  if (archive->count == archive->capacity) {
+    size_t capacity = archive->capacity == 0 ? 64 : archive->capacity * 2;
+    member_t *members = realloc(archive->members, capacity * sizeof(member_t));
+    if (members == NULL) return false;
+
+    archive->members = members;
+    archive->capacity = capacity;
+  }
+
+  archive->members[archive->count++] = member;
+  return true;
+}
+
+// Walks every header in the archive and collects the regular .rb members. Only
+// the headers are touched here; the contents aren't read until they're parsed.
+// Sets errno to EINVAL and returns false if the archive isn't made up of whole
+// blocks, or if a header is malformed. Since the first block then has to be a
+// valid header or the zeroed block that ends the archive, anything shorter
+// than a block isn't taken as an empty archive.
+static bool archive_walk(archive_t *archive) {
+  size_t offset = 0;
+  char *name = NULL; // the path given by a GNU long name or pax header
+
+  if (archive->size == 0 || archive->size % ARCHIVE_BLOCK != 0) {
+    errno = EINVAL;
+    return false;
+  }
+
+  while (offset + ARCHIVE_BLOCK <= archive->size) {
+    const char *header = archive->mapping + offset;
+
+    // The archive ends with two zeroed blocks, but one is enough to stop.
+    if (archive_zeroed(header, ARCHIVE_BLOCK)) break;
+
+    uint64_t size = archive_number(header + 124, 12);
+    size_t data = offset + ARCHIVE_BLOCK;
+
+    if (!archive_valid(header) || size > archive->size - data) {
+      free(name);
+      errno = EINVAL;
+      return false;
+    }
+
+    switch (header[156]) {
+      case 'L':
+        free(name);
+        name = strndup(archive->mapping + data, (size_t) size);
+        break;
+      case 'x': {
+        char *path = archive_pax_path(archive->mapping + data, (size_t) size);
+        if (path != NULL) {
+          free(name);
+          name = path;
+        }
+        break;
+      }
+      case '0':
+      case '\0': {
+        char *path = name != NULL ? name : archive_header_path(header);
+        name = NULL;
+
+        if (path == NULL) {
+          errno = ENOMEM;
+          return false;
+        }
+
+        if (!archive_ruby(path)) {
+          free(path);
+          break;
+        }
+
+        // Members are padded out to the block size with zeros, so most of them
+        // can be parsed in place. The rest go through the parser's checked path.
+        size_t end = data + (size_t) size;
+        member_t member = {
+          .path = path,
+          .offset = data,
+          .size = (size_t) size,
+          .padded = end + PARSE_PADDING <= archive->size && archive_zeroed(archive->mapping + end, PARSE_PADDING)
+        };
+
+        if (!archive_push(archive, member)) {
+          free(path);
+          errno = ENOMEM;
+          return false;
+        }
+        break;
+      }
+      default:
+        // Directories, links, and everything else are skipped, and they use
+        // up any long name that was meant for them.
+        free(name);
+        name = NULL;
+        break;
+    }
+
+    offset = data + ((size_t) size + ARCHIVE_BLOCK - 1) / ARCHIVE_BLOCK * ARCHIVE_BLOCK;
+  }
+
+  free(name);
+  return true;
+}
+
+// Maps an uncompressed tar archive and finds the .rb files in it. Returns NULL
+// with errno set if it can't be read, or with errno set to EINVAL if it isn't
+// a tar archive.
+archive_t * archive_open(const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return NULL;
+
+  struct stat sb;
+  if (fstat(fd, &sb) == -1) {
+    close(fd);
+    return NULL;
+  }
+
+  archive_t *archive = calloc(1, sizeof(archive_t));
+  if (archive == NULL) {
+    close(fd);
+    return NULL;
+  }
+
+  archive->size = (size_t) sb.st_size;
+  atomic_init(&archive->next, 0);
+
+  if (archive->size > 0) {
+    archive->mapping = mmap(NULL, archive->size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (archive->mapping == MAP_FAILED) {
+      int error = errno;
+      close(fd);
+      free(archive);
+      errno = error;
+      return NULL;
+    }
+  }
+
+  close(fd);
+
+  if (!archive_walk(archive)) {
+    int error = errno;
+    archive_close(archive);
+    errno = error;
+    return NULL;
+  }
+
+  return archive;
+}
+
+// Returns the number of members that archive_next will hand out.
+size_t archive_count(const archive_t *archive) {
+  return archive->count;
+}
+
+// Fills in the given source with the next member, pointing directly into the
+// mapping. Returns false once every member has been handed out. This is safe
+// to call from multiple threads, and the sources don't need to be released.
+bool archive_next(archive_t *archive, source_t *source) {
+  size_t index = atomic_fetch_add_explicit(&archive->next, 1, memory_order_relaxed);
+  if (index >= archive->count) return false;
+
+  const member_t *member = &archive->members[index];
+  uint64_t now = trace_now();
+
+  *source = (source_t) {
+    .path = member->path,
+    .source = archive->mapping + member->offset,
+    .size = (off_t) member->size,
+    .padded = member->padded,
+    .started = now,
+    .loaded = now
+  };
+
+  return true;
+}
+
+void archive_close(archive_t *archive) {
+  for (size_t index = 0; index < archive->count; index++) {
+    free(archive->members[index].path);
+  }
+
+  if (archive->mapping != NULL) munmap(archive->mapping, archive->size);
+  free(archive->members);
+  free(archive);
+}
@@ -0,0 +1,456 @@
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cli.h"
+
+// The version of the entry format and of what the parser produces. Bump this
+// whenever either changes, so that entries written by older builds are never
+// read back as if they were current. It seeds the hash, so old entries simply
+// stop being found and age out.
+#define CACHE_VERSION 1
+
+// Events are written exactly as they are in memory. Every field is fixed width
+// and naturally aligned, so the only thing that differs from one machine to
+// the next is byte order. It's part of the key along with the size of an
+// event, so machines that lay events out differently never share entries.
+_Static_assert(sizeof(event_t) == 32, "events are cached without padding");
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define CACHE_LAYOUT ((uint64_t) sizeof(event_t) << 1 | 1)
+#else
+#define CACHE_LAYOUT ((uint64_t) sizeof(event_t) << 1)
+#endif
+
+// Temporary files older than this many seconds are left over from a process
+// that stopped before renaming them, and are deleted when trimming.
+#define CACHE_TEMPORARY_AGE 3600
+
+// The size of an entry's header: "RBPC", version (u32), key (u64), source
+// size (u64), event count (u64), diagnostic count (u64).
+#define CACHE_HEADER 40
+
+struct cache {
+  char *directory;          // the directory that the entries live in
+  uint64_t capacity;        // the most bytes that entries can take up
+  atomic_size_t hits;       // the lookups that found an entry
+  atomic_size_t misses;     // the lookups that didn't
+  atomic_size_t stores;     // the entries that were written
+  atomic_size_t read;       // the bytes read from entries that were found
+  atomic_size_t written;    // the bytes written to new entries
+  atomic_uint_fast64_t reading; // the nanoseconds spent looking up entries
+  atomic_size_t temporary;  // a counter for naming files before they're renamed
+};
+
+// The primes of XXH64.
+#define XXH_PRIME_1 0x9e3779b185ebca87ULL
+#define XXH_PRIME_2 0xc2b2ae3d27d4eb4fULL
+#define XXH_PRIME_3 0x165667b19e3779f9ULL
+#define XXH_PRIME_4 0x85ebca77c2b2ae63ULL
+#define XXH_PRIME_5 0x27d4eb2f165667c5ULL
+
+static inline uint64_t xxh_rotate(uint64_t value, unsigned int amount) {
+  return (value << amount) | (value >> (64 - amount));
+}
+
+static inline uint64_t xxh_read64(const char *input) {
+  uint64_t value;
+  memcpy(&value, input, 8);
+  return value;
+}
+
+static inline uint64_t xxh_round(uint64_t accumulator, uint64_t input) {
+  accumulator += input * XXH_PRIME_2;
+  return xxh_rotate(accumulator, 31) * XXH_PRIME_1;
+}
+
+static inline uint64_t xxh_merge(uint64_t hash, uint64_t accumulator) {
+  hash ^= xxh_round(0, accumulator);
+  return hash * XXH_PRIME_1 + XXH_PRIME_4;
+}
+
+// XXH64 of the input with the given seed. It hashes 32 bytes per iteration in
+// four independent lanes, which runs at several GB/s, well ahead of reading
+// the source in the first place.
+static uint64_t xxh64(const char *input, size_t length, uint64_t seed) {
+  const char *end = input + length;
+  uint64_t hash;
+
+  if (length >= 32) {
+    uint64_t lanes[4] = { seed + XXH_PRIME_1 + XXH_PRIME_2, seed + XXH_PRIME_2, seed, seed - XXH_PRIME_1 };
+
+    for (; input + 32 <= end; input += 32) {
+      for (size_t lane = 0; lane < 4; lane++) {
+        lanes[lane] = xxh_round(lanes[lane], xxh_read64(input + lane * 8));
+      }
+    }
+
+    hash = xxh_rotate(lanes[0], 1) + xxh_rotate(lanes[1], 7) + xxh_rotate(lanes[2], 12) + xxh_rotate(lanes[3], 18);
+    for (size_t lane = 0; lane < 4; lane++) hash = xxh_merge(hash, lanes[lane]);
+  } else {
+    hash = seed + XXH_PRIME_5;
+  }
+
+  hash += (uint64_t) length;
+
+  for (; input + 8 <= end; input += 8) {
+    hash ^= xxh_round(0, xxh_read64(input));
+    hash = xxh_rotate(hash, 27) * XXH_PRIME_1 + XXH_PRIME_4;
+  }
+
+  if (input + 4 <= end) {
+    uint32_t word;
+    memcpy(&word, input, 4);
+    hash ^= (uint64_t) word * XXH_PRIME_1;
+    hash = xxh_rotate(hash, 23) * XXH_PRIME_2 + XXH_PRIME_3;
+    input += 4;
+  }
+
+  for (; input < end; input++) {
+    hash ^= (uint64_t) (unsigned char) *input * XXH_PRIME_5;
+    hash = xxh_rotate(hash, 11) * XXH_PRIME_1;
+  }
+
+  hash ^= hash >> 33;
+  hash *= XXH_PRIME_2;
+  hash ^= hash >> 29;
+  hash *= XXH_PRIME_3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+// Opens (creating if needed) the cache in the given directory, which is capped
+// at the given number of bytes. Returns NULL with errno set if the directory
+// can't be created.
+cache_t * cache_open(const char *directory, uint64_t capacity) {
+  if (mkdir(directory, 0777) == -1 && errno != EEXIST) return NULL;
+
+  cache_t *cache = calloc(1, sizeof(cache_t));
+  if (cache == NULL) return NULL;
+
+  cache->directory = strdup(directory);
+  if (cache->directory == NULL) {
+    free(cache);
+    return NULL;
+  }
+
+  cache->capacity = capacity;
+  return cache;
+}
+
+// Returns the key of the given kind of result for a source. The kind, the
+// cache version, and the layout of events are part of the seed, so each kind
+// has its own entries.
+uint64_t cache_key(cache_kind_t kind, const char *source, size_t size) {
+  return xxh64(source, size, (CACHE_LAYOUT << 16) | ((uint64_t) CACHE_VERSION << 8) | (uint64_t) kind);
+}
+
+// Entries are spread over 256 subdirectories by the top byte of their key so
+// that no one directory gets too large.
+static void cache_path(const cache_t *cache, uint64_t key, char *path, size_t length) {
+  snprintf(path, length, "%s/%02x/%014llx", cache->directory, (unsigned int) (key >> 56), (unsigned long long) (key & 0xffffffffffffffULL));
+}
+
+static inline void cache_write_u32(uint8_t *output, uint32_t value) {
+  for (size_t index = 0; index < 4; index++) output[index] = (uint8_t) (value >> (index * 8));
+}
+
+static inline void cache_write_u64(uint8_t *output, uint64_t value) {
+  for (size_t index = 0; index < 8; index++) output[index] = (uint8_t) (value >> (index * 8));
+}
+
+static inline uint32_t cache_read_u32(const uint8_t *input) {
+  uint32_t value = 0;
+  for (size_t index = 0; index < 4; index++) value |= (uint32_t) input[index] << (index * 8);
+  return value;
+}
+
+static inline uint64_t cache_read_u64(const uint8_t *input) {
+  uint64_t value = 0;
+  for (size_t index = 0; index < 8; index++) value |= (uint64_t) input[index] << (index * 8);
+  return value;
+}
+
+// Checks an entry that has been read into memory against the key and source
+// size it was looked up with, and points the entry at its events and
+// diagnostics. Returns false if it's for something else or is truncated.
+static bool cache_decode(cache_entry_t *entry, uint64_t key, size_t size) {
+  const uint8_t *data = entry->data;
+  if (
+    entry->size < CACHE_HEADER ||
+    memcmp(data, "RBPC", 4) != 0 ||
+    cache_read_u32(data + 4) != CACHE_VERSION ||
+    cache_read_u64(data + 8) != key ||
+    cache_read_u64(data + 16) != size
+  ) return false;
+
+  uint64_t events = cache_read_u64(data + 24);
+  uint64_t diagnostics = cache_read_u64(data + 32);
+  size_t offset = CACHE_HEADER;
+
+  if (events > (entry->size - offset) / sizeof(event_t)) return false;
+  entry->events = (const event_t *) (data + offset);
+  entry->count = (size_t) events;
+  offset += (size_t) events * sizeof(event_t);
+
+  // The events are replayed and matched against the source as they are, so a
+  // damaged entry in a shared directory mustn't be able to point outside of
+  // the source or the array, or name a kind of node that doesn't exist.
+  for (size_t index = 0; index < entry->count; index++) {
+    const event_t *event = &entry->events[index];
+
+    if (
+      event->type >= NODE_MAXIMUM ||
+      event->start > event->end || event->end > size ||
+      event->closing_start > event->closing_end || event->closing_end > size ||
+      event->span == 0 || event->span > index + 1 || event->children >= event->span
+    ) return false;
+  }
+
+  // Each diagnostic is its start (u64), end (u64), and the length of its
+  // message (u32), followed by the message and a NUL.
+  if (diagnostics > (entry->size - offset) / 21) return false;
+  entry->diagnostics = calloc((size_t) diagnostics + 1, sizeof(diagnostic_t));
+  if (entry->diagnostics == NULL) return false;
+
+  for (size_t index = 0; index < diagnostics; index++) {
+    if (entry->size - offset < 20) return false;
+
+    uint32_t length = cache_read_u32(data + offset + 16);
+    if (entry->size - offset - 20 < (size_t) length + 1 || data[offset + 20 + length] != '\0') return false;
+
+    uint64_t start = cache_read_u64(data + offset);
+    uint64_t end = cache_read_u64(data + offset + 8);
+    if (start > end || end > size) return false;
+
+    entry->diagnostics[index] = (diagnostic_t) {
+      .start = (size_t) start,
+      .end = (size_t) end,
+      .message = (const char *) (data + offset + 20)
+    };
+
+    offset += 20 + (size_t) length + 1;
+  }
+
+  entry->diagnostic_count = (size_t) diagnostics;
+  return offset == entry->size;
+}
+
+// Looks up the result with the given key for a source of the given size. On a
+// hit, fills in the entry (which must be released with cache_release) and
+// marks it as recently used. Anything that can't be read counts as a miss.
+bool cache_load(cache_t *cache, uint64_t key, size_t size, cache_entry_t *entry) {
+  uint64_t start = trace_now();
+  char path[4096];
+  cache_path(cache, key, path, sizeof(path));
+
+  *entry = (cache_entry_t) { .data = NULL };
+  bool found = false;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat sb;
+
+  if (fd != -1 && fstat(fd, &sb) == 0 && (entry->data = malloc((size_t) sb.st_size + 1)) != NULL) {
+    entry->size = (size_t) sb.st_size;
+    size_t offset = 0;
+
+    while (offset < entry->size) {
+      ssize_t length = read(fd, (char *) entry->data + offset, entry->size - offset);
+      if (length <= 0) break;
+      offset += (size_t) length;
+    }
+
+    found = offset == entry->size && cache_decode(entry, key, size);
+
+    // The modification time is what eviction goes by, so bumping it keeps the
+    // entries that are still being used.
+    if (found) futimens(fd, NULL);
+  }
+
+  if (fd != -1) close(fd);
+
+  if (found) {
+    atomic_fetch_add_explicit(&cache->hits, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&cache->read, entry->size, memory_order_relaxed);
+  } else {
+    cache_release(entry);
+    atomic_fetch_add_explicit(&cache->misses, 1, memory_order_relaxed);
+  }
+
+  atomic_fetch_add_explicit(&cache->reading, trace_now() - start, memory_order_relaxed);
+  return found;
+}
+
+void cache_release(cache_entry_t *entry) {
+  free(entry->data);
+  free(entry->diagnostics);
+  *entry = (cache_entry_t) { .data = NULL };
+}
+
+// Writes a result into the cache. It's written to a temporary file next to the
+// entry first and then renamed into place, which is atomic, so other processes
+// sharing the directory see either the whole entry or none of it. Failures are
+// ignored, since the cache is only ever an optimization.
+void cache_store(cache_t *cache, uint64_t key, size_t size, const event_t *events, size_t count, const diagnostic_t *diagnostics, size_t diagnostic_count) {
+  char path[4096];
+  char temporary[sizeof(path) + 64];
+
+  snprintf(path, sizeof(path), "%s/%02x", cache->directory, (unsigned int) (key >> 56));
+  if (mkdir(path, 0777) == -1 && errno != EEXIST) return;
+
+  snprintf(
+    temporary, sizeof(temporary), "%s/.tmp-%ld-%zu", path, (long) getpid(),
+    atomic_fetch_add_explicit(&cache->temporary, 1, memory_order_relaxed)
+  );
+  cache_path(cache, key, path, sizeof(path));
+
+  FILE *file = fopen(temporary, "wb");
+  if (file == NULL) return;
+
+  uint8_t header[CACHE_HEADER];
+  memcpy(header, "RBPC", 4);
+  cache_write_u32(header + 4, CACHE_VERSION);
+  cache_write_u64(header + 8, key);
+  cache_write_u64(header + 16, size);
+  cache_write_u64(header + 24, count);
+  cache_write_u64(header + 32, diagnostic_count);
+
+  size_t written = fwrite(header, 1, CACHE_HEADER, file);
+  if (count > 0) written += fwrite(events, sizeof(event_t), count, file) * sizeof(event_t);
+
+  for (size_t index = 0; index < diagnostic_count; index++) {
+    uint8_t record[20];
+    uint32_t length = (uint32_t) strlen(diagnostics[index].message);
+
+    cache_write_u64(record, diagnostics[index].start);
+    cache_write_u64(record + 8, diagnostics[index].end);
+    cache_write_u32(record + 16, length);
+
+    written += fwrite(record, 1, sizeof(record), file);
+    written += fwrite(diagnostics[index].message, 1, (size_t) length + 1, file);
+  }
+
+  if (fclose(file) != 0 || rename(temporary, path) != 0) {
+    unlink(temporary);
+    return;
+  }
+
+  atomic_fetch_add_explicit(&cache->stores, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&cache->written, written, memory_order_relaxed);
+}
+
+// An entry found while trimming the cache.
+typedef struct {
+  char *path;
+  time_t used;
+  uint64_t size;
+} cache_file_t;
+
+static int cache_file_compare(const void *left, const void *right) {
+  time_t left_used = ((const cache_file_t *) left)->used;
+  time_t right_used = ((const cache_file_t *) right)->used;
+  return (left_used > right_used) - (left_used < right_used);
+}
+
+// Deletes the least recently used entries until the cache fits within its
+// capacity, and returns how many were deleted. Temporary files that were never
+// renamed into place are deleted along the way once they're stale, without
+// counting as evictions. This lists every entry, so it's only done by
+// processes that have added to the cache.
+static size_t cache_trim(cache_t *cache) {
+  cache_file_t *files = NULL;
+  size_t count = 0;
+  size_t capacity = 0;
+  uint64_t total = 0;
+  time_t now = time(NULL);
+
+  for (unsigned int prefix = 0; prefix < 256; prefix++) {
+    char directory[4096];
+    snprintf(directory, sizeof(directory), "%s/%02x", cache->directory, prefix);
+
+    DIR *dir = opendir(directory);
+    if (dir == NULL) continue;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+      bool temporary = strncmp(entry->d_name, ".tmp-", 5) == 0;
+      if (entry->d_name[0] == '.' && !temporary) continue;
+
+      char path[sizeof(directory) + sizeof(entry->d_name) + 1];
+      snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+
+      struct stat sb;
+      if (stat(path, &sb) == -1 || !S_ISREG(sb.st_mode)) continue;
+
+      if (temporary) {
+        if (now - sb.st_mtime > CACHE_TEMPORARY_AGE) unlink(path);
+        continue;
+      }
+
+      if (count == capacity) {
+        size_t grown = capacity == 0 ? 256 : capacity * 2;
+        cache_file_t *resized = realloc(files, grown * sizeof(cache_file_t));
+        if (resized == NULL) break;
+
+        files = resized;
+        capacity = grown;
+      }
+
+      char *copy = strdup(path);
+      if (copy == NULL) break;
+
+      files[count++] = (cache_file_t) { .path = copy, .used = sb.st_mtime, .size = (uint64_t) sb.st_size };
+      total += (uint64_t) sb.st_size;
+    }
+
+    closedir(dir);
+  }
+
+  size_t evicted = 0;
+
+  if (total > cache->capacity) {
+    qsort(files, count, sizeof(cache_file_t), cache_file_compare);
+
+    for (size_t index = 0; index < count && total > cache->capacity; index++) {
+      if (unlink(files[index].path) == 0) evicted++;
+      total -= files[index].size;
+    }
+  }
+
+  for (size_t index = 0; index < count; index++) free(files[index].path);
+  free(files);
+  return evicted;
+}
+
+// Closes the cache, first trimming it to its capacity if anything was written.
+// If a stream is given, the statistics for this process are written to it.
+void cache_close(cache_t *cache, FILE *stream) {
+  size_t stores = atomic_load(&cache->stores);
+  size_t evicted = stores > 0 ? cache_trim(cache) : 0;
+
+  if (stream != NULL) {
+    size_t hits = atomic_load(&cache->hits);
+    size_t misses = atomic_load(&cache->misses);
+
+    fprintf(
+      stream,
+      "cache: %zu hits (%.1f%%), %zu misses, %zu stored, %zu evicted, %.1f MB read in %.1f ms, %.1f MB written\n",
+      hits,
+      hits + misses == 0 ? 0.0 : 100.0 * (double) hits / (double) (hits + misses),
+      misses,
+      stores,
+      evicted,
+      (double) atomic_load(&cache->read) / 1e6,
+      (double) atomic_load(&cache->reading) / 1e6,
+      (double) atomic_load(&cache->written) / 1e6
+    );
+  }
+
+  free(cache->directory);
+  free(cache);
+}
@@ -0,0 +1,113 @@
+#ifndef CLI_H
+#define CLI_H
+
+#include "parse.h"
+
+// This struct represents a single source file that has been read into memory
+// by the loader or found in an archive. The buffer is owned by the loader and
+// stays valid until the source is handed back with loader_release, or owned by
+// the archive and valid until it's closed.
+typedef struct {
+  const char *path;   // the path that was requested
+  char *source;       // the contents of the file
+  off_t size;         // the number of bytes in the file
+  bool padded;        // whether the contents are followed by PARSE_PADDING zero bytes
+  int error;          // the errno value if the file could not be read
+  size_t slot;        // the loader slot that owns the buffer
+  uint64_t started;   // when the loader started on the file, from trace_now
+  uint64_t loaded;    // when the loader finished with the file
+} source_t;
+
+typedef struct loader loader_t;
+
+loader_t * loader_create(char **paths, size_t count, bool ordered);
+bool loader_next(loader_t *loader, source_t *source);
+void loader_release(loader_t *loader, source_t *source);
+void loader_destroy(loader_t *loader);
+
+typedef struct archive archive_t;
+
+archive_t * archive_open(const char *path);
+size_t archive_count(const archive_t *archive);
+bool archive_next(archive_t *archive, source_t *source);
+void archive_close(archive_t *archive);
+
+// An on-disk cache of parse results, keyed by a hash of the source. It can be
+// shared by any number of threads and processes.
+typedef struct cache cache_t;
+
+// The most bytes that the cache takes up unless it's given a size, in MB, with
+// --cache-size.
+#define CACHE_DEFAULT_SIZE (256 * 1000000ULL)
+
+// The kinds of results that are cached. Each has its own entries.
+typedef enum {
+  CACHE_PARSE = 'p', // the recorded events and the diagnostics
+  CACHE_CHECK = 'c'  // only the diagnostics
+} cache_kind_t;
+
+// A result read back from the cache. The events and diagnostics point into the
+// data that was read.
+typedef struct {
+  void *data;                   // the contents of the entry
+  size_t size;                  // the number of bytes in the entry
+  const event_t *events;
+  size_t count;
+  diagnostic_t *diagnostics;
+  size_t diagnostic_count;
+} cache_entry_t;
+
+cache_t * cache_open(const char *directory, uint64_t capacity);
+uint64_t cache_key(cache_kind_t kind, const char *source, size_t size);
+bool cache_load(cache_t *cache, uint64_t key, size_t size, cache_entry_t *entry);
+void cache_release(cache_entry_t *entry);
+void cache_store(cache_t *cache, uint64_t key, size_t size, const event_t *events, size_t count, const diagnostic_t *diagnostics, size_t diagnostic_count);
+void cache_close(cache_t *cache, FILE *stream);
+
+// The state passed to print_token, which prints each token it's given.
+typedef struct {
+  FILE *stream;       // the stream to print to
+  const char *source; // the start of the source, for computing offsets
+} token_printer_t;
+
+void print_token(void *data, token_t *token);
+
+// A log-linear histogram of latencies in the style of HdrHistogram. Every
+// power of two is split into the same number of buckets, which keeps the
+// relative error bounded no matter how large the values get.
+#define HISTOGRAM_PRECISION 7
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_PRECISION + 2) << (HISTOGRAM_PRECISION - 1))
+
+typedef struct {
+  uint64_t counts[HISTOGRAM_BUCKETS];
+  uint64_t count;
+  uint64_t min;
+  uint64_t max;
+} histogram_t;
+
+void histogram_record(histogram_t *histogram, uint64_t value);
+void histogram_merge(histogram_t *histogram, const histogram_t *source);
+uint64_t histogram_percentile(const histogram_t *histogram, double percentile);
+void histogram_print(const histogram_t *histogram, const char *name, FILE *stream);
+
+// The hardware counts for the sources that one thread has processed, kept
+// separately for lexing each source on its own and for running the command.
+typedef struct {
+  counters_t counters;
+  int error;          // why the counters couldn't be opened, or 0
+  counts_t lex;
+  counts_t run;
+  size_t sources;
+  size_t bytes;
+  size_t tokens;
+} perf_t;
+
+void perf_open(perf_t *perf);
+void perf_close(perf_t *perf);
+void perf_lex(perf_t *perf, parser_t *parser, off_t size, const char *source);
+void perf_start(perf_t *perf);
+void perf_stop(perf_t *perf);
+void perf_merge(perf_t *perf, const perf_t *source);
+void perf_print(const perf_t *perf, const char *phase, FILE *stream);
+
+#endif
@@ -0,0 +1,79 @@
+#include "cli.h"
+
+// Returns the bucket that the given value falls into. Values below 128 each
+// get their own bucket. Above that, every power of two is split into 64
+// buckets, so a bucket is never wider than 1/64th of the values it holds.
+static size_t histogram_bucket(uint64_t value) {
+  if (value < (1 << HISTOGRAM_PRECISION)) return (size_t) value;
+
+  unsigned int shift = (63 - __builtin_clzll(value)) - (HISTOGRAM_PRECISION - 1);
+  return ((size_t) shift << (HISTOGRAM_PRECISION - 1)) + (size_t) (value >> shift);
+}
+
+// Returns the largest value that falls into the given bucket.
+static uint64_t histogram_highest(size_t bucket) {
+  if (bucket < (1 << HISTOGRAM_PRECISION)) return bucket;
+
+  unsigned int shift = (unsigned int) (bucket >> (HISTOGRAM_PRECISION - 1)) - 1;
+  uint64_t mantissa = bucket - ((size_t) shift << (HISTOGRAM_PRECISION - 1));
+  return ((mantissa + 1) << shift) - 1;
+}
+
+void histogram_record(histogram_t *histogram, uint64_t value) {
+  if (histogram->count == 0 || value < histogram->min) histogram->min = value;
+  if (value > histogram->max) histogram->max = value;
+
+  histogram->counts[histogram_bucket(value)]++;
+  histogram->count++;
+}
+
+// Adds all of the values recorded in the source histogram to the destination.
+void histogram_merge(histogram_t *histogram, const histogram_t *source) {
+  if (source->count == 0) return;
+
+  if (histogram->count == 0 || source->min < histogram->min) histogram->min = source->min;
+  if (source->max > histogram->max) histogram->max = source->max;
+
+  for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+    histogram->counts[bucket] += source->counts[bucket];
+  }
+  histogram->count += source->count;
+}
+
+// Returns the value at the given percentile (0 to 100). The result is the
+// upper bound of the bucket that holds it, so it's within 1/64th of the
+// recorded value and never more than the maximum.
+uint64_t histogram_percentile(const histogram_t *histogram, double percentile) {
+  if (histogram->count == 0) return 0;
+
+  uint64_t target = (uint64_t) (percentile / 100 * histogram->count + 0.5);
+  if (target == 0) target = 1;
+
+  uint64_t seen = 0;
+  for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+    seen += histogram->counts[bucket];
+
+    if (seen >= target) {
+      uint64_t highest = histogram_highest(bucket);
+      return highest < histogram->max ? highest : histogram->max;
+    }
+  }
+
+  return histogram->max;
+}
+
+// Prints a one-line summary of the histogram, with the values (which are in
+// nanoseconds) shown in microseconds.
+void histogram_print(const histogram_t *histogram, const char *name, FILE *stream) {
+  fprintf(
+    stream,
+    "%-6s count=%llu min=%.1fus p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n",
+    name,
+    (unsigned long long) histogram->count,
+    histogram->min / 1e3,
+    histogram_percentile(histogram, 50) / 1e3,
+    histogram_percentile(histogram, 99) / 1e3,
+    histogram_percentile(histogram, 99.9) / 1e3,
+    histogram->max / 1e3
+  );
+}
@@ -0,0 +1,656 @@
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define LOADER_URING
+#endif
+#endif
+
+#ifdef LOADER_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "cli.h"
+
+// The number of files that can be in flight at any given time. Each one owns a
+// buffer that is retained and reused for subsequent files.
+#define LOADER_DEPTH 64
+
+// The largest single read that we'll submit. Larger files are read in pieces.
+#define LOADER_CHUNK (1 << 30)
+
+typedef enum {
+  SLOT_FREE,    // available to start loading a new file
+  SLOT_OPENING, // waiting on the open and statx to complete
+  SLOT_READING, // waiting on reads to complete
+  SLOT_READY,   // fully read and waiting to be handed out
+  SLOT_HELD     // handed out to a consumer, waiting to be released
+} slot_state_t;
+
+typedef struct {
+  slot_state_t state;
+  size_t index;     // the index of the path being loaded
+  int fd;           // the file descriptor once it has been opened
+  int pending;      // the number of outstanding operations
+  int error;        // the first error encountered while loading
+  off_t size;       // the size of the file
+  off_t offset;     // the number of bytes read so far
+  char *buffer;     // the pooled buffer for the contents of the file
+  size_t capacity;  // the number of bytes allocated for the buffer
+  uint64_t started; // when the load was kicked off
+  uint64_t loaded;  // when the load finished
+#ifdef LOADER_URING
+  struct statx statx;
+#endif
+} slot_t;
+
+#ifdef LOADER_URING
+typedef enum {
+  OP_OPEN = 1,
+  OP_STATX,
+  OP_READ,
+  OP_CLOSE
+} op_t;
+
+// The mapped submission and completion queues of a single io_uring instance.
+typedef struct {
+  int fd;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+  unsigned submitting;  // the number of queued entries not yet submitted
+  unsigned inflight;    // the number of submitted entries not yet reaped
+  int error;            // the errno from the kernel refusing entries, if it has
+} uring_t;
+#endif
+
+struct loader {
+  char **paths;         // the paths to load
+  size_t count;         // the number of paths
+  size_t started;       // the number of paths that have started loading
+  size_t finished;      // the number of paths that have been handed out
+  bool ordered;         // whether paths are handed out in the order requested
+  size_t ready[LOADER_DEPTH]; // the queue of slots that are ready, if unordered
+  size_t ready_head;
+  size_t ready_tail;
+  slot_t slots[LOADER_DEPTH];
+  pthread_mutex_t lock;
+  pthread_cond_t changed; // signaled when a slot is released or becomes ready
+#ifdef LOADER_URING
+  bool uring;           // whether files are being loaded through the ring
+  bool ring_open;       // whether the ring was created and needs tearing down
+  bool reaping;         // whether a thread is waiting on the ring (unlocked)
+  uring_t ring;
+#endif
+};
+
+// Make sure the buffer in the given slot can hold the file along with the
+// padding that the parser expects after it.
+static bool slot_reserve(slot_t *slot) {
+  size_t needed = (size_t) slot->size + PARSE_PADDING;
+  if (needed <= slot->capacity) return true;
+
+  char *buffer = realloc(slot->buffer, needed);
+  if (buffer == NULL) {
+    slot->error = ENOMEM;
+    return false;
+  }
+
+  slot->buffer = buffer;
+  slot->capacity = needed;
+  return true;
+}
+
+static void loader_push_ready(loader_t *loader, slot_t *slot) {
+  if (slot->error == 0) {
+    memset(slot->buffer + slot->size, 0, PARSE_PADDING);
+  }
+
+  slot->state = SLOT_READY;
+  slot->loaded = trace_now();
+  if (!loader->ordered) loader->ready[loader->ready_tail++ % LOADER_DEPTH] = slot - loader->slots;
+  pthread_cond_broadcast(&loader->changed);
+}
+
+// Takes the next slot to hand out, if it's ready. When ordered, that's the slot
+// of the path after the last one handed out, which was started before any
+// that come after it and so is always in a slot of its own.
+static slot_t * loader_take(loader_t *loader) {
+  if (loader->ordered) {
+    for (size_t index = 0; index < LOADER_DEPTH; index++) {
+      slot_t *slot = &loader->slots[index];
+      if (slot->state == SLOT_READY && slot->index == loader->finished) return slot;
+    }
+
+    return NULL;
+  }
+
+  if (loader->ready_head == loader->ready_tail) return NULL;
+  return &loader->slots[loader->ready[loader->ready_head++ % LOADER_DEPTH]];
+}
+
+static slot_t * loader_free_slot(loader_t *loader) {
+  for (size_t index = 0; index < LOADER_DEPTH; index++) {
+    if (loader->slots[index].state == SLOT_FREE) return &loader->slots[index];
+  }
+  return NULL;
+}
+
+// Reads a whole file into the given slot with plain blocking syscalls. This is
+// the portable path, and it's also used whenever io_uring isn't available.
+static void loader_read(loader_t *loader, slot_t *slot) {
+  slot->started = trace_now();
+  slot->error = 0;
+  slot->offset = 0;
+
+  int fd = open(loader->paths[slot->index], O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    slot->error = errno;
+    return;
+  }
+
+  struct stat sb;
+  if (fstat(fd, &sb) == -1) {
+    slot->error = errno;
+    close(fd);
+    return;
+  }
+
+  slot->size = sb.st_size;
+  if (!slot_reserve(slot)) {
+    close(fd);
+    return;
+  }
+
+  while (slot->offset < slot->size) {
+    ssize_t length = pread(fd, slot->buffer + slot->offset, slot->size - slot->offset, slot->offset);
+
+    if (length == -1) {
+      if (errno == EINTR) continue;
+      slot->error = errno;
+      break;
+    }
+
+    // The file shrunk underneath us, so treat what we have as the contents.
+    if (length == 0) {
+      slot->size = slot->offset;
+      break;
+    }
+
+    slot->offset += length;
+  }
+
+  close(fd);
+}
+
+#ifdef LOADER_URING
+
+static int uring_setup(unsigned entries, struct io_uring_params *params) {
+  return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned submit, unsigned complete, unsigned flags) {
+  return (int) syscall(__NR_io_uring_enter, fd, submit, complete, flags, NULL, 0);
+}
+
+// Creates the ring and maps its queues into memory. Returns false if io_uring
+// isn't permitted or the kernel doesn't support the operations we need (they
+// all arrived alongside IORING_FEAT_RW_CUR_POS).
+static bool uring_create(uring_t *ring, unsigned entries) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  ring->fd = uring_setup(entries, &params);
+  if (ring->fd < 0) return false;
+
+  if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+    close(ring->fd);
+    return false;
+  }
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+  bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single && ring->cq_ring_size > ring->sq_ring_size) {
+    ring->sq_ring_size = ring->cq_ring_size;
+  }
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    close(ring->fd);
+    return false;
+  }
+
+  if (single) {
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+      munmap(ring->sq_ring, ring->sq_ring_size);
+      close(ring->fd);
+      return false;
+    }
+  }
+
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    if (!single) munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    return false;
+  }
+
+  char *sq = ring->sq_ring;
+  ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+
+  char *cq = ring->cq_ring;
+  ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+  ring->submitting = 0;
+  ring->inflight = 0;
+  return true;
+}
+
+static void uring_destroy(uring_t *ring) {
+  munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+  munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->fd);
+}
+
+// Submits everything that has been queued, optionally waiting for at least one
+// completion to arrive. Returns false if the kernel refused (for any reason
+// other than being interrupted), leaving the errno in the ring's error.
+static bool uring_submit(uring_t *ring, unsigned complete) {
+  unsigned flags = complete ? IORING_ENTER_GETEVENTS : 0;
+
+  while (ring->submitting > 0 || complete > 0) {
+    int result = uring_enter(ring->fd, ring->submitting, complete, flags);
+
+    if (result < 0) {
+      if (errno == EINTR) continue;
+      ring->error = errno;
+      return false;
+    }
+
+    ring->inflight += (unsigned) result;
+    ring->submitting -= (unsigned) result;
+    if (ring->submitting == 0) return true;
+    complete = 0;
+    flags = 0;
+  }
+
+  return true;
+}
+
+// Returns the next free submission queue entry, flushing the queue to the
+// kernel first if it's full. Returns NULL if it's full and can't be flushed.
+static struct io_uring_sqe * uring_sqe(uring_t *ring) {
+  unsigned tail = *ring->sq_tail;
+
+  if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) > *ring->sq_mask) {
+    if (!uring_submit(ring, 0)) return NULL;
+  }
+
+  unsigned index = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->submitting++;
+
+  return sqe;
+}
+
+// Queues an operation for the slot. Returns false if it couldn't be queued, in
+// which case the ring has failed (see loader_abandon).
+static bool uring_prep(uring_t *ring, op_t op, size_t slot, int fd, const void *addr, unsigned length, uint64_t offset) {
+  struct io_uring_sqe *sqe = uring_sqe(ring);
+  if (sqe == NULL) return false;
+
+  switch (op) {
+    case OP_OPEN: sqe->opcode = IORING_OP_OPENAT; sqe->open_flags = O_RDONLY | O_CLOEXEC; break;
+    case OP_STATX: sqe->opcode = IORING_OP_STATX; break;
+    case OP_READ: sqe->opcode = IORING_OP_READ; break;
+    case OP_CLOSE: sqe->opcode = IORING_OP_CLOSE; break;
+  }
+
+  sqe->fd = fd;
+  sqe->addr = (uint64_t) (uintptr_t) addr;
+  sqe->len = length;
+  sqe->off = offset;
+  sqe->user_data = ((uint64_t) slot << 3) | op;
+  return true;
+}
+
+static void loader_submit_read(loader_t *loader, slot_t *slot) {
+  off_t remaining = slot->size - slot->offset;
+  unsigned length = remaining > LOADER_CHUNK ? LOADER_CHUNK : (unsigned) remaining;
+
+  uring_prep(&loader->ring, OP_READ, slot - loader->slots, slot->fd, slot->buffer + slot->offset, length, (uint64_t) slot->offset);
+  slot->pending++;
+}
+
+// Closes the file descriptor without waiting on the result, and marks the slot
+// as ready to be handed out.
+static void loader_finish(loader_t *loader, slot_t *slot) {
+  if (slot->fd >= 0) {
+    if (!uring_prep(&loader->ring, OP_CLOSE, slot - loader->slots, slot->fd, NULL, 0, 0)) close(slot->fd);
+    slot->fd = -1;
+  }
+
+  loader_push_ready(loader, slot);
+}
+
+// Kicks off the open and statx for a path. They're independent of each other
+// so they're submitted together and run concurrently in the kernel.
+static void loader_start(loader_t *loader, slot_t *slot) {
+  size_t index = slot - loader->slots;
+  const char *path = loader->paths[slot->index];
+
+  slot->state = SLOT_OPENING;
+  slot->started = trace_now();
+  slot->fd = -1;
+  slot->pending = 2;
+  slot->error = 0;
+  slot->offset = 0;
+
+  uring_prep(&loader->ring, OP_OPEN, index, AT_FDCWD, path, 0, 0);
+  uring_prep(&loader->ring, OP_STATX, index, AT_FDCWD, path, STATX_SIZE, (uint64_t) (uintptr_t) &slot->statx);
+}
+
+static void loader_complete(loader_t *loader, uint64_t user_data, int result) {
+  op_t op = (op_t) (user_data & 7);
+  if (op == OP_CLOSE) return;
+
+  slot_t *slot = &loader->slots[user_data >> 3];
+  slot->pending--;
+
+  switch (op) {
+    case OP_OPEN:
+      if (result < 0) {
+        if (slot->error == 0) slot->error = -result;
+      } else {
+        slot->fd = result;
+      }
+      break;
+    case OP_STATX:
+      if (result < 0) {
+        if (slot->error == 0) slot->error = -result;
+      } else {
+        slot->size = (off_t) slot->statx.stx_size;
+      }
+      break;
+    case OP_READ:
+      if (result == -EINTR || result == -EAGAIN) {
+        loader_submit_read(loader, slot);
+        return;
+      }
+
+      if (result < 0) {
+        slot->error = -result;
+        loader_finish(loader, slot);
+        return;
+      }
+
+      if (result == 0) {
+        slot->size = slot->offset;
+      } else {
+        slot->offset += result;
+      }
+
+      if (slot->offset < slot->size) {
+        loader_submit_read(loader, slot);
+      } else {
+        loader_finish(loader, slot);
+      }
+      return;
+    case OP_CLOSE:
+      return;
+  }
+
+  // Once both the open and statx have come back, we know the size of the file
+  // and can start reading into the pooled buffer.
+  if (slot->pending == 0) {
+    if (slot->error != 0 || !slot_reserve(slot) || slot->size == 0) {
+      loader_finish(loader, slot);
+    } else {
+      slot->state = SLOT_READING;
+      loader_submit_read(loader, slot);
+    }
+  }
+}
+
+static void loader_reap(loader_t *loader) {
+  uring_t *ring = &loader->ring;
+  unsigned head = *ring->cq_head;
+  unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+  for (; head != tail; head++) {
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    ring->inflight--;
+    loader_complete(loader, cqe->user_data, cqe->res);
+  }
+
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Detaches a slot that was still loading from the ring once the kernel has
+// refused it. Its buffer is left alone for good, since the kernel may still be
+// writing into it. Returns whether the slot was loading.
+static bool loader_orphan(slot_t *slot) {
+  if (slot->state != SLOT_OPENING && slot->state != SLOT_READING) return false;
+
+  if (slot->fd >= 0) close(slot->fd);
+  slot->fd = -1;
+  slot->buffer = NULL;
+  slot->capacity = 0;
+  return true;
+}
+
+// Gives up on the ring once the kernel has refused it, and goes on with plain
+// reads. Every slot that was still loading is loaded again that way, in a new
+// buffer.
+static void loader_abandon(loader_t *loader) {
+  loader->uring = false;
+
+  for (size_t index = 0; index < LOADER_DEPTH; index++) {
+    slot_t *slot = &loader->slots[index];
+    if (!loader_orphan(slot)) continue;
+
+    loader_read(loader, slot);
+    loader_push_ready(loader, slot);
+  }
+}
+
+// Fills every free slot with a new path, submits everything queued in a single
+// syscall, and waits for at least one completion. The lock is dropped while
+// waiting, so that other threads can keep releasing slots, and only one thread
+// at a time does this (see reaping). Called with the lock held.
+static void loader_pump(loader_t *loader) {
+  uring_t *ring = &loader->ring;
+  slot_t *slot;
+
+  while (loader->started < loader->count && (slot = loader_free_slot(loader)) != NULL) {
+    slot->index = loader->started++;
+    loader_start(loader, slot);
+  }
+
+  bool submitted = false;
+
+  if (ring->error == 0) {
+    unsigned complete = ring->inflight + ring->submitting > 0 ? 1 : 0;
+    loader->reaping = true;
+    pthread_mutex_unlock(&loader->lock);
+
+    submitted = uring_submit(ring, complete);
+
+    pthread_mutex_lock(&loader->lock);
+    loader->reaping = false;
+  }
+
+  loader_reap(loader);
+  if (!submitted || ring->error != 0) loader_abandon(loader);
+  pthread_cond_broadcast(&loader->changed);
+}
+
+#endif
+
+// Creates a loader for the given paths. When ordered, they're handed out in the
+// order given, even though they can finish loading in any order. Otherwise
+// they're handed out as soon as they've loaded.
+loader_t * loader_create(char **paths, size_t count, bool ordered) {
+  loader_t *loader = calloc(1, sizeof(loader_t));
+  if (loader == NULL) return NULL;
+
+  loader->paths = paths;
+  loader->count = count;
+  loader->ordered = ordered;
+
+  pthread_mutex_init(&loader->lock, NULL);
+  pthread_cond_init(&loader->changed, NULL);
+
+#ifdef LOADER_URING
+  // A single file never benefits from the ring, so skip setting one up.
+  loader->uring = count > 1 && uring_create(&loader->ring, LOADER_DEPTH * 4);
+  loader->ring_open = loader->uring;
+#endif
+
+  return loader;
+}
+
+// Blocks until the next file has been loaded and fills in the given source.
+// Unless the loader is ordered, files are handed out in the order they finish
+// loading, which is not necessarily the order they were requested. Returns
+// false once every file has been handed out. This is safe to call from
+// multiple threads, and no thread holds the lock while waiting on a read.
+bool loader_next(loader_t *loader, source_t *source) {
+  pthread_mutex_lock(&loader->lock);
+  slot_t *slot;
+
+  while ((slot = loader_take(loader)) == NULL) {
+    if (loader->finished == loader->count) {
+      pthread_mutex_unlock(&loader->lock);
+      return false;
+    }
+
+#ifdef LOADER_URING
+    if (loader->uring) {
+      // The thread that's reaping submits to the ring without the lock, so
+      // its counters are only looked at once it's done.
+      if (loader->reaping) {
+        pthread_cond_wait(&loader->changed, &loader->lock);
+        continue;
+      }
+
+      bool waiting = loader->ring.inflight + loader->ring.submitting == 0;
+
+      if (waiting && (loader->started == loader->count || loader_free_slot(loader) == NULL)) {
+        pthread_cond_wait(&loader->changed, &loader->lock);
+      } else {
+        loader_pump(loader);
+      }
+      continue;
+    }
+#endif
+
+    slot = loader_free_slot(loader);
+    if (slot == NULL || loader->started == loader->count) {
+      pthread_cond_wait(&loader->changed, &loader->lock);
+      continue;
+    }
+
+    slot->index = loader->started++;
+    slot->state = SLOT_READING;
+
+    pthread_mutex_unlock(&loader->lock);
+    loader_read(loader, slot);
+    pthread_mutex_lock(&loader->lock);
+
+    loader_push_ready(loader, slot);
+  }
+
+  slot->state = SLOT_HELD;
+  loader->finished++;
+
+  *source = (source_t) {
+    .path = loader->paths[slot->index],
+    .source = slot->buffer,
+    .size = slot->error == 0 ? slot->size : 0,
+    .padded = true,
+    .error = slot->error,
+    .slot = slot - loader->slots,
+    .started = slot->started,
+    .loaded = slot->loaded
+  };
+
+  pthread_mutex_unlock(&loader->lock);
+  return true;
+}
+
+// Hands a source back to the loader so that its buffer can be reused.
+void loader_release(loader_t *loader, source_t *source) {
+  pthread_mutex_lock(&loader->lock);
+  loader->slots[source->slot].state = SLOT_FREE;
+  pthread_cond_broadcast(&loader->changed);
+  pthread_mutex_unlock(&loader->lock);
+}
+
+void loader_destroy(loader_t *loader) {
+#ifdef LOADER_URING
+  if (loader->uring) {
+    // Drain anything still outstanding (like closes) before tearing down the
+    // ring so the kernel isn't left writing into freed buffers. If the kernel
+    // refuses, the buffers that might still be written into are left alone.
+    while (loader->ring.inflight + loader->ring.submitting > 0) {
+      bool submitted = uring_submit(&loader->ring, 1);
+      loader_reap(loader);
+      if (submitted) continue;
+
+      for (size_t index = 0; index < LOADER_DEPTH; index++) loader_orphan(&loader->slots[index]);
+      break;
+    }
+  }
+
+  if (loader->ring_open) uring_destroy(&loader->ring);
+#endif
+
+  for (size_t index = 0; index < LOADER_DEPTH; index++) {
+    free(loader->slots[index].buffer);
+  }
+
+  pthread_cond_destroy(&loader->changed);
+  pthread_mutex_destroy(&loader->lock);
+  free(loader);
+}
@@ -1,67 +1,1051 @@
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <unistd.h>
 
-#include "parse.h"
+#include "cli.h"
 
-static int parse_file(const char *command, const char *path) {
-  // Open the file for reading
-  int fd = open(path, O_RDONLY);
-  if (fd == -1) {
-    perror("open");
+// The options that were passed on the command line after the command.
+typedef struct {
+  const char *command;
+  unsigned int parser_options;
+  unsigned int jobs;
+  bool events;
+  bool histogram;
+  bool perf_counters;
+  bool packed;
+  bool tar;
+  unsigned int split; // the threads each source's statements are parsed on, or 0
+  unsigned int nodes; // the kinds of node that parse prints, one bit for each
+  bool located;     // whether only the statement around offset is parsed
+  size_t offset;    // the offset given by --at
+  uint64_t timeout; // the milliseconds each source is given, or 0 for no limit
+  const char *trace;
+  cache_t *cache;   // the cache of results, if one was given
+  const char **pattern_sources; // the patterns given to search, in order
+  size_t pattern_count;
+  patterns_t *patterns; // the compiled patterns
+} options_t;
+
+// The tokens of a source collected as offsets, so that they can be packed.
+typedef struct {
+  packed_token_t *tokens;
+  size_t size;
+  size_t capacity;
+  const char *source;
+  bool failed;
+} token_buffer_t;
+
+static void collect_token(void *data, token_t *token) {
+  token_buffer_t *buffer = data;
+
+  if (buffer->size == buffer->capacity) {
+    size_t capacity = buffer->capacity == 0 ? 1024 : buffer->capacity * 2;
+    packed_token_t *tokens = realloc(buffer->tokens, capacity * sizeof(packed_token_t));
+
+    if (tokens == NULL) {
+      buffer->failed = true;
+      return;
+    }
+
+    buffer->tokens = tokens;
+    buffer->capacity = capacity;
+  }
+
+  buffer->tokens[buffer->size++] = (packed_token_t) {
+    .start = (uint32_t) (token->start - buffer->source),
+    .end = (uint32_t) (token->end - buffer->source),
+    .type = (uint8_t) token->type
+  };
+}
+
+// Tokenizes the source and writes the tokens out in the packed format.
+static void tokenize_packed(parser_t *parser, FILE *stream, off_t size, const char *source) {
+  if (size > UINT32_MAX) {
+    fprintf(stderr, "packed: source is too large\n");
+    return;
+  }
+
+  token_buffer_t buffer = { .source = source };
+  parser_tokenize(parser, size, source, collect_token, &buffer);
+
+  uint8_t *output = buffer.failed ? NULL : malloc(packed_bound(buffer.size));
+  if (output == NULL) {
+    perror("packed");
+  } else {
+    fwrite(output, 1, packed_encode(buffer.tokens, buffer.size, output), stream);
+  }
+
+  free(output);
+  free(buffer.tokens);
+}
+
+// Prints each diagnostic as path:line:column: message, finding the lines with
+// a structural index of the source up through the last diagnostic. Returns
+// false (having printed why) if the index can't be built.
+static bool print_diagnostics(FILE *stream, const char *path, const char *source, const diagnostic_t *diagnostics, size_t count) {
+  index_t lines = { .blocks = 0 };
+  size_t end = 0;
+
+  for (size_t index = 0; index < count; index++) {
+    if (diagnostics[index].start > end) end = diagnostics[index].start;
+  }
+
+  if (count > 0 && !index_build(&lines, end, source)) {
+    perror(path);
+    return false;
+  }
+
+  for (size_t index = 0; index < count; index++) {
+    const diagnostic_t *diagnostic = &diagnostics[index];
+    size_t start;
+    size_t line = index_line(&lines, diagnostic->start, &start);
+
+    fprintf(stream, "%s:%zu:%zu: %s\n", path, line, diagnostic->start - start + 1, diagnostic->message);
+  }
+
+  index_free(&lines);
+  return true;
+}
+
+// Prints the result of checking a source like ruby -c, either its diagnostics
+// or that it's OK. Returns false if there were any diagnostics.
+static bool report_check(FILE *stream, const char *path, const char *source, const diagnostic_t *diagnostics, size_t count) {
+  if (count == 0) {
+    fprintf(stream, "%s: Syntax OK\n", path);
+    return true;
+  }
+
+  print_diagnostics(stream, path, source, diagnostics, count);
+  return false;
+}
+
+// Checks the syntax of a source like ruby -c. Returns false if there were any
+// diagnostics.
+static bool check(parser_t *parser, FILE *stream, const char *path, off_t size, const char *source) {
+  if (!parser_check(parser, size, source)) {
+    perror(path);
+    return false;
+  }
+
+  size_t count;
+  const diagnostic_t *diagnostics = parser_diagnostics(parser, &count);
+  return report_check(stream, path, source, diagnostics, count);
+}
+
+static bool checking(const options_t *options) {
+  return strcmp(options->command, "check") == 0;
+}
+
+static bool searching(const options_t *options) {
+  return strcmp(options->command, "search") == 0;
+}
+
+// The names that --only takes for each kind of node, the same as the ones that
+// patterns use.
+static const struct {
+  const char *name;
+  node_type_t type;
+} node_names[] = {
+  { "array", NODE_ARRAY },
+  { "assign", NODE_ASSIGN },
+  { "begin", NODE_BEGIN },
+  { "binary", NODE_BINARY },
+  { "defined", NODE_DEFINED },
+  { "group", NODE_GROUP },
+  { "index", NODE_INDEX_EXPR },
+  { "index_call", NODE_INDEX_CALL },
+  { "literal", NODE_LITERAL },
+  { "not", NODE_NOT },
+  { "ternary", NODE_TERNARY },
+  { "unary", NODE_UNARY },
+  { "until", NODE_UNTIL_BLOCK },
+  { "while", NODE_WHILE_BLOCK }
+};
+
+// Parses the comma-separated kinds given to --only into a mask. Returns false
+// if one of them isn't a kind of node.
+static bool parse_nodes(char *names, unsigned int *nodes) {
+  *nodes = 0;
+
+  for (char *name = strtok(names, ","); name != NULL; name = strtok(NULL, ",")) {
+    size_t index = 0;
+    while (index < sizeof(node_names) / sizeof(node_names[0]) && strcmp(node_names[index].name, name) != 0) index++;
+
+    if (index == sizeof(node_names) / sizeof(node_names[0])) {
+      fprintf(stderr, "Unknown kind of node: %s\n", name);
+      return false;
+    }
+
+    *nodes |= 1u << node_names[index].type;
+  }
+
+  return true;
+}
+
+// Returns the printer writing to the stream, with the callbacks for the kinds
+// of node that weren't asked for left out. The parser and events_replay skip
+// those kinds entirely.
+static visitor_t parse_printer(const options_t *options, FILE *stream) {
+  visitor_t visitor = printer;
+  visitor.data = stream;
+
+  if (!(options->nodes & (1u << NODE_ARRAY))) visitor.array = NULL;
+  if (!(options->nodes & (1u << NODE_ASSIGN))) visitor.assign = NULL;
+  if (!(options->nodes & (1u << NODE_BEGIN))) visitor.begin = NULL;
+  if (!(options->nodes & (1u << NODE_BINARY))) visitor.binary = NULL;
+  if (!(options->nodes & (1u << NODE_DEFINED))) visitor.defined = NULL;
+  if (!(options->nodes & (1u << NODE_GROUP))) visitor.group = NULL;
+  if (!(options->nodes & (1u << NODE_INDEX_CALL))) visitor.index_call = NULL;
+  if (!(options->nodes & (1u << NODE_INDEX_EXPR))) visitor.index_expr = NULL;
+  if (!(options->nodes & (1u << NODE_LITERAL))) visitor.literal = NULL;
+  if (!(options->nodes & (1u << NODE_NOT))) visitor.not = NULL;
+  if (!(options->nodes & (1u << NODE_TERNARY))) visitor.ternary = NULL;
+  if (!(options->nodes & (1u << NODE_UNARY))) visitor.unary = NULL;
+  if (!(options->nodes & (1u << NODE_UNTIL_BLOCK))) visitor.until_block = NULL;
+  if (!(options->nodes & (1u << NODE_WHILE_BLOCK))) visitor.while_block = NULL;
+
+  return visitor;
+}
+
+// Whether every line of output already starts with the path of its source, so
+// that it doesn't need to be keyed when there are several.
+static bool labeled(const options_t *options) {
+  return checking(options) || searching(options);
+}
+
+// A node that a pattern matched, kept so that matches can be reported in
+// source order.
+typedef struct {
+  size_t start;   // the offset of the start of the node's first token
+  size_t pattern; // the index of the pattern that matched
+  size_t index;   // the index of the node's event
+} match_t;
+
+typedef struct {
+  match_t *matches;
+  size_t size;
+  size_t capacity;
+  bool failed;
+} match_buffer_t;
+
+// Collects a match, starting it at the leftmost token in the node's subtree.
+static void collect_match(void *data, size_t pattern, __attribute__((unused)) const event_t *events, size_t index, size_t start) {
+  match_buffer_t *buffer = data;
+
+  if (buffer->size == buffer->capacity) {
+    size_t capacity = buffer->capacity == 0 ? 64 : buffer->capacity * 2;
+    match_t *matches = realloc(buffer->matches, capacity * sizeof(match_t));
+
+    if (matches == NULL) {
+      buffer->failed = true;
+      return;
+    }
+
+    buffer->matches = matches;
+    buffer->capacity = capacity;
+  }
+
+  buffer->matches[buffer->size++] = (match_t) { .start = start, .pattern = pattern, .index = index };
+}
+
+static int compare_matches(const void *left, const void *right) {
+  const match_t *a = left;
+  const match_t *b = right;
+
+  if (a->start != b->start) return a->start < b->start ? -1 : 1;
+  if (a->index != b->index) return a->index > b->index ? -1 : 1;
+  if (a->pattern != b->pattern) return a->pattern < b->pattern ? -1 : 1;
+  return 0;
+}
+
+// Runs every pattern over the events of a parse at once and prints each match
+// as path:line:column: pattern, in source order (outer nodes before the nodes
+// inside of them that start in the same place). Syntax errors go to stderr.
+// Returns false if the matches couldn't be collected.
+static bool report_search(options_t *options, FILE *stream, const char *path, const char *source, const event_t *events, size_t count, const diagnostic_t *diagnostics, size_t diagnostic_count) {
+  if (!print_diagnostics(stderr, path, source, diagnostics, diagnostic_count)) return false;
+
+  matcher_t *matcher = matcher_create(options->patterns);
+  match_buffer_t buffer = { .matches = NULL };
+  index_t lines = { .blocks = 0 };
+
+  if (matcher == NULL || matcher_run(matcher, events, count, source, collect_match, &buffer) == SIZE_MAX || buffer.failed) {
+    perror(path);
+    if (matcher != NULL) matcher_destroy(matcher);
+    free(buffer.matches);
+    return false;
+  }
+
+  if (buffer.size > 1) qsort(buffer.matches, buffer.size, sizeof(match_t), compare_matches);
+
+  // The matches are in source order, so the last one is the furthest that the
+  // index has to reach.
+  if (buffer.size > 0 && !index_build(&lines, buffer.matches[buffer.size - 1].start, source)) {
+    perror(path);
+    matcher_destroy(matcher);
+    free(buffer.matches);
+    return false;
+  }
+
+  for (size_t index = 0; index < buffer.size; index++) {
+    const match_t *match = &buffer.matches[index];
+    size_t start;
+    size_t line = index_line(&lines, match->start, &start);
+
+    fprintf(stream, "%s:%zu:%zu: %s\n", path, line, match->start - start + 1, options->pattern_sources[match->pattern]);
+  }
+
+  index_free(&lines);
+  matcher_destroy(matcher);
+  free(buffer.matches);
+  return true;
+}
+
+// Searches a source for the patterns, recording its events to match against.
+static bool search(options_t *options, parser_t *parser, FILE *stream, const char *path, off_t size, const char *source) {
+  const event_t *events;
+  size_t count;
+
+  if (options->split > 1) {
+    events = parser_record_split(parser, size, source, options->split, &count);
+  } else {
+    events = parser_record(parser, size, source, &count);
+  }
+
+  if (events == NULL) {
+    perror(path);
+    return false;
+  }
+
+  size_t diagnostic_count;
+  const diagnostic_t *diagnostics = parser_diagnostics(parser, &diagnostic_count);
+  return report_search(options, stream, path, source, events, count, diagnostics, diagnostic_count) && !parser_timed_out(parser);
+}
+
+// Prints the events of a parse through the printer, followed by its syntax
+// errors on stderr.
+static void report_parse(const options_t *options, FILE *stream, const char *source, const event_t *events, size_t count, const diagnostic_t *diagnostics, size_t diagnostic_count) {
+  visitor_t visitor = parse_printer(options, stream);
+  events_replay(events, count, source, &visitor);
+
+  for (size_t index = 0; index < diagnostic_count; index++) {
+    fprintf(stderr, "%s\n", diagnostics[index].message);
+  }
+}
+
+// Reports the recorded events of a parse, for the commands that record them.
+static bool report_events(options_t *options, FILE *stream, const char *path, const char *source, const event_t *events, size_t count, const diagnostic_t *diagnostics, size_t diagnostic_count) {
+  if (searching(options)) return report_search(options, stream, path, source, events, count, diagnostics, diagnostic_count);
+
+  report_parse(options, stream, source, events, count, diagnostics, diagnostic_count);
+  return true;
+}
+
+// Parses only the top-level statement that encloses the offset given by --at,
+// resuming from the nearest checkpoint instead of the start of the source.
+// The checkpoints are built fresh for each source, since the CLI only looks
+// up one offset in each.
+static bool parse_located(options_t *options, parser_t *parser, FILE *stream, const char *path, off_t size, const char *source) {
+  checkpoints_t checkpoints = { .size = 0 };
+  const event_t *events = NULL;
+  size_t count;
+
+  if (checkpoints_build(&checkpoints, (size_t) size, source)) {
+    events = parser_record_statement(parser, size, source, &checkpoints, options->offset, &count);
+  }
+
+  checkpoints_free(&checkpoints);
+
+  if (events == NULL) {
+    perror(path);
+    return false;
+  }
+
+  size_t diagnostic_count;
+  const diagnostic_t *diagnostics = parser_diagnostics(parser, &diagnostic_count);
+  report_parse(options, stream, source, events, count, diagnostics, diagnostic_count);
+  return !parser_timed_out(parser);
+}
+
+// Runs the parse, search, or check command over a single source through the
+// cache. Searches share the entries of parses, since both record events. On a
+// hit, the stored result is printed without parsing at all. On a miss, the
+// source is parsed (recording events, so that they can be stored) and the
+// result is stored unless the parse ran out of time. Either way the output is
+// the same as without the cache. Returns false if the source isn't cacheable,
+// leaving it to be processed as usual.
+static bool process_cached(options_t *options, parser_t *parser, FILE *stream, const char *path, off_t size, const char *source, bool *result) {
+  bool checked = checking(options);
+  if (!checked && !searching(options) && strncmp(options->command, "parse", 5) != 0) return false;
+
+  uint64_t key = cache_key(checked ? CACHE_CHECK : CACHE_PARSE, source, (size_t) size);
+  cache_entry_t entry;
+
+  if (cache_load(options->cache, key, (size_t) size, &entry)) {
+    if (checked) {
+      *result = report_check(stream, path, source, entry.diagnostics, entry.diagnostic_count);
+    } else {
+      *result = report_events(options, stream, path, source, entry.events, entry.count, entry.diagnostics, entry.diagnostic_count);
+    }
+
+    cache_release(&entry);
+    return true;
+  }
+
+  const event_t *events = NULL;
+  size_t count = 0;
+
+  if (checked) {
+    if (!parser_check(parser, size, source)) return false;
+  } else if (options->split > 1) {
+    if ((events = parser_record_split(parser, size, source, options->split, &count)) == NULL) return false;
+  } else {
+    if ((events = parser_record(parser, size, source, &count)) == NULL) return false;
+  }
+
+  size_t diagnostic_count;
+  const diagnostic_t *diagnostics = parser_diagnostics(parser, &diagnostic_count);
+
+  if (!parser_timed_out(parser)) {
+    cache_store(options->cache, key, (size_t) size, events, count, diagnostics, diagnostic_count);
+  }
+
+  if (checked) {
+    *result = report_check(stream, path, source, diagnostics, diagnostic_count) && !parser_timed_out(parser);
+  } else {
+    *result = report_events(options, stream, path, source, events, count, diagnostics, diagnostic_count) && !parser_timed_out(parser);
+  }
+
+  return true;
+}
+
+// Runs the command over a single source. Returns false if it's being checked
+// and has syntax errors, or if it ran out of time. Otherwise syntax errors are
+// printed to stderr, and don't change the exit status.
+static bool process(options_t *options, parser_t *parser, FILE *stream, const char *path, off_t size, const char *source) {
+  if (options->timeout != 0) parser_set_deadline(parser, trace_now() + options->timeout * 1000000);
+
+  if (options->located && strncmp(options->command, "parse", 5) == 0) {
+    return parse_located(options, parser, stream, path, size, source);
+  }
+
+  bool result;
+  if (options->cache != NULL && process_cached(options, parser, stream, path, size, source, &result)) return result;
+  if (checking(options)) return check(parser, stream, path, size, source);
+  if (searching(options)) return search(options, parser, stream, path, size, source);
+
+  if (strncmp(options->command, "tokenize", 8) == 0) {
+    if (options->packed) {
+      tokenize_packed(parser, stream, size, source);
+    } else {
+      token_printer_t token_printer = { .stream = stream, .source = source };
+      parser_tokenize(parser, size, source, print_token, &token_printer);
+    }
+  } else if (strncmp(options->command, "parse", 5) == 0) {
+    visitor_t visitor = parse_printer(options, stream);
+
+    // When recording, the events are replayed into the printer afterward,
+    // which should give the same output as visiting directly. The same goes
+    // for splitting the source's statements across threads.
+    const event_t *events;
+    size_t count;
+
+    if (options->split > 1 && (events = parser_record_split(parser, size, source, options->split, &count)) != NULL) {
+      events_replay(events, count, source, &visitor);
+    } else if (options->events && (events = parser_record(parser, size, source, &count)) != NULL) {
+      events_replay(events, count, source, &visitor);
+    } else {
+      parser_parse(parser, size, source, &visitor);
+    }
+  }
+
+  size_t count;
+  const diagnostic_t *diagnostics = parser_diagnostics(parser, &count);
+
+  for (size_t index = 0; index < count; index++) {
+    fprintf(stderr, "%s\n", diagnostics[index].message);
+  }
+
+  return !parser_timed_out(parser);
+}
+
+// The state shared by the threads that are draining the loader (or the
+// archive, when reading from a tar file).
+typedef struct {
+  options_t *options;
+  loader_t *loader;
+  archive_t *archive;
+  size_t count;
+  bool keyed; // whether each source's output is preceded by its path
+} worker_t;
+
+// The state that belongs to a single thread. The status, trace, histograms,
+// and counts are only touched by their own thread and get combined once every
+// thread is done.
+typedef struct {
+  worker_t *worker;
+  int status;
+  trace_t trace;
+  histogram_t load;
+  histogram_t parse;
+  perf_t perf;
+} job_t;
+
+// Writes out the traces from every thread to the file given by --trace.
+static int write_trace(options_t *options, const trace_t *traces, size_t count) {
+  FILE *file = fopen(options->trace, "w");
+  if (file == NULL) {
+    perror(options->trace);
     return EXIT_FAILURE;
   }
 
-  // Stat the file to get the file size
-  struct stat sb;
-  if (fstat(fd, &sb) == -1) {
-    close(fd);
-    perror("fstat");
+  trace_write(traces, count, file);
+  fclose(file);
+  return EXIT_SUCCESS;
+}
+
+// Takes the next source from whichever of the loader or the archive the
+// workers are draining.
+static bool worker_next(worker_t *worker, source_t *source) {
+  if (worker->archive != NULL) return archive_next(worker->archive, source);
+  return loader_next(worker->loader, source);
+}
+
+// Each worker has its own parser handle and pulls files off the loader until
+// there are none left. When running more than one worker, the output for each
+// file is buffered and then written out with a single call so that the output
+// of different files doesn't interleave.
+static void * work(void *data) {
+  job_t *job = data;
+  worker_t *worker = job->worker;
+  options_t *options = worker->options;
+
+  if (options->perf_counters) perf_open(&job->perf);
+
+  parser_t *parser = parser_create(NULL, options->parser_options);
+  if (parser == NULL) {
+    perror("parser");
+    job->status = EXIT_FAILURE;
+    return NULL;
+  }
+
+  if (options->trace != NULL) parser_set_trace(parser, &job->trace);
+
+  // Sources that aren't padded (some archive members) need a handle that
+  // takes the checked path, which is only created once one turns up.
+  parser_t *checked = NULL;
+
+  // Parsing around an offset needs a padded source, so with --at unpadded
+  // sources are copied here instead.
+  char *padded = NULL;
+  size_t padded_capacity = 0;
+
+  char *buffer = NULL;
+  size_t length = 0;
+  FILE *stream = stdout;
+
+  if (options->jobs > 1 && (stream = open_memstream(&buffer, &length)) == NULL) {
+    perror("open_memstream");
+    parser_destroy(parser);
+    job->status = EXIT_FAILURE;
+    return NULL;
+  }
+
+  source_t source;
+  while (worker_next(worker, &source)) {
+    parser_t *handle = parser;
+
+    if (!source.padded && source.error == 0 && options->located) {
+      size_t needed = (size_t) source.size + PARSE_PADDING;
+
+      if (needed > padded_capacity) {
+        char *resized = realloc(padded, needed);
+
+        if (resized == NULL) {
+          source.error = ENOMEM;
+        } else {
+          padded = resized;
+          padded_capacity = needed;
+        }
+      }
+
+      if (source.error == 0) {
+        if (source.size > 0) memcpy(padded, source.source, (size_t) source.size);
+        memset(padded + source.size, 0, PARSE_PADDING);
+        source.source = padded;
+        source.padded = true;
+      }
+    }
+
+    if (!source.padded) {
+      if (checked == NULL && (checked = parser_create(NULL, options->parser_options & ~PARSER_OPTION_PADDED)) != NULL) {
+        if (options->trace != NULL) parser_set_trace(checked, &job->trace);
+      }
+
+      handle = checked;
+    }
+
+    if (source.error != 0) {
+      fprintf(stderr, "%s: %s\n", source.path, strerror(source.error));
+      job->status = EXIT_FAILURE;
+    } else if (handle == NULL) {
+      perror("parser");
+      job->status = EXIT_FAILURE;
+    } else {
+      if (worker->keyed) fprintf(stream, "==> %s <==\n", source.path);
+
+      if (options->trace != NULL) {
+        trace_span(&job->trace, "load", source.path, source.started, source.loaded);
+      }
+
+      if (options->perf_counters) {
+        perf_lex(&job->perf, handle, source.size, source.source);
+        perf_start(&job->perf);
+      }
+
+      uint64_t start = options->histogram ? trace_now() : 0;
+      if (!process(options, handle, stream, source.path, source.size, source.source)) {
+        job->status = EXIT_FAILURE;
+      }
+
+      if (options->perf_counters) perf_stop(&job->perf);
+
+      if (options->histogram) {
+        histogram_record(&job->load, source.loaded - source.started);
+        histogram_record(&job->parse, trace_now() - start);
+      }
+    }
+
+    if (worker->loader != NULL) loader_release(worker->loader, &source);
+
+    if (stream != stdout) {
+      fflush(stream);
+      fwrite(buffer, 1, length, stdout);
+      fseeko(stream, 0, SEEK_SET);
+    }
+  }
+
+  if (stream != stdout) {
+    fclose(stream);
+    free(buffer);
+  }
+
+  if (checked != NULL) parser_destroy(checked);
+  parser_destroy(parser);
+  if (options->perf_counters) perf_close(&job->perf);
+  return NULL;
+}
+
+// Runs the workers over every source, on as many threads as were asked for
+// (but no more than there are sources), and then reports on what they did.
+static int run(options_t *options, worker_t *worker) {
+  if (options->jobs > worker->count) options->jobs = (unsigned int) worker->count;
+
+  job_t *jobs = calloc(options->jobs, sizeof(job_t));
+  pthread_t *threads = calloc(options->jobs, sizeof(pthread_t));
+
+  if (jobs == NULL || threads == NULL) {
+    perror("jobs");
+    free(jobs);
+    free(threads);
     return EXIT_FAILURE;
   }
 
-  // mmap the file descriptor to virtually get the contents
-  off_t size = sb.st_size;
-  const char *source = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The main thread runs the last job, so only start threads for the rest.
+  unsigned int started = 0;
+  for (unsigned int index = 0; index < options->jobs; index++) {
+    jobs[index].worker = worker;
+    jobs[index].status = EXIT_SUCCESS;
+  }
+
+  for (; started + 1 < options->jobs; started++) {
+    if (pthread_create(&threads[started], NULL, work, &jobs[started]) != 0) break;
+  }
+
+  work(&jobs[options->jobs - 1]);
+
+  for (unsigned int index = 0; index < started; index++) {
+    pthread_join(threads[index], NULL);
+  }
+
+  int status = EXIT_SUCCESS;
+  for (unsigned int index = 0; index < options->jobs; index++) {
+    if (jobs[index].status != EXIT_SUCCESS) status = jobs[index].status;
+  }
+
+  if (options->histogram) {
+    for (unsigned int index = 0; index + 1 < options->jobs; index++) {
+      histogram_merge(&jobs[options->jobs - 1].load, &jobs[index].load);
+      histogram_merge(&jobs[options->jobs - 1].parse, &jobs[index].parse);
+    }
+
+    histogram_print(&jobs[options->jobs - 1].load, "load", stderr);
+    histogram_print(&jobs[options->jobs - 1].parse, "parse", stderr);
+  }
+
+  if (options->perf_counters) {
+    for (unsigned int index = 0; index + 1 < options->jobs; index++) {
+      perf_merge(&jobs[options->jobs - 1].perf, &jobs[index].perf);
+    }
+
+    perf_print(&jobs[options->jobs - 1].perf, options->command, stderr);
+  }
+
+  if (options->trace != NULL) {
+    trace_t *traces = calloc(options->jobs, sizeof(trace_t));
+
+    if (traces == NULL) {
+      perror("trace");
+      status = EXIT_FAILURE;
+    } else {
+      for (unsigned int index = 0; index < options->jobs; index++) {
+        traces[index] = jobs[index].trace;
+      }
+
+      if (write_trace(options, traces, options->jobs) != EXIT_SUCCESS) status = EXIT_FAILURE;
+      free(traces);
+    }
+
+    for (unsigned int index = 0; index < options->jobs; index++) {
+      trace_free(&jobs[index].trace);
+    }
+  }
+
+  free(jobs);
+  free(threads);
+  return status;
+}
+
+// Load every file through the loader and process each one as soon as it has
+// been read. While one file is being processed, the reads for the files after
+// it are still in flight.
+static int parse_files(options_t *options, char **paths, size_t count) {
+  // With a single job, the output comes in the order the paths were given.
+  if (options->jobs > count) options->jobs = (unsigned int) count;
 
-  close(fd);
-  if (source == MAP_FAILED) {
-    perror("mmap");
+  loader_t *loader = loader_create(paths, count, options->jobs == 1);
+  if (loader == NULL) {
+    perror("loader");
     return EXIT_FAILURE;
   }
 
-  if (strncmp(command, "tokenize", 8) == 0) {
-    tokenize(size, source);
-  } else if (strncmp(command, "parse", 5) == 0) {
-    parse(size, source, &printer);
+  worker_t worker = {
+    .options = options,
+    .loader = loader,
+    .count = count,
+    .keyed = count > 1 && !labeled(options)
+  };
+
+  int status = run(options, &worker);
+  loader_destroy(loader);
+  return status;
+}
+
+// Process every .rb file in an uncompressed tar archive in place, without
+// extracting it. The archive is mapped once and its members are handed out to
+// the workers directly from the mapping. The output for each member is keyed
+// by its path in the archive.
+static int parse_archive(options_t *options, char **paths, size_t count) {
+  if (count != 1) {
+    fprintf(stderr, "Usage: --tar <archive>\n");
+    return EXIT_FAILURE;
   }
 
-  // Clean up and free
-  munmap((void *) source, size);
-  return EXIT_SUCCESS;
+  archive_t *archive = archive_open(paths[0]);
+  if (archive == NULL) {
+    fprintf(stderr, "%s: %s\n", paths[0], errno == EINVAL ? "not a tar archive" : strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  worker_t worker = {
+    .options = options,
+    .archive = archive,
+    .count = archive_count(archive),
+    .keyed = !labeled(options)
+  };
+
+  int status = worker.count == 0 ? EXIT_SUCCESS : run(options, &worker);
+  archive_close(archive);
+  return status;
+}
+
+// Reads all of stdin into a buffer that is padded the way the parser expects.
+static char * read_stdin(size_t *size) {
+  size_t capacity = 4096;
+  char *source = malloc(capacity);
+  *size = 0;
+
+  while (source != NULL) {
+    if (capacity - *size < PARSE_PADDING + 1) {
+      char *grown = realloc(source, capacity * 2);
+      if (grown == NULL) break;
+
+      source = grown;
+      capacity *= 2;
+    }
+
+    size_t length = fread(source + *size, 1, capacity - *size - PARSE_PADDING, stdin);
+    *size += length;
+
+    if (length == 0) {
+      memset(source + *size, 0, PARSE_PADDING);
+      return source;
+    }
+  }
+
+  free(source);
+  return NULL;
 }
 
-static int parse_stdin(const char *command) {
-  char source[1024];
-  size_t size = 0;
+static int parse_stdin(options_t *options) {
+  size_t size;
+  char *source = read_stdin(&size);
 
-  while (fgets(source + size, 1024, stdin) != NULL) {
-    size += strlen(source + size);
+  if (source == NULL) {
+    perror("stdin");
+    return EXIT_FAILURE;
   }
 
-  if (strncmp(command, "tokenize", 8) == 0) {
-    tokenize(size, source);
-  } else if (strncmp(command, "parse", 5) == 0) {
-    parse(size, source, &printer);
+  parser_t *parser = parser_create(NULL, options->parser_options);
+  if (parser == NULL) {
+    perror("parser");
+    free(source);
+    return EXIT_FAILURE;
   }
 
-  return EXIT_SUCCESS;
+  trace_t trace = { 0 };
+  if (options->trace != NULL) parser_set_trace(parser, &trace);
+
+  perf_t perf;
+  if (options->perf_counters) {
+    perf_open(&perf);
+    perf_lex(&perf, parser, (off_t) size, source);
+    perf_start(&perf);
+  }
+
+  int status = process(options, parser, stdout, "-", size, source) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+  if (options->perf_counters) {
+    perf_stop(&perf);
+    perf_close(&perf);
+    perf_print(&perf, options->command, stderr);
+  }
+
+  parser_destroy(parser);
+  free(source);
+
+  if (options->trace != NULL) {
+    if (write_trace(options, &trace, 1) != EXIT_SUCCESS) status = EXIT_FAILURE;
+    trace_free(&trace);
+  }
+
+  return status;
+}
+
+static void print_difference(void *data, const tree_node_t *left, const tree_node_t *right) {
+  FILE *stream = data;
+
+  if (left != NULL) {
+    fputs("- ", stream);
+    tree_print(left, stream);
+    fputc('\n', stream);
+  }
+
+  if (right != NULL) {
+    fputs("+ ", stream);
+    tree_print(right, stream);
+    fputc('\n', stream);
+  }
+}
+
+// Compares the structure of two files, printing each of the smallest subtrees
+// that changed. Both are built into the same hash-consed tree, so everything
+// they have in common is shared and skipped by the diff. Like diff(1), this
+// exits with 0 if they're the same, 1 if they differ, and 2 if there's trouble.
+static int diff_files(options_t *options, char **paths, size_t count) {
+  if (count != 2) {
+    fprintf(stderr, "Usage: diff <old> <new>\n");
+    return 2;
+  }
+
+  loader_t *loader = loader_create(paths, count, false);
+  parser_t *parser = parser_create(NULL, options->parser_options);
+  tree_t *tree = tree_create();
+
+  if (loader == NULL || parser == NULL || tree == NULL) {
+    perror("diff");
+    if (loader != NULL) loader_destroy(loader);
+    if (parser != NULL) parser_destroy(parser);
+    if (tree != NULL) tree_destroy(tree);
+    return 2;
+  }
+
+  const tree_node_t *roots[2] = { NULL, NULL };
+  int status = 0;
+  source_t source;
+
+  // Files come back from the loader in whatever order they finish loading.
+  while (loader_next(loader, &source)) {
+    size_t side = source.path == paths[0] ? 0 : 1;
+    const event_t *events;
+    size_t size;
+
+    if (source.error != 0) {
+      fprintf(stderr, "%s: %s\n", source.path, strerror(source.error));
+      status = 2;
+    } else if (
+      (events = parser_record(parser, source.size, source.source, &size)) == NULL ||
+      (roots[side] = tree_build(tree, events, size, source.source)) == NULL
+    ) {
+      fprintf(stderr, "%s: could not build tree\n", source.path);
+      status = 2;
+    }
+
+    loader_release(loader, &source);
+  }
+
+  if (status == 0 && tree_diff(roots[0], roots[1], print_difference, stdout) > 0) {
+    status = 1;
+  }
+
+  tree_destroy(tree);
+  parser_destroy(parser);
+  loader_destroy(loader);
+  return status;
 }
 
 int main(int argc, char **argv) {
-  return argc == 3 ? parse_file(argv[1], argv[2]) : parse_stdin(argv[1]);
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <command> [options] [files...]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  static struct option longopts[] = {
+    { "at", required_argument, NULL, 'o' },
+    { "cache", required_argument, NULL, 'c' },
+    { "cache-size", required_argument, NULL, 'S' },
+    { "cache-stats", no_argument, NULL, 'C' },
+    { "events", no_argument, NULL, 'e' },
+    { "format", required_argument, NULL, 'f' },
+    { "histogram", no_argument, NULL, 'h' },
+    { "index", no_argument, NULL, 'i' },
+    { "jobs", required_argument, NULL, 'j' },
+    { "only", required_argument, NULL, 'n' },
+    { "pattern", required_argument, NULL, 'P' },
+    { "perf-counters", no_argument, NULL, 'k' },
+    { "pipelined", no_argument, NULL, 'p' },
+    { "split", required_argument, NULL, 's' },
+    { "tar", no_argument, NULL, 'a' },
+    { "timeout", required_argument, NULL, 'T' },
+    { "trace", required_argument, NULL, 't' },
+    { "trace-detail", no_argument, NULL, 'd' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  // Every source the CLI reads comes from the loader or read_stdin, which both
+  // pad it, so the parser never has to copy.
+  options_t options = {
+    .command = argv[1],
+    .jobs = 1,
+    .parser_options = PARSER_OPTION_PADDED,
+    .nodes = (1u << NODE_MAXIMUM) - 1
+  };
+  const char *cache = NULL;
+  uint64_t cache_size = CACHE_DEFAULT_SIZE;
+  bool cache_stats = false;
+  int option;
+
+  // Options are parsed from after the command, so the command takes the place
+  // of the program name as far as getopt is concerned.
+  while ((option = getopt_long(argc - 1, argv + 1, "j:", longopts, NULL)) != -1) {
+    switch (option) {
+      case 'a': options.tar = true; break;
+      case 'c': cache = optarg; break;
+      case 'C': cache_stats = true; break;
+      case 'd': options.parser_options |= PARSER_OPTION_TRACE_DETAIL; break;
+      case 'e': options.events = true; break;
+      case 'f':
+        if (strcmp(optarg, "packed") == 0) {
+          options.packed = true;
+        } else if (strcmp(optarg, "text") != 0) {
+          fprintf(stderr, "Unknown format: %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'h': options.histogram = true; break;
+      case 'i': options.parser_options |= PARSER_OPTION_INDEX; break;
+      case 'j': options.jobs = (unsigned int) strtoul(optarg, NULL, 10); break;
+      case 'k': options.perf_counters = true; break;
+      case 'n':
+        if (!parse_nodes(optarg, &options.nodes)) return EXIT_FAILURE;
+        break;
+      case 'o':
+        options.located = true;
+        options.offset = (size_t) strtoull(optarg, NULL, 10);
+        break;
+      case 'p': options.parser_options |= PARSER_OPTION_PIPELINED; break;
+      case 'P': {
+        const char **sources = realloc(options.pattern_sources, (options.pattern_count + 1) * sizeof(const char *));
+        if (sources == NULL) {
+          perror("pattern");
+          return EXIT_FAILURE;
+        }
+
+        options.pattern_sources = sources;
+        options.pattern_sources[options.pattern_count++] = optarg;
+        break;
+      }
+      case 's': options.split = (unsigned int) strtoul(optarg, NULL, 10); break;
+      case 'S': cache_size = strtoull(optarg, NULL, 10) * 1000000; break;
+      case 't': options.trace = optarg; break;
+      case 'T': options.timeout = strtoull(optarg, NULL, 10); break;
+      default: return EXIT_FAILURE;
+    }
+  }
+
+  if (options.jobs == 0) options.jobs = 1;
+
+  char **paths = argv + 1 + optind;
+  int count = argc - 1 - optind;
+
+  if (strcmp(options.command, "diff") == 0) return diff_files(&options, paths, count);
+
+  if (searching(&options)) {
+    pattern_error_t error;
+
+    if (options.pattern_count == 0) {
+      fprintf(stderr, "Usage: search --pattern <pattern> [--pattern <pattern>...] [files...]\n");
+    } else if ((options.patterns = patterns_compile(options.pattern_sources, options.pattern_count, &error)) == NULL) {
+      if (error.message == NULL) {
+        perror("pattern");
+      } else {
+        fprintf(stderr, "pattern %zu:%zu: %s\n", error.pattern + 1, error.offset + 1, error.message);
+      }
+    }
+
+    if (options.patterns == NULL) {
+      free(options.pattern_sources);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (cache != NULL && (options.cache = cache_open(cache, cache_size)) == NULL) {
+    perror(cache);
+    return EXIT_FAILURE;
+  }
+
+  int status;
+  if (options.tar) {
+    status = parse_archive(&options, paths, count);
+  } else {
+    status = count > 0 ? parse_files(&options, paths, count) : parse_stdin(&options);
+  }
+
+  if (options.cache != NULL) cache_close(options.cache, cache_stats ? stderr : NULL);
+  if (options.patterns != NULL) patterns_destroy(options.patterns);
+  free(options.pattern_sources);
+  return status;
 }
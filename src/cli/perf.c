@@ -0,0 +1,93 @@
+#include <string.h>
+
+#include "cli.h"
+
+// Opens the counters for the calling thread. They count only that thread, so
+// every worker opens its own and they're merged at the end.
+void perf_open(perf_t *perf) {
+  *perf = (perf_t) { .sources = 0 };
+  if (!counters_open(&perf->counters)) perf->error = perf->counters.error;
+}
+
+// Closes the counters. What they counted is kept, so it can still be merged
+// and printed.
+void perf_close(perf_t *perf) {
+  counters_close(&perf->counters);
+}
+
+static void perf_count(void *data, __attribute__((unused)) token_t *token) {
+  (*(size_t *) data)++;
+}
+
+// Counts lexing the source on its own. Lexing is interleaved with parsing, so
+// this is the only way to tell the two apart: the difference between this and
+// the command is what the rest of the command costs. The lexing isn't held to
+// the deadline (if there is one), since it isn't part of the command.
+void perf_lex(perf_t *perf, parser_t *parser, off_t size, const char *source) {
+  counts_t counts;
+  size_t tokens = 0;
+
+  parser_set_deadline(parser, 0);
+  counters_start(&perf->counters);
+  parser_tokenize(parser, size, source, perf_count, &tokens);
+  counters_stop(&perf->counters, &counts);
+
+  counts_add(&perf->lex, &counts);
+  perf->bytes += (size_t) size;
+  perf->tokens += tokens;
+  perf->sources++;
+}
+
+void perf_start(perf_t *perf) {
+  counters_start(&perf->counters);
+}
+
+void perf_stop(perf_t *perf) {
+  counts_t counts;
+  counters_stop(&perf->counters, &counts);
+  counts_add(&perf->run, &counts);
+}
+
+// Adds the counts of another thread into this one's.
+void perf_merge(perf_t *perf, const perf_t *source) {
+  counts_add(&perf->lex, &source->lex);
+  counts_add(&perf->run, &source->run);
+  perf->bytes += source->bytes;
+  perf->tokens += source->tokens;
+  perf->sources += source->sources;
+  if (perf->error == 0) perf->error = source->error;
+}
+
+static void perf_ratio(FILE *stream, long long value, size_t total) {
+  if (value < 0 || total == 0) {
+    fprintf(stream, " %14s", "n/a");
+  } else {
+    fprintf(stream, " %14.3f", (double) value / (double) total);
+  }
+}
+
+// Prints each counter per byte and per token, for lexing and for running the
+// command (named by phase). When no counter could be opened, this says why
+// instead.
+void perf_print(const perf_t *perf, const char *phase, FILE *stream) {
+  if (perf->error != 0) {
+    fprintf(stream, "perf: hardware counters are unavailable: %s\n", strerror(perf->error));
+    return;
+  }
+
+  fprintf(stream, "perf: %zu sources, %zu bytes, %zu tokens\n", perf->sources, perf->bytes, perf->tokens);
+
+  char labels[2][32];
+  snprintf(labels[0], sizeof(labels[0]), "%.16s/byte", phase);
+  snprintf(labels[1], sizeof(labels[1]), "%.16s/token", phase);
+  fprintf(stream, "%-14s %14s %14s %14s %14s\n", "counter", "lex/byte", "lex/token", labels[0], labels[1]);
+
+  for (counter_type_t type = 0; type < COUNTER_MAXIMUM; type++) {
+    fprintf(stream, "%-14s", counter_name(type));
+    perf_ratio(stream, perf->lex.values[type], perf->bytes);
+    perf_ratio(stream, perf->lex.values[type], perf->tokens);
+    perf_ratio(stream, perf->run.values[type], perf->bytes);
+    perf_ratio(stream, perf->run.values[type], perf->tokens);
+    fprintf(stream, "\n");
+  }
+}
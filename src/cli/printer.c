@@ -1,140 +1,147 @@
-#include "parse.h"
+#include "cli.h"
 
 #define UNUSED __attribute__((unused))
 
-static void array(UNUSED token_t *opening, UNUSED token_t *closing, size_t size) {
-  printf("ARRAY=%zu\n", size);
+// The printer writes to the stream given as the visitor's data, falling back
+// to stdout when there isn't one.
+static inline FILE * output(void *data) {
+  return data == NULL ? stdout : data;
 }
 
-static void assign(token_t *operator) {
+static void array(void *data, UNUSED token_t *opening, UNUSED token_t *closing, size_t size) {
+  fprintf(output(data), "ARRAY=%zu\n", size);
+}
+
+static void assign(void *data, token_t *operator) {
   switch (operator->type) {
-    case TOKEN_AMPERSAND_EQUAL: printf("BITWISE_AND_ASSIGN\n"); break;
-    case TOKEN_CARET_EQUAL: printf("BITWISE_XOR_ASSIGN\n"); break;
-    case TOKEN_DOUBLE_AMPERSAND_EQUAL: printf("LOGICAL_AND_ASSIGN\n"); break;
-    case TOKEN_DOUBLE_PIPE_EQUAL: printf("LOGICAL_OR_ASSIGN\n"); break;
-    case TOKEN_DOUBLE_STAR_EQUAL: printf("EXPONENT_ASSIGN\n"); break;
-    case TOKEN_EQUAL: printf("ASSIGN\n"); break;
-    case TOKEN_MINUS_EQUAL: printf("SUBTRACT_ASSIGN\n"); break;
-    case TOKEN_PERCENT_EQUAL: printf("MODULO_ASSIGN\n"); break;
-    case TOKEN_PIPE_EQUAL: printf("BITWISE_OR_ASSIGN\n"); break;
-    case TOKEN_PLUS_EQUAL: printf("ADD_ASSIGN\n"); break;
-    case TOKEN_SHIFT_LEFT_EQUAL: printf("SHIFT_LEFT_ASSIGN\n"); break;
-    case TOKEN_SHIFT_RIGHT_EQUAL: printf("SHIFT_RIGHT_ASSIGN\n"); break;
-    case TOKEN_SLASH_EQUAL: printf("DIVIDE_ASSIGN\n"); break;
-    case TOKEN_STAR_EQUAL: printf("MULTIPLY_ASSIGN\n"); break;
-    default: printf("???\n"); break;
+    case TOKEN_AMPERSAND_EQUAL: fprintf(output(data), "BITWISE_AND_ASSIGN\n"); break;
+    case TOKEN_CARET_EQUAL: fprintf(output(data), "BITWISE_XOR_ASSIGN\n"); break;
+    case TOKEN_DOUBLE_AMPERSAND_EQUAL: fprintf(output(data), "LOGICAL_AND_ASSIGN\n"); break;
+    case TOKEN_DOUBLE_PIPE_EQUAL: fprintf(output(data), "LOGICAL_OR_ASSIGN\n"); break;
+    case TOKEN_DOUBLE_STAR_EQUAL: fprintf(output(data), "EXPONENT_ASSIGN\n"); break;
+    case TOKEN_EQUAL: fprintf(output(data), "ASSIGN\n"); break;
+    case TOKEN_MINUS_EQUAL: fprintf(output(data), "SUBTRACT_ASSIGN\n"); break;
+    case TOKEN_PERCENT_EQUAL: fprintf(output(data), "MODULO_ASSIGN\n"); break;
+    case TOKEN_PIPE_EQUAL: fprintf(output(data), "BITWISE_OR_ASSIGN\n"); break;
+    case TOKEN_PLUS_EQUAL: fprintf(output(data), "ADD_ASSIGN\n"); break;
+    case TOKEN_SHIFT_LEFT_EQUAL: fprintf(output(data), "SHIFT_LEFT_ASSIGN\n"); break;
+    case TOKEN_SHIFT_RIGHT_EQUAL: fprintf(output(data), "SHIFT_RIGHT_ASSIGN\n"); break;
+    case TOKEN_SLASH_EQUAL: fprintf(output(data), "DIVIDE_ASSIGN\n"); break;
+    case TOKEN_STAR_EQUAL: fprintf(output(data), "MULTIPLY_ASSIGN\n"); break;
+    default: fprintf(output(data), "???\n"); break;
   }
 }
 
-static void begin(UNUSED token_t *opening, UNUSED token_t *closing) {
-  printf("BEGIN\n");
+static void begin(void *data, UNUSED token_t *opening, UNUSED token_t *closing) {
+  fprintf(output(data), "BEGIN\n");
 }
 
-static void binary(token_t *operator) {
+static void binary(void *data, token_t *operator) {
   switch (operator->type) {
-    case TOKEN_AMPERSAND: printf("BITWISE_AND\n"); break;
-    case TOKEN_AND: printf("COMPOSITION_AND\n"); break;
-    case TOKEN_BANG_EQUAL: printf("BANG_EQUAL\n"); break;
-    case TOKEN_BANG_TILDE: printf("BANG_TILDE\n"); break;
-    case TOKEN_CARET: printf("BITWISE_XOR\n"); break;
-    case TOKEN_COMPARE: printf("COMPARE\n"); break;
-    case TOKEN_DOUBLE_AMPERSAND: printf("LOGICAL_AND\n"); break;
-    case TOKEN_DOUBLE_DOT: printf("RANGE_INCLUSIVE\n"); break;
-    case TOKEN_DOUBLE_EQUAL: printf("DOUBLE_EQUAL\n"); break;
-    case TOKEN_DOUBLE_PIPE: printf("LOGICAL_OR\n"); break;
-    case TOKEN_DOUBLE_STAR: printf("EXPONENT\n"); break;
-    case TOKEN_EQUAL_TILDE: printf("EQUAL_TILDE\n"); break;
-    case TOKEN_GREATER_EQUAL: printf("GREATER_EQUAL\n"); break;
-    case TOKEN_GREATER: printf("GREATER\n"); break;
-    case TOKEN_IF: printf("IF_MODIFIER\n"); break;
-    case TOKEN_LESS_EQUAL: printf("LESS_EQUAL\n"); break;
-    case TOKEN_LESS: printf("LESS\n"); break;
-    case TOKEN_MINUS: printf("SUBTRACT\n"); break;
-    case TOKEN_OR: printf("COMPOSITION_OR\n"); break;
-    case TOKEN_PERCENT: printf("MODULO\n"); break;
-    case TOKEN_PIPE: printf("BITWISE_OR\n"); break;
-    case TOKEN_PLUS: printf("ADD\n"); break;
-    case TOKEN_RESCUE: printf("RESCUE_MODIFIER\n"); break;
-    case TOKEN_SHIFT_LEFT: printf("SHIFT_LEFT\n"); break;
-    case TOKEN_SHIFT_RIGHT: printf("SHIFT_RIGHT\n"); break;
-    case TOKEN_SLASH: printf("DIVIDE\n"); break;
-    case TOKEN_STAR: printf("MULTIPLY\n"); break;
-    case TOKEN_TRIPLE_DOT: printf("RANGE_EXCLUSIVE\n"); break;
-    case TOKEN_TRIPLE_EQUAL: printf("TRIPLE_EQUAL\n"); break;
-    case TOKEN_UNLESS: printf("UNLESS_MODIFIER\n"); break;
-    case TOKEN_UNTIL: printf("UNTIL_MODIFIER\n"); break;
-    case TOKEN_WHILE: printf("WHILE_MODIFIER\n"); break;
-    default: printf("???\n"); break;
+    case TOKEN_AMPERSAND: fprintf(output(data), "BITWISE_AND\n"); break;
+    case TOKEN_AND: fprintf(output(data), "COMPOSITION_AND\n"); break;
+    case TOKEN_BANG_EQUAL: fprintf(output(data), "BANG_EQUAL\n"); break;
+    case TOKEN_BANG_TILDE: fprintf(output(data), "BANG_TILDE\n"); break;
+    case TOKEN_CARET: fprintf(output(data), "BITWISE_XOR\n"); break;
+    case TOKEN_COMPARE: fprintf(output(data), "COMPARE\n"); break;
+    case TOKEN_DOUBLE_AMPERSAND: fprintf(output(data), "LOGICAL_AND\n"); break;
+    case TOKEN_DOUBLE_DOT: fprintf(output(data), "RANGE_INCLUSIVE\n"); break;
+    case TOKEN_DOUBLE_EQUAL: fprintf(output(data), "DOUBLE_EQUAL\n"); break;
+    case TOKEN_DOUBLE_PIPE: fprintf(output(data), "LOGICAL_OR\n"); break;
+    case TOKEN_DOUBLE_STAR: fprintf(output(data), "EXPONENT\n"); break;
+    case TOKEN_EQUAL_TILDE: fprintf(output(data), "EQUAL_TILDE\n"); break;
+    case TOKEN_GREATER_EQUAL: fprintf(output(data), "GREATER_EQUAL\n"); break;
+    case TOKEN_GREATER: fprintf(output(data), "GREATER\n"); break;
+    case TOKEN_IF: fprintf(output(data), "IF_MODIFIER\n"); break;
+    case TOKEN_LESS_EQUAL: fprintf(output(data), "LESS_EQUAL\n"); break;
+    case TOKEN_LESS: fprintf(output(data), "LESS\n"); break;
+    case TOKEN_MINUS: fprintf(output(data), "SUBTRACT\n"); break;
+    case TOKEN_OR: fprintf(output(data), "COMPOSITION_OR\n"); break;
+    case TOKEN_PERCENT: fprintf(output(data), "MODULO\n"); break;
+    case TOKEN_PIPE: fprintf(output(data), "BITWISE_OR\n"); break;
+    case TOKEN_PLUS: fprintf(output(data), "ADD\n"); break;
+    case TOKEN_RESCUE: fprintf(output(data), "RESCUE_MODIFIER\n"); break;
+    case TOKEN_SHIFT_LEFT: fprintf(output(data), "SHIFT_LEFT\n"); break;
+    case TOKEN_SHIFT_RIGHT: fprintf(output(data), "SHIFT_RIGHT\n"); break;
+    case TOKEN_SLASH: fprintf(output(data), "DIVIDE\n"); break;
+    case TOKEN_STAR: fprintf(output(data), "MULTIPLY\n"); break;
+    case TOKEN_TRIPLE_DOT: fprintf(output(data), "RANGE_EXCLUSIVE\n"); break;
+    case TOKEN_TRIPLE_EQUAL: fprintf(output(data), "TRIPLE_EQUAL\n"); break;
+    case TOKEN_UNLESS: fprintf(output(data), "UNLESS_MODIFIER\n"); break;
+    case TOKEN_UNTIL: fprintf(output(data), "UNTIL_MODIFIER\n"); break;
+    case TOKEN_WHILE: fprintf(output(data), "WHILE_MODIFIER\n"); break;
+    default: fprintf(output(data), "???\n"); break;
   }
 }
 
-static void defined(UNUSED token_t *keyword) {
-  printf("DEFINED\n");
+static void defined(void *data, UNUSED token_t *keyword) {
+  fprintf(output(data), "DEFINED\n");
 }
 
-static void group(UNUSED token_t *opening, UNUSED token_t *closing) {
-  printf("GROUP\n");
+static void group(void *data, UNUSED token_t *opening, UNUSED token_t *closing) {
+  fprintf(output(data), "GROUP\n");
 }
 
-static void index_call(UNUSED token_t *opening, UNUSED token_t *closing) {
-  printf("INDEX_CALL\n");
+static void index_call(void *data, UNUSED token_t *opening, UNUSED token_t *closing) {
+  fprintf(output(data), "INDEX_CALL\n");
 }
 
-static void index_expr(UNUSED token_t *opening, UNUSED token_t *closing) {
-  printf("INDEX\n");
+static void index_expr(void *data, UNUSED token_t *opening, UNUSED token_t *closing) {
+  fprintf(output(data), "INDEX\n");
 }
 
-static void literal(token_t *value) {
+static void literal(void *data, token_t *value) {
   switch (value->type) {
-    case TOKEN_FALSE: printf("FALSE\n"); return;
-    case TOKEN_NIL: printf("NIL\n"); return;
-    case TOKEN_SELF: printf("SELF\n"); return;
-    case TOKEN_TRUE: printf("TRUE\n"); return;
-
-    case TOKEN_BACK_REFERENCE: printf("BACK_REFERENCE"); break;
-    case TOKEN_GLOBAL_VARIABLE: printf("GLOBAL_VARIABLE"); break;
-    case TOKEN_IDENTIFIER: printf("VCALL"); break;
-    case TOKEN_INTEGER: printf("INTEGER"); break;
-    case TOKEN_METHOD_IDENTIFIER: printf("FCALL"); break;
-    case TOKEN_NTH_REFERENCE: printf("NTH_REFERENCE"); break;
-
-    default: printf("???"); break;
+    case TOKEN_FALSE: fprintf(output(data), "FALSE\n"); return;
+    case TOKEN_NIL: fprintf(output(data), "NIL\n"); return;
+    case TOKEN_SELF: fprintf(output(data), "SELF\n"); return;
+    case TOKEN_TRUE: fprintf(output(data), "TRUE\n"); return;
+
+    case TOKEN_BACK_REFERENCE: fprintf(output(data), "BACK_REFERENCE"); break;
+    case TOKEN_GLOBAL_VARIABLE: fprintf(output(data), "GLOBAL_VARIABLE"); break;
+    case TOKEN_IDENTIFIER: fprintf(output(data), "VCALL"); break;
+    case TOKEN_INTEGER: fprintf(output(data), "INTEGER"); break;
+    case TOKEN_METHOD_IDENTIFIER: fprintf(output(data), "FCALL"); break;
+    case TOKEN_NTH_REFERENCE: fprintf(output(data), "NTH_REFERENCE"); break;
+
+    default: fprintf(output(data), "???"); break;
   }
 
-  printf("=%.*s\n", (int) (value->end - value->start), value->start);
+  fprintf(output(data), "=%.*s\n", (int) (value->end - value->start), value->start);
 }
 
-static void not(UNUSED token_t *keyword) {
-  printf("NOT\n");
+static void not(void *data, UNUSED token_t *keyword) {
+  fprintf(output(data), "NOT\n");
 }
 
-static void ternary(void) {
-  printf("TERNARY\n");
+static void ternary(void *data) {
+  fprintf(output(data), "TERNARY\n");
 }
 
-static void unary(token_t *operator) {
+static void unary(void *data, token_t *operator) {
   switch (operator->type) {
-    case TOKEN_MINUS: printf("UMINUS\n"); break;
-    case TOKEN_BANG: printf("UBANG\n"); break;
-    case TOKEN_TILDE: printf("UTILDE\n"); break;
-    case TOKEN_PLUS: printf("UPLUS\n"); break;
-    case TOKEN_TRIPLE_DOT: printf("BEGINLESS_RANGE_EXCLUSIVE\n"); break;
-    case TOKEN_DOUBLE_DOT: printf("BEGINLESS_RANGE_INCLUSIVE\n"); break;
-    default: printf("???\n"); break;
+    case TOKEN_MINUS: fprintf(output(data), "UMINUS\n"); break;
+    case TOKEN_BANG: fprintf(output(data), "UBANG\n"); break;
+    case TOKEN_TILDE: fprintf(output(data), "UTILDE\n"); break;
+    case TOKEN_PLUS: fprintf(output(data), "UPLUS\n"); break;
+    case TOKEN_TRIPLE_DOT: fprintf(output(data), "BEGINLESS_RANGE_EXCLUSIVE\n"); break;
+    case TOKEN_DOUBLE_DOT: fprintf(output(data), "BEGINLESS_RANGE_INCLUSIVE\n"); break;
+    default: fprintf(output(data), "???\n"); break;
   }
 }
 
-static void while_block(UNUSED token_t *keyword) {
-  printf("WHILE\n");
+static void while_block(void *data, UNUSED token_t *keyword) {
+  fprintf(output(data), "WHILE\n");
 }
 
-static void until_block(UNUSED token_t *keyword) {
-  printf("UNTIL\n");
+static void until_block(void *data, UNUSED token_t *keyword) {
+  fprintf(output(data), "UNTIL\n");
 }
 
 #undef UNUSED
 
-visitor_t printer = {
+const visitor_t printer = {
+  .data = NULL,
   .array = array,
   .assign = assign,
   .begin = begin,
@@ -150,3 +157,19 @@ visitor_t printer = {
   .until_block = until_block,
   .while_block = while_block
 };
+
+// Prints a line for a token in the same shape as the output of Ripper.lex, so
+// that the tests can compare the two. The data is a token_printer_t.
+void print_token(void *data, token_t *token) {
+  token_printer_t *token_printer = data;
+
+  fprintf(
+    token_printer->stream,
+    "%ld-%ld %s %.*s\n",
+    token->start - token_printer->source,
+    token->end - token_printer->source,
+    ripper_event(token->type),
+    (int) (token->end - token->start),
+    token->start
+  );
+}
@@ -0,0 +1,159 @@
+#include <errno.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "parse.h"
+
+static const char *counter_names[COUNTER_MAXIMUM] = {
+  [COUNTER_CYCLES] = "cycles",
+  [COUNTER_INSTRUCTIONS] = "instructions",
+  [COUNTER_BRANCH_MISSES] = "branch-misses",
+  [COUNTER_L1D_MISSES] = "L1d-misses",
+  [COUNTER_LLC_MISSES] = "LLC-misses"
+};
+
+const char * counter_name(counter_type_t type) {
+  return counter_names[type];
+}
+
+#ifdef __linux__
+// Opens one counter for the calling thread in user space. The group leader is
+// opened disabled, and the rest of the group follows it.
+static int counter_open(counter_type_t type, int group) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+
+  attr.size = sizeof(attr);
+  attr.disabled = group == -1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+  switch (type) {
+    case COUNTER_CYCLES:
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_CPU_CYCLES;
+      break;
+    case COUNTER_INSTRUCTIONS:
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+      break;
+    case COUNTER_BRANCH_MISSES:
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+      break;
+    case COUNTER_L1D_MISSES:
+      attr.type = PERF_TYPE_HW_CACHE;
+      attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+      break;
+    case COUNTER_LLC_MISSES:
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_CACHE_MISSES;
+      break;
+    case COUNTER_MAXIMUM:
+      return -1;
+  }
+
+  return (int) syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+#endif
+
+// Opens as many of the counters as the machine and its permissions allow, as
+// a single group so that they all count over exactly the same instructions.
+// The first counter that opens leads the group. Returns false if none of them
+// could be opened (no permission, or a VM without a PMU), leaving the errno
+// from the first attempt in error. Counting still works after that, it just
+// reports every counter as unavailable.
+bool counters_open(counters_t *counters) {
+  *counters = (counters_t) { .leader = -1 };
+
+#ifdef __linux__
+  for (counter_type_t type = 0; type < COUNTER_MAXIMUM; type++) {
+    int fd = counter_open(type, counters->leader);
+
+    if (fd == -1) {
+      if (counters->error == 0) counters->error = errno;
+      continue;
+    }
+
+    if (counters->leader == -1) counters->leader = fd;
+    counters->fds[counters->size] = fd;
+    counters->types[counters->size++] = type;
+  }
+
+  if (counters->leader != -1) counters->error = 0;
+#else
+  counters->error = ENOSYS;
+#endif
+
+  return counters->leader != -1;
+}
+
+void counters_close(counters_t *counters) {
+#ifdef __linux__
+  for (size_t index = 0; index < counters->size; index++) {
+    close(counters->fds[index]);
+  }
+#endif
+
+  *counters = (counters_t) { .leader = -1 };
+}
+
+void counters_start(counters_t *counters) {
+#ifdef __linux__
+  if (counters->leader != -1) {
+    ioctl(counters->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(counters->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+#else
+  (void) counters;
+#endif
+}
+
+// Stops counting and reads every counter in the group at once. If the kernel
+// had to multiplex the group with other events, the counts are scaled up by
+// the share of the time that it was actually counting. Counters that aren't
+// open, or a group that never got to count, come back as -1.
+void counters_stop(counters_t *counters, counts_t *counts) {
+  for (size_t type = 0; type < COUNTER_MAXIMUM; type++) {
+    counts->values[type] = -1;
+  }
+
+#ifdef __linux__
+  if (counters->leader == -1) return;
+  ioctl(counters->leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+  // The group read format: the number of counters, the time enabled, the
+  // time running, and then each value in the order they joined the group.
+  uint64_t values[3 + COUNTER_MAXIMUM];
+  ssize_t length = read(counters->leader, values, (3 + counters->size) * sizeof(uint64_t));
+
+  if (length != (ssize_t) ((3 + counters->size) * sizeof(uint64_t)) || values[0] != counters->size || values[2] == 0) {
+    return;
+  }
+
+  double scale = (double) values[1] / (double) values[2];
+  for (size_t index = 0; index < counters->size; index++) {
+    counts->values[counters->types[index]] = (long long) ((double) values[3 + index] * scale);
+  }
+#else
+  (void) counters;
+#endif
+}
+
+// Adds one set of counts to a running total. A counter that's unavailable in
+// either one is unavailable in the total.
+void counts_add(counts_t *total, const counts_t *counts) {
+  for (size_t type = 0; type < COUNTER_MAXIMUM; type++) {
+    if (total->values[type] < 0 || counts->values[type] < 0) {
+      total->values[type] = -1;
+    } else {
+      total->values[type] += counts->values[type];
+    }
+  }
+}
@@ -10,7 +10,7 @@ static size_t alnum(const char *value) {
   return 0;
 }
 
-encoding_t ascii = {
+const encoding_t ascii = {
   .name = "ASCII",
   .alnum = alnum
 };
@@ -0,0 +1,97 @@
+#include "parse.h"
+
+// Returns a mask with the bit (1 << type) set for every kind of node that the
+// visitor has a callback for. The parser and events_replay check it before
+// building the tokens for a node, so that uninteresting nodes cost nothing.
+unsigned int visitor_interest(const visitor_t *visitor) {
+  unsigned int interest = 0;
+
+  if (visitor->array != NULL) interest |= 1u << NODE_ARRAY;
+  if (visitor->assign != NULL) interest |= 1u << NODE_ASSIGN;
+  if (visitor->begin != NULL) interest |= 1u << NODE_BEGIN;
+  if (visitor->binary != NULL) interest |= 1u << NODE_BINARY;
+  if (visitor->defined != NULL) interest |= 1u << NODE_DEFINED;
+  if (visitor->group != NULL) interest |= 1u << NODE_GROUP;
+  if (visitor->index_call != NULL) interest |= 1u << NODE_INDEX_CALL;
+  if (visitor->index_expr != NULL) interest |= 1u << NODE_INDEX_EXPR;
+  if (visitor->literal != NULL) interest |= 1u << NODE_LITERAL;
+  if (visitor->not != NULL) interest |= 1u << NODE_NOT;
+  if (visitor->ternary != NULL) interest |= 1u << NODE_TERNARY;
+  if (visitor->unary != NULL) interest |= 1u << NODE_UNARY;
+  if (visitor->until_block != NULL) interest |= 1u << NODE_UNTIL_BLOCK;
+  if (visitor->while_block != NULL) interest |= 1u << NODE_WHILE_BLOCK;
+
+  return interest;
+}
+
+// Calls the callback on the visitor that corresponds to the given type of node.
+// The callback must not be NULL, so callers check visitor_interest first.
+void visitor_visit(const visitor_t *visitor, node_type_t type, token_t *token, token_t *closing, size_t size) {
+  void *data = visitor->data;
+
+  switch (type) {
+    case NODE_ARRAY: visitor->array(data, token, closing, size); break;
+    case NODE_ASSIGN: visitor->assign(data, token); break;
+    case NODE_BEGIN: visitor->begin(data, token, closing); break;
+    case NODE_BINARY: visitor->binary(data, token); break;
+    case NODE_DEFINED: visitor->defined(data, token); break;
+    case NODE_GROUP: visitor->group(data, token, closing); break;
+    case NODE_INDEX_CALL: visitor->index_call(data, token, closing); break;
+    case NODE_INDEX_EXPR: visitor->index_expr(data, token, closing); break;
+    case NODE_LITERAL: visitor->literal(data, token); break;
+    case NODE_NOT: visitor->not(data, token); break;
+    case NODE_TERNARY: visitor->ternary(data); break;
+    case NODE_UNARY: visitor->unary(data, token); break;
+    case NODE_UNTIL_BLOCK: visitor->until_block(data, token); break;
+    case NODE_WHILE_BLOCK: visitor->while_block(data, token); break;
+    case NODE_MAXIMUM: break;
+  }
+}
+
+// Replays a recorded array of events into a visitor. The visitor sees exactly
+// the same sequence of calls that it would have seen had it been passed to the
+// parse directly. The source must be the same source that was recorded.
+void events_replay(const event_t *events, size_t count, const char *source, const visitor_t *visitor) {
+  unsigned int interest = visitor_interest(visitor);
+
+  for (size_t index = 0; index < count; index++) {
+    const event_t *event = &events[index];
+    if (!(interest & (1u << event->type))) continue;
+
+    token_t token = {
+      .type = event->token,
+      .start = source + event->start,
+      .end = source + event->end
+    };
+
+    token_t closing = {
+      .type = event->closing,
+      .start = source + event->closing_start,
+      .end = source + event->closing_end
+    };
+
+    visitor_visit(visitor, event->type, &token, &closing, event->size);
+  }
+}
+
+// Finds the subtrees that exactly cover the events in [start, end) and writes
+// the index of the root of each one into indices in source order, returning
+// how many there were. This is how the array is walked as a tree without ever
+// building one. The children of the event at index i are the subtrees of
+// [i + 1 - span, i), and the top-level statements are the subtrees of
+// [0, count). indices must have room for one entry per subtree, which for
+// children is the event's children field.
+size_t events_subtrees(const event_t *events, size_t start, size_t end, size_t *indices) {
+  size_t count = 0;
+
+  for (size_t index = end; index > start; index -= events[index - 1].span) {
+    count++;
+  }
+
+  size_t position = count;
+  for (size_t index = end; index > start; index -= events[index - 1].span) {
+    indices[--position] = index - 1;
+  }
+
+  return count;
+}
@@ -0,0 +1,209 @@
+#include "parse.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+// Returns a vector with 0xff in each byte that is between low and high.
+static inline __m128i index_range(__m128i bytes, char low, char high) {
+  __m128i shifted = _mm_sub_epi8(bytes, _mm_set1_epi8(low));
+  return _mm_cmpeq_epi8(_mm_min_epu8(shifted, _mm_set1_epi8((char) (high - low))), shifted);
+}
+
+static inline __m128i index_equal(__m128i bytes, char value) {
+  return _mm_cmpeq_epi8(bytes, _mm_set1_epi8(value));
+}
+
+static inline uint64_t index_mask(__m128i matches, unsigned int shift) {
+  return (uint64_t) (uint16_t) _mm_movemask_epi8(matches) << shift;
+}
+
+// Classifies 64 bytes at a time, 16 bytes per vector. Each class is a handful
+// of comparisons whose results are packed into bits with movemask.
+static void index_block(const char *block, uint64_t *masks) {
+  for (unsigned int shift = 0; shift < 64; shift += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *) (block + shift));
+
+    __m128i whitespace = _mm_or_si128(
+      index_equal(bytes, ' '),
+      _mm_andnot_si128(index_equal(bytes, '\n'), index_range(bytes, '\t', '\r'))
+    );
+
+    __m128i bracket = _mm_or_si128(
+      index_range(bytes, '(', ')'),
+      _mm_or_si128(index_equal(bytes, '['), index_equal(bytes, ']'))
+    );
+
+    // ! % & ( ) * + , - . / : ; < = > ? [ ] ^ | ~
+    __m128i operator = _mm_or_si128(
+      _mm_or_si128(
+        _mm_or_si128(index_equal(bytes, '!'), index_range(bytes, '%', '&')),
+        _mm_or_si128(index_range(bytes, '(', '/'), index_range(bytes, ':', '?'))
+      ),
+      _mm_or_si128(
+        _mm_or_si128(index_equal(bytes, '['), index_range(bytes, ']', '^')),
+        _mm_or_si128(index_equal(bytes, '|'), index_equal(bytes, '~'))
+      )
+    );
+
+    __m128i digit = index_range(bytes, '0', '9');
+    __m128i identifier = _mm_or_si128(
+      _mm_or_si128(digit, index_equal(bytes, '_')),
+      index_range(_mm_or_si128(bytes, _mm_set1_epi8(0x20)), 'a', 'z')
+    );
+
+    masks[INDEX_NEWLINE] |= index_mask(index_equal(bytes, '\n'), shift);
+    masks[INDEX_WHITESPACE] |= index_mask(whitespace, shift);
+    masks[INDEX_BRACKET] |= index_mask(bracket, shift);
+    masks[INDEX_OPERATOR] |= index_mask(operator, shift);
+    masks[INDEX_IDENTIFIER] |= index_mask(identifier, shift);
+    masks[INDEX_DOLLAR] |= index_mask(index_equal(bytes, '$'), shift);
+    masks[INDEX_DIGIT] |= index_mask(digit, shift);
+  }
+}
+
+#else
+
+// Returns a mask with a bit set for each class that the given byte is in.
+static unsigned int index_classify(unsigned char value) {
+  unsigned int classes = 0;
+
+  switch (value) {
+    case '\n':
+      classes |= 1 << INDEX_NEWLINE;
+      break;
+    case ' ': case '\t': case '\f': case '\r': case '\v':
+      classes |= 1 << INDEX_WHITESPACE;
+      break;
+    case '(': case ')': case '[': case ']':
+      classes |= 1 << INDEX_BRACKET | 1 << INDEX_OPERATOR;
+      break;
+    case '!': case '%': case '&': case '*': case '+': case ',': case '-':
+    case '.': case '/': case ':': case ';': case '<': case '=': case '>':
+    case '?': case '^': case '|': case '~':
+      classes |= 1 << INDEX_OPERATOR;
+      break;
+    case '$':
+      classes |= 1 << INDEX_DOLLAR;
+      break;
+    case '_':
+      classes |= 1 << INDEX_IDENTIFIER;
+      break;
+    default:
+      if (value >= '0' && value <= '9') {
+        classes |= 1 << INDEX_DIGIT | 1 << INDEX_IDENTIFIER;
+      } else if ((value >= 'a' && value <= 'z') || (value >= 'A' && value <= 'Z')) {
+        classes |= 1 << INDEX_IDENTIFIER;
+      }
+      break;
+  }
+
+  return classes;
+}
+
+// The portable path, which classifies a byte at a time.
+static void index_block(const char *block, uint64_t *masks) {
+  for (unsigned int offset = 0; offset < 64; offset++) {
+    unsigned int classes = index_classify((unsigned char) block[offset]);
+
+    for (unsigned int class = 0; class < INDEX_MAXIMUM; class++) {
+      masks[class] |= (uint64_t) ((classes >> class) & 1) << offset;
+    }
+  }
+}
+
+#endif
+
+// Builds the structural index for the given source, reusing the bitmaps from
+// a previous build when they're large enough. Returns false if they can't be
+// allocated.
+bool index_build(index_t *index, size_t size, const char *source) {
+  size_t blocks = (size + 63) / 64;
+
+  if (blocks > index->capacity) {
+    uint64_t *bitmaps = malloc(blocks * INDEX_MAXIMUM * sizeof(uint64_t));
+    if (bitmaps == NULL) return false;
+
+    size_t *lines = malloc((blocks / INDEX_LINE_STRIDE + 1) * sizeof(size_t));
+    if (lines == NULL) {
+      free(bitmaps);
+      return false;
+    }
+
+    free(index->bitmaps[0]);
+    free(index->lines);
+
+    for (size_t class = 0; class < INDEX_MAXIMUM; class++) {
+      index->bitmaps[class] = bitmaps + class * blocks;
+    }
+    index->lines = lines;
+    index->capacity = blocks;
+  }
+
+  index->blocks = blocks;
+  size_t newlines = 0;
+
+  for (size_t block = 0; block < blocks; block++) {
+    uint64_t masks[INDEX_MAXIMUM] = { 0 };
+
+    // The last block is copied out so that we never read past the end of the
+    // source, with the rest of it zeroed so that it isn't in any class.
+    if ((block + 1) * 64 <= size) {
+      index_block(source + block * 64, masks);
+    } else {
+      char tail[64] = { 0 };
+      memcpy(tail, source + block * 64, size - block * 64);
+      index_block(tail, masks);
+    }
+
+    for (size_t class = 0; class < INDEX_MAXIMUM; class++) {
+      index->bitmaps[class][block] = masks[class];
+    }
+
+    if (block % INDEX_LINE_STRIDE == 0) index->lines[block / INDEX_LINE_STRIDE] = newlines;
+    newlines += (size_t) __builtin_popcountll(masks[INDEX_NEWLINE]);
+  }
+
+  // The count at the very end, for offsets there when it falls on a stride.
+  if (blocks % INDEX_LINE_STRIDE == 0 && blocks > 0) index->lines[blocks / INDEX_LINE_STRIDE] = newlines;
+  return true;
+}
+
+void index_free(index_t *index) {
+  free(index->bitmaps[0]);
+  free(index->lines);
+  *index = (index_t) { .blocks = 0 };
+}
+
+// Returns the line number (starting at 1) of the byte at the given offset, and
+// sets start (if it isn't NULL) to the offset that the line starts at. Lines
+// are counted from the nearest running count, so this takes at most
+// INDEX_LINE_STRIDE popcounts plus a scan back over the line for its start.
+// Offsets past the end of the index are taken as the end.
+size_t index_line(const index_t *index, size_t offset, size_t *start) {
+  const uint64_t *newlines = index->bitmaps[INDEX_NEWLINE];
+  if (offset > index->blocks * 64) offset = index->blocks * 64;
+
+  size_t block = offset / 64;
+  size_t line = 1;
+
+  if (block > 0 || offset % 64 != 0) {
+    size_t word = block / INDEX_LINE_STRIDE * INDEX_LINE_STRIDE;
+    line += index->lines[word / INDEX_LINE_STRIDE];
+
+    for (; word < block; word++) {
+      line += (size_t) __builtin_popcountll(newlines[word]);
+    }
+  }
+
+  // The newlines before the offset in its own word, which is only partly
+  // before it (and doesn't exist when the offset is the end of the index).
+  uint64_t before = offset % 64 == 0 ? 0 : newlines[block] & (UINT64_MAX >> (64 - offset % 64));
+  line += (size_t) __builtin_popcountll(before);
+
+  if (start != NULL) {
+    while (before == 0 && block > 0) before = newlines[--block];
+    *start = before == 0 ? 0 : block * 64 + (size_t) (64 - __builtin_clzll(before));
+  }
+
+  return line;
+}
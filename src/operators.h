@@ -0,0 +1,538 @@
+// This file is generated by bin/operators.rb. Do not edit it directly.
+
+// Use the threaded state machine wherever computed gotos are supported,
+// unless the switch has been asked for explicitly.
+#if defined(__GNUC__) && !defined(PARSE_OPERATOR_SWITCH)
+#define OPERATOR_THREADED
+#endif
+
+#ifdef OPERATOR_THREADED
+#define OPERATOR_STATES 51
+#define OPERATOR_CLASSES 23
+
+// The byte class of every byte, where class 0 never continues an operator.
+static const uint8_t operator_classes[256] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 1, 0, 0, 0, 2, 3, 0, 4, 5, 6, 7, 8, 9, 10, 11,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 12, 13, 14, 15, 16, 17,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 18, 0, 19, 20, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 21, 0, 22, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+// The state to move to from each state on each byte class, or 0 if the
+// operator ends before the byte.
+static const uint8_t operator_transitions[OPERATOR_STATES][OPERATOR_CLASSES] = {
+  { 0, 48, 33, 35, 5, 6, 27, 23, 1, 25, 45, 31, 3, 2, 14, 10, 19, 4, 7, 8, 43, 39, 9 }, // start
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, // ,
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, // ;
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, // :
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, // ?
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, // (
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, // )
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, // [
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, // ]
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, // ~
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 12, 0, 0, 0, 0, 0, 0, 11 }, // =
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, // =~
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 13, 0, 0, 0, 0, 0, 0, 0 }, // ==
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, // ===
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 15, 17, 0, 0, 0, 0, 0, 0, 0 }, // <
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 16, 0, 0, 0, 0, 0, 0, 0 }, // <<
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, // <<=
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 18, 0, 0, 0, 0, 0, 0 }, // <=
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, // <=>
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 22, 20, 0, 0, 0, 0, 0, 0 }, // >
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 21, 0, 0, 0, 0, 0, 0, 0 }, // >>
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, // >>=
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, // >=
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 24, 0, 0, 0, 0, 0, 0, 0 }, // +
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, // +=
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 26, 0, 0, 0, 0, 0, 0, 0 }, // -
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, // -=
+  { 0, 0, 0, 0, 0, 0, 28, 0, 0, 0, 0, 0, 0, 0, 0, 30, 0, 0, 0, 0, 0, 0, 0 }, // *
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 29, 0, 0, 0, 0, 0, 0, 0 }, // **
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, // **=
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, // *=
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 32, 0, 0, 0, 0, 0, 0, 0 }, // /
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, // /=
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 34, 0, 0, 0, 0, 0, 0, 0 }, // %
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, // %=
+  { 0, 0, 0, 36, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 38, 0, 0, 0, 0, 0, 0, 0 }, // &
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 37, 0, 0, 0, 0, 0, 0, 0 }, // &&
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, // &&=
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, // &=
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 42, 0, 0, 0, 0, 0, 40, 0 }, // |
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 41, 0, 0, 0, 0, 0, 0, 0 }, // ||
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, // ||=
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, // |=
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 44, 0, 0, 0, 0, 0, 0, 0 }, // ^
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, // ^=
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 46, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, // .
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 47, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, // ..
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, // ...
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 50, 0, 0, 0, 0, 0, 0, 49 }, // !
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, // !~
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, // !=
+};
+
+// The token that is returned when the operator ends in each state.
+static const uint8_t operator_tokens[OPERATOR_STATES] = {
+  TOKEN_EOF,
+  TOKEN_COMMA, // ,
+  TOKEN_SEMICOLON, // ;
+  TOKEN_COLON, // :
+  TOKEN_QUESTION_MARK, // ?
+  TOKEN_LEFT_PARENTHESIS, // (
+  TOKEN_RIGHT_PARENTHESIS, // )
+  TOKEN_LEFT_BRACKET, // [
+  TOKEN_RIGHT_BRACKET, // ]
+  TOKEN_TILDE, // ~
+  TOKEN_EQUAL, // =
+  TOKEN_EQUAL_TILDE, // =~
+  TOKEN_DOUBLE_EQUAL, // ==
+  TOKEN_TRIPLE_EQUAL, // ===
+  TOKEN_LESS, // <
+  TOKEN_SHIFT_LEFT, // <<
+  TOKEN_SHIFT_LEFT_EQUAL, // <<=
+  TOKEN_LESS_EQUAL, // <=
+  TOKEN_COMPARE, // <=>
+  TOKEN_GREATER, // >
+  TOKEN_SHIFT_RIGHT, // >>
+  TOKEN_SHIFT_RIGHT_EQUAL, // >>=
+  TOKEN_GREATER_EQUAL, // >=
+  TOKEN_PLUS, // +
+  TOKEN_PLUS_EQUAL, // +=
+  TOKEN_MINUS, // -
+  TOKEN_MINUS_EQUAL, // -=
+  TOKEN_STAR, // *
+  TOKEN_DOUBLE_STAR, // **
+  TOKEN_DOUBLE_STAR_EQUAL, // **=
+  TOKEN_STAR_EQUAL, // *=
+  TOKEN_SLASH, // /
+  TOKEN_SLASH_EQUAL, // /=
+  TOKEN_PERCENT, // %
+  TOKEN_PERCENT_EQUAL, // %=
+  TOKEN_AMPERSAND, // &
+  TOKEN_DOUBLE_AMPERSAND, // &&
+  TOKEN_DOUBLE_AMPERSAND_EQUAL, // &&=
+  TOKEN_AMPERSAND_EQUAL, // &=
+  TOKEN_PIPE, // |
+  TOKEN_DOUBLE_PIPE, // ||
+  TOKEN_DOUBLE_PIPE_EQUAL, // ||=
+  TOKEN_PIPE_EQUAL, // |=
+  TOKEN_CARET, // ^
+  TOKEN_CARET_EQUAL, // ^=
+  TOKEN_EOF, // .
+  TOKEN_DOUBLE_DOT, // ..
+  TOKEN_TRIPLE_DOT, // ...
+  TOKEN_BANG, // !
+  TOKEN_BANG_TILDE, // !~
+  TOKEN_BANG_EQUAL, // !=
+};
+#endif
+
+// The case labels for every byte that starts an operator.
+#define OPERATOR_CASES \
+  case ',': case ';': case ':': case '?': case '(': case ')': case '[': case ']': \
+  case '~': case '=': case '<': case '>': case '+': case '-': case '*': case '/': \
+  case '%': case '&': case '|': case '^': case '.': case '!':
+
+// Lexes the rest of an operator whose first byte has already been consumed
+// and returns its type.
+static inline token_type_t lex_operator(parser_t *parser) {
+#ifdef OPERATOR_THREADED
+  // Each state consumes the next byte and jumps straight to the state for its
+  // class. When there's no transition, we land on accept, which gives the
+  // byte back and returns the token for the last state we were in. Having an
+  // indirect jump per state (instead of one shared one) gives the branch
+  // predictor a separate history for each.
+  static void *const labels[OPERATOR_STATES] = {
+    &&accept,
+    &&state_1,
+    &&state_2,
+    &&state_3,
+    &&state_4,
+    &&state_5,
+    &&state_6,
+    &&state_7,
+    &&state_8,
+    &&state_9,
+    &&state_10,
+    &&state_11,
+    &&state_12,
+    &&state_13,
+    &&state_14,
+    &&state_15,
+    &&state_16,
+    &&state_17,
+    &&state_18,
+    &&state_19,
+    &&state_20,
+    &&state_21,
+    &&state_22,
+    &&state_23,
+    &&state_24,
+    &&state_25,
+    &&state_26,
+    &&state_27,
+    &&state_28,
+    &&state_29,
+    &&state_30,
+    &&state_31,
+    &&state_32,
+    &&state_33,
+    &&state_34,
+    &&state_35,
+    &&state_36,
+    &&state_37,
+    &&state_38,
+    &&state_39,
+    &&state_40,
+    &&state_41,
+    &&state_42,
+    &&state_43,
+    &&state_44,
+    &&state_45,
+    &&state_46,
+    &&state_47,
+    &&state_48,
+    &&state_49,
+    &&state_50,
+  };
+
+  uint8_t state = 0;
+  goto *labels[operator_transitions[0][operator_classes[(unsigned char) parser->current.end[-1]]]];
+
+state_1: // ,
+  return TOKEN_COMMA;
+state_2: // ;
+  return TOKEN_SEMICOLON;
+state_3: // :
+  return TOKEN_COLON;
+state_4: // ?
+  return TOKEN_QUESTION_MARK;
+state_5: // (
+  return TOKEN_LEFT_PARENTHESIS;
+state_6: // )
+  return TOKEN_RIGHT_PARENTHESIS;
+state_7: // [
+  return TOKEN_LEFT_BRACKET;
+state_8: // ]
+  return TOKEN_RIGHT_BRACKET;
+state_9: // ~
+  return TOKEN_TILDE;
+state_10: // =
+  state = 10;
+  goto *labels[operator_transitions[10][operator_classes[(unsigned char) *parser->current.end++]]];
+state_11: // =~
+  return TOKEN_EQUAL_TILDE;
+state_12: // ==
+  state = 12;
+  goto *labels[operator_transitions[12][operator_classes[(unsigned char) *parser->current.end++]]];
+state_13: // ===
+  return TOKEN_TRIPLE_EQUAL;
+state_14: // <
+  state = 14;
+  goto *labels[operator_transitions[14][operator_classes[(unsigned char) *parser->current.end++]]];
+state_15: // <<
+  state = 15;
+  goto *labels[operator_transitions[15][operator_classes[(unsigned char) *parser->current.end++]]];
+state_16: // <<=
+  return TOKEN_SHIFT_LEFT_EQUAL;
+state_17: // <=
+  state = 17;
+  goto *labels[operator_transitions[17][operator_classes[(unsigned char) *parser->current.end++]]];
+state_18: // <=>
+  return TOKEN_COMPARE;
+state_19: // >
+  state = 19;
+  goto *labels[operator_transitions[19][operator_classes[(unsigned char) *parser->current.end++]]];
+state_20: // >>
+  state = 20;
+  goto *labels[operator_transitions[20][operator_classes[(unsigned char) *parser->current.end++]]];
+state_21: // >>=
+  return TOKEN_SHIFT_RIGHT_EQUAL;
+state_22: // >=
+  return TOKEN_GREATER_EQUAL;
+state_23: // +
+  state = 23;
+  goto *labels[operator_transitions[23][operator_classes[(unsigned char) *parser->current.end++]]];
+state_24: // +=
+  return TOKEN_PLUS_EQUAL;
+state_25: // -
+  state = 25;
+  goto *labels[operator_transitions[25][operator_classes[(unsigned char) *parser->current.end++]]];
+state_26: // -=
+  return TOKEN_MINUS_EQUAL;
+state_27: // *
+  state = 27;
+  goto *labels[operator_transitions[27][operator_classes[(unsigned char) *parser->current.end++]]];
+state_28: // **
+  state = 28;
+  goto *labels[operator_transitions[28][operator_classes[(unsigned char) *parser->current.end++]]];
+state_29: // **=
+  return TOKEN_DOUBLE_STAR_EQUAL;
+state_30: // *=
+  return TOKEN_STAR_EQUAL;
+state_31: // /
+  state = 31;
+  goto *labels[operator_transitions[31][operator_classes[(unsigned char) *parser->current.end++]]];
+state_32: // /=
+  return TOKEN_SLASH_EQUAL;
+state_33: // %
+  state = 33;
+  goto *labels[operator_transitions[33][operator_classes[(unsigned char) *parser->current.end++]]];
+state_34: // %=
+  return TOKEN_PERCENT_EQUAL;
+state_35: // &
+  state = 35;
+  goto *labels[operator_transitions[35][operator_classes[(unsigned char) *parser->current.end++]]];
+state_36: // &&
+  state = 36;
+  goto *labels[operator_transitions[36][operator_classes[(unsigned char) *parser->current.end++]]];
+state_37: // &&=
+  return TOKEN_DOUBLE_AMPERSAND_EQUAL;
+state_38: // &=
+  return TOKEN_AMPERSAND_EQUAL;
+state_39: // |
+  state = 39;
+  goto *labels[operator_transitions[39][operator_classes[(unsigned char) *parser->current.end++]]];
+state_40: // ||
+  state = 40;
+  goto *labels[operator_transitions[40][operator_classes[(unsigned char) *parser->current.end++]]];
+state_41: // ||=
+  return TOKEN_DOUBLE_PIPE_EQUAL;
+state_42: // |=
+  return TOKEN_PIPE_EQUAL;
+state_43: // ^
+  state = 43;
+  goto *labels[operator_transitions[43][operator_classes[(unsigned char) *parser->current.end++]]];
+state_44: // ^=
+  return TOKEN_CARET_EQUAL;
+state_45: // .
+  state = 45;
+  goto *labels[operator_transitions[45][operator_classes[(unsigned char) *parser->current.end++]]];
+state_46: // ..
+  state = 46;
+  goto *labels[operator_transitions[46][operator_classes[(unsigned char) *parser->current.end++]]];
+state_47: // ...
+  return TOKEN_TRIPLE_DOT;
+state_48: // !
+  state = 48;
+  goto *labels[operator_transitions[48][operator_classes[(unsigned char) *parser->current.end++]]];
+state_49: // !~
+  return TOKEN_BANG_TILDE;
+state_50: // !=
+  return TOKEN_BANG_EQUAL;
+accept:
+  parser->current.end--;
+  return operator_tokens[state];
+#else
+  switch (parser->current.end[-1]) {
+    case ',':
+      return TOKEN_COMMA;
+    case ';':
+      return TOKEN_SEMICOLON;
+    case ':':
+      return TOKEN_COLON;
+    case '?':
+      return TOKEN_QUESTION_MARK;
+    case '(':
+      return TOKEN_LEFT_PARENTHESIS;
+    case ')':
+      return TOKEN_RIGHT_PARENTHESIS;
+    case '[':
+      return TOKEN_LEFT_BRACKET;
+    case ']':
+      return TOKEN_RIGHT_BRACKET;
+    case '~':
+      return TOKEN_TILDE;
+    case '=':
+      switch (*parser->current.end) {
+        case '~':
+          parser->current.end++;
+          return TOKEN_EQUAL_TILDE;
+        case '=':
+          parser->current.end++;
+          switch (*parser->current.end) {
+            case '=':
+              parser->current.end++;
+              return TOKEN_TRIPLE_EQUAL;
+            default:
+              return TOKEN_DOUBLE_EQUAL;
+          }
+        default:
+          return TOKEN_EQUAL;
+      }
+    case '<':
+      switch (*parser->current.end) {
+        case '<':
+          parser->current.end++;
+          switch (*parser->current.end) {
+            case '=':
+              parser->current.end++;
+              return TOKEN_SHIFT_LEFT_EQUAL;
+            default:
+              return TOKEN_SHIFT_LEFT;
+          }
+        case '=':
+          parser->current.end++;
+          switch (*parser->current.end) {
+            case '>':
+              parser->current.end++;
+              return TOKEN_COMPARE;
+            default:
+              return TOKEN_LESS_EQUAL;
+          }
+        default:
+          return TOKEN_LESS;
+      }
+    case '>':
+      switch (*parser->current.end) {
+        case '>':
+          parser->current.end++;
+          switch (*parser->current.end) {
+            case '=':
+              parser->current.end++;
+              return TOKEN_SHIFT_RIGHT_EQUAL;
+            default:
+              return TOKEN_SHIFT_RIGHT;
+          }
+        case '=':
+          parser->current.end++;
+          return TOKEN_GREATER_EQUAL;
+        default:
+          return TOKEN_GREATER;
+      }
+    case '+':
+      switch (*parser->current.end) {
+        case '=':
+          parser->current.end++;
+          return TOKEN_PLUS_EQUAL;
+        default:
+          return TOKEN_PLUS;
+      }
+    case '-':
+      switch (*parser->current.end) {
+        case '=':
+          parser->current.end++;
+          return TOKEN_MINUS_EQUAL;
+        default:
+          return TOKEN_MINUS;
+      }
+    case '*':
+      switch (*parser->current.end) {
+        case '*':
+          parser->current.end++;
+          switch (*parser->current.end) {
+            case '=':
+              parser->current.end++;
+              return TOKEN_DOUBLE_STAR_EQUAL;
+            default:
+              return TOKEN_DOUBLE_STAR;
+          }
+        case '=':
+          parser->current.end++;
+          return TOKEN_STAR_EQUAL;
+        default:
+          return TOKEN_STAR;
+      }
+    case '/':
+      switch (*parser->current.end) {
+        case '=':
+          parser->current.end++;
+          return TOKEN_SLASH_EQUAL;
+        default:
+          return TOKEN_SLASH;
+      }
+    case '%':
+      switch (*parser->current.end) {
+        case '=':
+          parser->current.end++;
+          return TOKEN_PERCENT_EQUAL;
+        default:
+          return TOKEN_PERCENT;
+      }
+    case '&':
+      switch (*parser->current.end) {
+        case '&':
+          parser->current.end++;
+          switch (*parser->current.end) {
+            case '=':
+              parser->current.end++;
+              return TOKEN_DOUBLE_AMPERSAND_EQUAL;
+            default:
+              return TOKEN_DOUBLE_AMPERSAND;
+          }
+        case '=':
+          parser->current.end++;
+          return TOKEN_AMPERSAND_EQUAL;
+        default:
+          return TOKEN_AMPERSAND;
+      }
+    case '|':
+      switch (*parser->current.end) {
+        case '|':
+          parser->current.end++;
+          switch (*parser->current.end) {
+            case '=':
+              parser->current.end++;
+              return TOKEN_DOUBLE_PIPE_EQUAL;
+            default:
+              return TOKEN_DOUBLE_PIPE;
+          }
+        case '=':
+          parser->current.end++;
+          return TOKEN_PIPE_EQUAL;
+        default:
+          return TOKEN_PIPE;
+      }
+    case '^':
+      switch (*parser->current.end) {
+        case '=':
+          parser->current.end++;
+          return TOKEN_CARET_EQUAL;
+        default:
+          return TOKEN_CARET;
+      }
+    case '.':
+      switch (*parser->current.end) {
+        case '.':
+          parser->current.end++;
+          switch (*parser->current.end) {
+            case '.':
+              parser->current.end++;
+              return TOKEN_TRIPLE_DOT;
+            default:
+              return TOKEN_DOUBLE_DOT;
+          }
+        default:
+          return TOKEN_EOF;
+      }
+    case '!':
+      switch (*parser->current.end) {
+        case '~':
+          parser->current.end++;
+          return TOKEN_BANG_TILDE;
+        case '=':
+          parser->current.end++;
+          return TOKEN_BANG_EQUAL;
+        default:
+          return TOKEN_BANG;
+      }
+    default:
+      return TOKEN_EOF;
+  }
+#endif
+}
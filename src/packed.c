@@ -0,0 +1,177 @@
+#include "parse.h"
+
+#define PACKED_HEADER 24
+#define PACKED_ENTRY 16
+
+static inline void write_u32(uint8_t *output, uint32_t value) {
+  for (size_t index = 0; index < 4; index++) output[index] = (uint8_t) (value >> (index * 8));
+}
+
+static inline void write_u64(uint8_t *output, uint64_t value) {
+  for (size_t index = 0; index < 8; index++) output[index] = (uint8_t) (value >> (index * 8));
+}
+
+static inline uint32_t read_u32(const uint8_t *input) {
+  uint32_t value = 0;
+  for (size_t index = 0; index < 4; index++) value |= (uint32_t) input[index] << (index * 8);
+  return value;
+}
+
+static inline uint64_t read_u64(const uint8_t *input) {
+  uint64_t value = 0;
+  for (size_t index = 0; index < 8; index++) value |= (uint64_t) input[index] << (index * 8);
+  return value;
+}
+
+static inline uint8_t * varint_write(uint8_t *output, uint32_t value) {
+  while (value >= 0x80) {
+    *output++ = (uint8_t) (value | 0x80);
+    value >>= 7;
+  }
+
+  *output++ = (uint8_t) value;
+  return output;
+}
+
+// Reads a varint, returning NULL if it runs past the end or is too long. Most
+// gaps and lengths fit in a single byte, so that case is checked first.
+static inline const uint8_t * varint_read(const uint8_t *input, const uint8_t *end, uint32_t *value) {
+  if (input < end && *input < 0x80) {
+    *value = *input;
+    return input + 1;
+  }
+
+  uint32_t result = 0;
+  for (unsigned int shift = 0; shift < 35 && input < end; shift += 7) {
+    uint8_t byte = *input++;
+    result |= (uint32_t) (byte & 0x7f) << shift;
+
+    if (byte < 0x80) {
+      *value = result;
+      return input;
+    }
+  }
+
+  return NULL;
+}
+
+// Returns the most bytes that encoding the given number of tokens can take.
+size_t packed_bound(size_t count) {
+  size_t blocks = (count + PACKED_BLOCK - 1) / PACKED_BLOCK;
+  return PACKED_HEADER + blocks * PACKED_ENTRY + count * 11;
+}
+
+// Encodes the tokens into the output, which must have room for packed_bound
+// bytes, and returns the number of bytes written. The tokens must be in order
+// and not overlap.
+size_t packed_encode(const packed_token_t *tokens, size_t count, uint8_t *output) {
+  size_t blocks = (count + PACKED_BLOCK - 1) / PACKED_BLOCK;
+
+  memcpy(output, "RBPK", 4);
+  write_u32(output + 4, PACKED_VERSION);
+  write_u64(output + 8, count);
+  write_u64(output + 16, blocks);
+
+  uint8_t *index = output + PACKED_HEADER;
+  uint8_t *start = index + blocks * PACKED_ENTRY;
+  uint8_t *cursor = start;
+  uint32_t previous = 0;
+
+  for (size_t block = 0; block < blocks; block++) {
+    const packed_token_t *first = &tokens[block * PACKED_BLOCK];
+    size_t size = count - block * PACKED_BLOCK;
+    if (size > PACKED_BLOCK) size = PACKED_BLOCK;
+
+    uint8_t *data = cursor;
+    for (size_t offset = 0; offset < size; offset++) {
+      *cursor++ = first[offset].type;
+    }
+
+    uint32_t base = previous;
+    for (size_t offset = 0; offset < size; offset++) {
+      uint32_t gap = first[offset].start - previous;
+      uint32_t width = first[offset].end - first[offset].start;
+
+      if ((gap | width) < 0x80) {
+        cursor[0] = (uint8_t) gap;
+        cursor[1] = (uint8_t) width;
+        cursor += 2;
+      } else {
+        cursor = varint_write(cursor, gap);
+        cursor = varint_write(cursor, width);
+      }
+
+      previous = first[offset].end;
+    }
+
+    write_u64(index + block * PACKED_ENTRY, (uint64_t) (data - start));
+    write_u32(index + block * PACKED_ENTRY + 8, base);
+    write_u32(index + block * PACKED_ENTRY + 12, (uint32_t) (cursor - data));
+  }
+
+  return (size_t) (cursor - output);
+}
+
+// Checks the header of an encoded stream and fills in the reader. Returns false
+// if it isn't a stream in a version of the format that we understand.
+bool packed_open(packed_reader_t *reader, const uint8_t *data, size_t size) {
+  if (size < PACKED_HEADER || memcmp(data, "RBPK", 4) != 0 || read_u32(data + 4) != PACKED_VERSION) {
+    return false;
+  }
+
+  uint64_t count = read_u64(data + 8);
+  uint64_t blocks = read_u64(data + 16);
+
+  if (blocks != (count + PACKED_BLOCK - 1) / PACKED_BLOCK || blocks > (size - PACKED_HEADER) / PACKED_ENTRY) {
+    return false;
+  }
+
+  *reader = (packed_reader_t) { .data = data, .size = size, .count = count, .blocks = blocks };
+  return true;
+}
+
+// Decodes a single block into the given array, which must have room for
+// PACKED_BLOCK tokens, and returns the number of tokens in it. Returns 0 if
+// the block is out of range or malformed.
+size_t packed_decode(const packed_reader_t *reader, size_t block, packed_token_t *tokens) {
+  if (block >= reader->blocks) return 0;
+
+  const uint8_t *entry = reader->data + PACKED_HEADER + block * PACKED_ENTRY;
+  const uint8_t *start = reader->data + PACKED_HEADER + reader->blocks * PACKED_ENTRY;
+  uint64_t offset = read_u64(entry);
+  uint32_t previous = read_u32(entry + 8);
+  uint32_t length = read_u32(entry + 12);
+
+  size_t available = reader->size - (size_t) (start - reader->data);
+  if (offset > available || length > available - offset) return 0;
+
+  size_t size = reader->count - block * PACKED_BLOCK;
+  if (size > PACKED_BLOCK) size = PACKED_BLOCK;
+  if (size > length) return 0;
+
+  const uint8_t *types = start + offset;
+  const uint8_t *cursor = types + size;
+  const uint8_t *end = types + length;
+
+  for (size_t index = 0; index < size; index++) {
+    uint32_t gap;
+    uint32_t width;
+
+    // Almost every token has a gap and a length under 128, so check both
+    // bytes at once before falling back to decoding them one at a time.
+    if (end - cursor >= 2 && ((cursor[0] | cursor[1]) & 0x80) == 0) {
+      gap = cursor[0];
+      width = cursor[1];
+      cursor += 2;
+    } else {
+      if ((cursor = varint_read(cursor, end, &gap)) == NULL) return 0;
+      if ((cursor = varint_read(cursor, end, &width)) == NULL) return 0;
+    }
+
+    tokens[index].start = previous + gap;
+    tokens[index].end = previous = tokens[index].start + width;
+    tokens[index].type = types[index];
+  }
+
+  return size;
+}
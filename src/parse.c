@@ -1,5 +1,22 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
 #include "parse.h"
 
+// This file is compiled twice. On its own, it's the parser that visits or
+// records every node. check.c includes it again with PARSE_CHECK defined to
+// get a separate copy of the grammar in which building nodes compiles away
+// entirely, so that checking syntax never pays for it. Only parser_check and
+// parse_check are defined by that copy.
+#ifdef PARSE_CHECK
+#define PARSE_BUILDING false
+#else
+#define PARSE_BUILDING true
+#endif
+
 typedef enum {
   CONTEXT_MAIN,
   CONTEXT_ARRAY, // ]
@@ -13,26 +30,157 @@ typedef struct context {
   struct context *parent;
 } context_t;
 
+// The number of tokens that fit in the ring between the lexer thread and the
+// parser thread. This must be a power of two.
+#define RING_CAPACITY 4096
+
+// The number of tokens that the lexer thread buffers before publishing them to
+// the parser thread.
+#define RING_BATCH 64
+
+// The deepest that grammar functions can nest before the parser gives up on
+// the source. Each level costs a few stack frames, so this keeps adversarial
+// inputs like a long run of ( from overflowing the stack, including on the
+// smaller stacks that worker threads get.
+#define PARSE_MAXIMUM_DEPTH 1024
+
+// The number of steps of parsing between checks of the deadline and the cancel
+// flag. A step is roughly an operand, so this bounds how long a parse can run
+// past its deadline to a few microseconds.
+#define PARSE_DEADLINE_INTERVAL 1024
+
+// The number of tokens that the lookahead ring holds, which bounds both how far
+// ahead the parser can peek and how far it can rewind to a checkpoint without
+// lexing again. This must be a power of two.
+#define LOOKAHEAD_CAPACITY 64
+
+// The number of earlier checkpoints that parser_record_statement tries when
+// the statement it finds doesn't parse cleanly from the nearest one.
+#define PARSE_CHECKPOINT_RETRIES 4
+
+// A compact token used to pass tokens through the ring. Offsets are relative to
+// the start of the source.
+typedef struct {
+  uint32_t start;
+  uint32_t end;
+  uint32_t type;
+} ring_token_t;
+
+// A single-producer/single-consumer ring of tokens. The indices are only ever
+// incremented and are each written by a single thread. They sit on their own
+// cache lines alongside a cached copy of the other side's index so that the
+// threads only touch shared lines when they think they've run out of room.
+typedef struct {
+  alignas(64) atomic_size_t head; // the next token to be read by the parser
+  size_t tail_cache;              // the parser's last view of the tail
+  alignas(64) atomic_size_t tail; // the next token to be written by the lexer
+  size_t head_cache;              // the lexer's last view of the head
+  atomic_bool stopped;             // set by the parser if it stops early
+  alignas(64) ring_token_t tokens[RING_CAPACITY];
+} ring_t;
+
+// Tokens that have been lexed past the current one, either because the parser
+// peeked at them or because it's speculating and may rewind to a checkpoint.
+// Positions are counts of tokens from the start of the parse that only ever
+// increase, and the ring keeps the LOOKAHEAD_CAPACITY most recently lexed.
+typedef struct {
+  token_t tokens[LOOKAHEAD_CAPACITY];
+  size_t next;    // the position of the token after the current one
+  size_t filled;  // the position after the last token in the ring
+  size_t marks;   // the number of checkpoints that are still outstanding
+} lookahead_t;
+
+// The state of the lexer at a point in the parse, which the parser can return
+// to after speculatively parsing ahead. See lex_checkpoint.
+typedef struct {
+  token_t previous;
+  token_t current;
+  size_t next;    // the position of the token after the current one
+} lex_checkpoint_t;
+
+// A growable array of events that is retained by the parser handle between
+// parses when recording.
+typedef struct {
+  event_t *events;
+  size_t size;
+  size_t capacity;
+  bool failed; // set if the buffer couldn't be grown
+} event_buffer_t;
+
+// A growable array of diagnostics that is retained by the parser handle
+// between parses.
+typedef struct {
+  diagnostic_t *diagnostics;
+  size_t size;
+  size_t capacity;
+  bool failed; // set if the buffer couldn't be grown
+} diagnostic_buffer_t;
+
+// One range of statements in a split parse, which is recorded by its own
+// handle on its own thread. The handles are retained by the handle that
+// splits the parse.
+typedef struct {
+  parser_t *parser;       // the handle that records the range
+  const char *source;     // the start of the range in the caller's source
+  size_t offset;          // the offset of the range in the caller's source
+  size_t size;            // the number of bytes in the range
+  bool last;              // whether the range runs to the end of the source
+  const event_t *events;  // the recorded events, or NULL if recording failed
+  size_t count;           // the number of recorded events
+  bool valid;             // whether the range parsed the way it does in place
+} split_t;
+
 // This struct represents the overall parser. It contains a reference to the
 // source file, as well as pointers that indicate where in the source it's
 // currently parsing. Finally, it also contains the most recent and current
 // token that it's considering.
-typedef struct {
-  const char *start;    // the pointer to the start of the source
-  const char *end;      // the pointer to the end of the source
-  token_t previous;     // the last token we considered
-  token_t current;      // the current token we're considering
-  int lineno;           // the current line number we're looking at
-  visitor_t *visitor;   // the visitor used to visit each node as it is built
-  encoding_t *encoding; // the current encoding being used for parsing
-  context_t *context;   // the linked list of contexts for this parser
-} parser_t;
-
-// Returns the character at the given offset from the current character. If one
-// can't be read because there aren't enough, then it returns \0.
+//
+// The fields at the top are reset at the start of every parse, while the ones
+// at the bottom are configuration and scratch space that live as long as the
+// handle does.
+struct parser {
+  const char *start;          // the pointer to the start of the source
+  const char *source;         // the caller's source, if start points to a padded copy
+  const char *end;            // the pointer to the end of the source
+  token_t previous;           // the last token we considered
+  token_t current;            // the current token we're considering
+  int lineno;                 // the current line number we're looking at
+  const visitor_t *visitor;   // the visitor used to visit each node as it is built
+  unsigned int interest;      // the visitor_interest of the visitor
+  context_t *context;         // the linked list of contexts for this parser
+  ring_t *ring;               // the ring of tokens when lexing on another thread
+  bool recording;             // whether nodes are recorded instead of visited
+  trace_t *detail;            // the trace for fine-grained spans, if enabled
+  const index_t *structure;   // the structural index of the source, if enabled
+  size_t depth;               // the number of grammar functions currently nested
+  bool stopped;               // whether parsing was stopped before the end of the source
+  bool lexed;                 // whether the end of the file has come off the ring
+  size_t budget;              // the steps left before the deadline is next checked
+  bool timed_out;             // whether the parse was stopped by the deadline or cancel flag
+  lookahead_t lookahead;      // the tokens lexed past the current one
+
+  const encoding_t *encoding; // the encoding being used for parsing
+  unsigned int options;       // the parser_option_t flags for this handle
+  ring_t *ring_buffer;        // the retained ring used for pipelined parsing
+  event_buffer_t events;      // the retained buffer of recorded events
+  diagnostic_buffer_t diagnostics; // the retained buffer of syntax errors
+  trace_t *trace;             // the trace that spans are appended to, if any
+  index_t index;              // the retained structural index
+  uint64_t deadline;          // when parses are stopped, from trace_now, or 0 for never
+  const atomic_bool *cancel;  // a flag that stops parses when it's set, if any
+  char *scratch;              // the retained padded copy of unpadded sources
+  size_t scratch_capacity;    // the number of bytes allocated for the copy
+  statements_t statements;    // the retained statement offsets for split parses
+  split_t *splits;            // the retained ranges and handles for split parses
+  size_t split_capacity;      // the number of ranges allocated
+};
+
+// Returns the character at the given offset from the current character. This
+// doesn't check against the end of the source, since the source is always
+// followed by PARSE_PADDING zero bytes (see parser_reset), and the lexer never
+// looks more than a few bytes past a \0.
 static inline char peek(parser_t *parser, size_t offset) {
-  const char *pointer = parser->current.end + offset;
-  return pointer < parser->end ? *pointer : '\0';
+  return parser->current.end[offset];
 }
 
 // If the character to be read matches the given value, then returns true and
@@ -45,6 +193,27 @@ static inline bool match(parser_t *parser, char value) {
   return false;
 }
 
+// Returns the offset of the first byte at or after the given offset that isn't
+// in the given class, using bit scans over the structural index.
+static inline size_t index_skip(const index_t *index, index_class_t class, size_t offset) {
+  const uint64_t *bitmap = index->bitmaps[class];
+  size_t block = offset / 64;
+  if (block >= index->blocks) return offset;
+
+  uint64_t outside = ~bitmap[block] & (UINT64_MAX << (offset % 64));
+  while (outside == 0) {
+    if (++block == index->blocks) return block * 64;
+    outside = ~bitmap[block];
+  }
+
+  return block * 64 + (size_t) __builtin_ctzll(outside);
+}
+
+// Moves the end of the current token past every byte in the given class.
+static inline void index_advance(parser_t *parser, index_class_t class) {
+  parser->current.end = parser->start + index_skip(parser->structure, class, parser->current.end - parser->start);
+}
+
 static bool isdigit(const char value) {
   return '0' <= value && value <= '9';
 }
@@ -58,6 +227,11 @@ static size_t identchar(parser_t *parser) {
 }
 
 static size_t lex_identifier(parser_t *parser) {
+  if (parser->structure != NULL) {
+    index_advance(parser, INDEX_IDENTIFIER);
+    return parser->current.end - parser->current.start;
+  }
+
   for (size_t width = identchar(parser); width != 0; width = identchar(parser)) {
     parser->current.end += width;
   }
@@ -113,6 +287,11 @@ static token_type_t lex_global_variable(parser_t *parser) {
 static token_type_t lex_numeric(parser_t *parser) {
   parser->current.type = TOKEN_INTEGER;
 
+  if (parser->structure != NULL) {
+    index_advance(parser, INDEX_DIGIT);
+    return TOKEN_INTEGER;
+  }
+
   while (isdigit(*parser->current.end)) {
     parser->current.end++;
   }
@@ -120,6 +299,8 @@ static token_type_t lex_numeric(parser_t *parser) {
   return TOKEN_INTEGER;
 }
 
+#include "operators.h"
+
 // Moves the source pointer one token forward and returns the type of token that
 // was just seen.
 static token_type_t lex_token_type(parser_t *parser) {
@@ -134,6 +315,9 @@ static token_type_t lex_token_type(parser_t *parser) {
       case '\0': // NUL or end of script
       case '\004': // ^D
       case '\032': // ^Z
+        // Stay on this byte so that lexing again returns EOF again instead of
+        // walking off into the padding.
+        parser->current.end--;
         return TOKEN_EOF;
 
       case ' ':
@@ -141,6 +325,11 @@ static token_type_t lex_token_type(parser_t *parser) {
       case '\f':
       case '\r':
       case '\v': {
+        if (parser->structure != NULL) {
+          index_advance(parser, INDEX_WHITESPACE);
+          break;
+        }
+
         size_t offset = 0;
         char current;
 
@@ -156,6 +345,13 @@ static token_type_t lex_token_type(parser_t *parser) {
         break;
       }
       case '\n': {
+        if (parser->structure != NULL) {
+          const char *start = parser->current.end;
+          index_advance(parser, INDEX_NEWLINE);
+          parser->lineno += 1 + (int) (parser->current.end - start);
+          return TOKEN_NEWLINE;
+        }
+
         do {
           parser->lineno++; 
         } while (match(parser, '\n'));
@@ -163,72 +359,10 @@ static token_type_t lex_token_type(parser_t *parser) {
         return TOKEN_NEWLINE;
       }
 
-      case ',': return TOKEN_COMMA;
-      case ';': return TOKEN_SEMICOLON;
-      case ':': return TOKEN_COLON;
-      case '?': return TOKEN_QUESTION_MARK;
-      case '(': return TOKEN_LEFT_PARENTHESIS;
-      case ')': return TOKEN_RIGHT_PARENTHESIS;
-      case '[': return TOKEN_LEFT_BRACKET;
-      case ']': return TOKEN_RIGHT_BRACKET;
-      case '~': return TOKEN_TILDE;
-
-      // = =~ == ===
-      case '=':
-        if (match(parser, '~')) return TOKEN_EQUAL_TILDE;
-        if (match(parser, '=')) return match(parser, '=') ? TOKEN_TRIPLE_EQUAL : TOKEN_DOUBLE_EQUAL;
-        return TOKEN_EQUAL;
-
-      // < << <<= <= <=>
-      case '<':
-        if (match(parser, '<')) return match(parser, '=') ? TOKEN_SHIFT_LEFT_EQUAL : TOKEN_SHIFT_LEFT;
-        if (match(parser, '=')) return match(parser, '>') ? TOKEN_COMPARE : TOKEN_LESS_EQUAL;
-        return TOKEN_LESS;
-
-      // > >> >>= >=
-      case '>':
-        if (match(parser, '>')) return match(parser, '=') ? TOKEN_SHIFT_RIGHT_EQUAL : TOKEN_SHIFT_RIGHT;
-        return match(parser, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER;
-
-      // + +=
-      case '+': return match(parser, '=') ? TOKEN_PLUS_EQUAL : TOKEN_PLUS;
-
-      // - -=
-      case '-': return match(parser, '=') ? TOKEN_MINUS_EQUAL : TOKEN_MINUS;
-
-      // * ** **= *=
-      case '*':
-        if (match(parser, '*')) return match(parser, '=') ? TOKEN_DOUBLE_STAR_EQUAL : TOKEN_DOUBLE_STAR;
-        return match(parser, '=') ? TOKEN_STAR_EQUAL : TOKEN_STAR;
-
-      // / /=
-      case '/': return match(parser, '=') ? TOKEN_SLASH_EQUAL : TOKEN_SLASH;
-
-      // % %=
-      case '%': return match(parser, '=') ? TOKEN_PERCENT_EQUAL : TOKEN_PERCENT;
-
-      // & && &&= &=
-      case '&':
-        if (match(parser, '&')) return match(parser, '=') ? TOKEN_DOUBLE_AMPERSAND_EQUAL : TOKEN_DOUBLE_AMPERSAND;
-        return match(parser, '=') ? TOKEN_AMPERSAND_EQUAL : TOKEN_AMPERSAND;
-
-      // | || ||= |=
-      case '|':
-        if (match(parser, '|')) return match(parser, '=') ? TOKEN_DOUBLE_PIPE_EQUAL : TOKEN_DOUBLE_PIPE;
-        return match(parser, '=') ? TOKEN_PIPE_EQUAL : TOKEN_PIPE;
-
-      // ^ ^=
-      case '^': return match(parser, '=') ? TOKEN_CARET_EQUAL : TOKEN_CARET;
-
-      // .. ...
-      case '.':
-        if (!match(parser, '.')) return TOKEN_EOF; // this is temporary
-        return match(parser, '.') ? TOKEN_TRIPLE_DOT : TOKEN_DOUBLE_DOT;
-
-      // ! !~ !=
-      case '!':
-        if (match(parser, '~')) return TOKEN_BANG_TILDE;
-        return match(parser, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG;
+      // , ; : ? ( ) [ ] ~ = =~ == === < << <<= <= <=> > >> >>= >= + += - -=
+      // * ** **= *= / /= % %= & && &&= &= | || ||= |= ^ ^= .. ... ! !~ !=
+      OPERATOR_CASES
+        return lex_operator(parser);
 
       case '$': // this is temporary
         return lex_global_variable(parser);
@@ -273,9 +407,192 @@ static token_type_t lex_token_type(parser_t *parser) {
   }
 }
 
+// Backs off while waiting on the other side of the ring. Spin briefly first
+// since the other thread is usually only a few tokens behind.
+static inline void ring_relax(unsigned int *spins) {
+  if (++(*spins) < 128) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+  } else {
+    sched_yield();
+  }
+}
+
+// Reads the next token off the ring into the current token, blocking until the
+// lexer thread has produced one.
+static void ring_pop(parser_t *parser) {
+  ring_t *ring = parser->ring;
+  parser->previous = parser->current;
+
+  // Once we've seen the end of the file the lexer thread has stopped, so keep
+  // returning the same token.
+  if (parser->lexed) return;
+
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  unsigned int spins = 0;
+
+  while (head == ring->tail_cache) {
+    ring->tail_cache = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head == ring->tail_cache) ring_relax(&spins);
+  }
+
+  ring_token_t *token = &ring->tokens[head & (RING_CAPACITY - 1)];
+  parser->current = (token_t) {
+    .type = token->type,
+    .start = parser->start + token->start,
+    .end = parser->start + token->end
+  };
+
+  if (token->type == TOKEN_EOF) parser->lexed = true;
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
 // Get the next token type and set its value on the current pointer.
+static inline void lex_next(parser_t *parser) {
+  if (parser->ring != NULL) {
+    ring_pop(parser);
+  } else {
+    parser->current.type = lex_token_type(parser);
+  }
+}
+
+// Moves to the next token through the lookahead ring. Tokens that were already
+// lexed by peeking or before a rewind are handed out again, and while there's
+// a checkpoint every new token is kept so that it can be rewound over. Once the
+// parse has been stopped every token is the end of the file, even in the
+// middle of speculating.
+static __attribute__((noinline)) void lex_buffered(parser_t *parser) {
+  lookahead_t *lookahead = &parser->lookahead;
+
+  if (parser->stopped) {
+    parser->previous = parser->current;
+    parser->current.type = TOKEN_EOF;
+    return;
+  }
+
+  if (lookahead->next == lookahead->filled) {
+    lex_next(parser);
+    lookahead->tokens[lookahead->filled++ & (LOOKAHEAD_CAPACITY - 1)] = parser->current;
+  } else {
+    parser->previous = parser->current;
+    parser->current = lookahead->tokens[lookahead->next & (LOOKAHEAD_CAPACITY - 1)];
+  }
+
+  lookahead->next++;
+}
+
+// Moves to the next token. Unless the parser has peeked, is speculating, or
+// has been stopped, the lookahead ring is empty and this goes straight to the
+// lexer.
+static inline void lex_advance(parser_t *parser) {
+  lookahead_t *lookahead = &parser->lookahead;
+
+  if (__builtin_expect(lookahead->next == lookahead->filled && lookahead->marks == 0 && !parser->stopped, 1)) {
+    lex_next(parser);
+  } else {
+    lex_buffered(parser);
+  }
+}
+
+// Lex the next token, timing it if detailed tracing is enabled. When it isn't,
+// this costs a single well-predicted branch.
 static inline void lex_token(parser_t *parser) {
-  parser->current.type = lex_token_type(parser);
+  if (parser->detail == NULL) {
+    lex_advance(parser);
+    return;
+  }
+
+  uint64_t start = trace_now();
+  lex_advance(parser);
+  trace_span(parser->detail, "lex", NULL, start, trace_now());
+}
+
+// Returns the token the given distance past the current one (so 1 is the next
+// token) without moving to it, lexing up to it into the lookahead ring if it
+// hasn't been already. The distance must be between 1 and LOOKAHEAD_CAPACITY.
+// Past the end of the file (or once the parse has been stopped), every token
+// is the end of the file. The token is valid until the parser moves on or
+// peeks further.
+static inline const token_t * lex_peek(parser_t *parser, size_t distance) {
+  lookahead_t *lookahead = &parser->lookahead;
+  if (parser->stopped) return &parser->current;
+
+  while (lookahead->filled - lookahead->next < distance) {
+    token_t previous = parser->previous;
+    token_t current = parser->current;
+
+    // The lexer picks up from the end of the last token it lexed.
+    if (lookahead->filled != lookahead->next) {
+      parser->current = lookahead->tokens[(lookahead->filled - 1) & (LOOKAHEAD_CAPACITY - 1)];
+    }
+
+    lex_next(parser);
+    lookahead->tokens[lookahead->filled++ & (LOOKAHEAD_CAPACITY - 1)] = parser->current;
+
+    parser->previous = previous;
+    parser->current = current;
+  }
+
+  return &lookahead->tokens[(lookahead->next + distance - 1) & (LOOKAHEAD_CAPACITY - 1)];
+}
+
+// The state handed to the lexer thread in pipelined mode. The times bracket the
+// lexing so they can be added to the trace once the thread is joined.
+typedef struct {
+  parser_t lexer;
+  uint64_t started;
+  uint64_t finished;
+} pipeline_t;
+
+// This is the body of the lexer thread when parsing in pipelined mode. It lexes
+// the entire source with its own lexer state and pushes every token (including
+// the final EOF) onto the ring, waiting whenever the parser falls behind.
+static void * lex_pipelined(void *data) {
+  pipeline_t *pipeline = data;
+  parser_t *lexer = &pipeline->lexer;
+  ring_t *ring = lexer->ring;
+  size_t tail = 0;
+
+  pipeline->started = trace_now();
+
+  do {
+    // If the parser has stopped early, there's no point lexing the rest of the
+    // source, so end the file here. This is only checked once per batch.
+    if ((tail & (RING_BATCH - 1)) == 0 && atomic_load_explicit(&ring->stopped, memory_order_relaxed)) {
+      lexer->current.type = TOKEN_EOF;
+    } else {
+      lexer->current.type = lex_token_type(lexer);
+    }
+
+    unsigned int spins = 0;
+
+    while (tail - ring->head_cache == RING_CAPACITY) {
+      ring->head_cache = atomic_load_explicit(&ring->head, memory_order_acquire);
+      if (tail - ring->head_cache == RING_CAPACITY) ring_relax(&spins);
+    }
+
+    ring->tokens[tail & (RING_CAPACITY - 1)] = (ring_token_t) {
+      .start = (uint32_t) (lexer->current.start - lexer->start),
+      .end = (uint32_t) (lexer->current.end - lexer->start),
+      .type = lexer->current.type
+    };
+
+    // Publish in batches so the parser isn't constantly pulling the tail's
+    // cache line away from us, but always publish when the ring fills up or
+    // we've hit the end.
+    tail++;
+    if (
+      (tail & (RING_BATCH - 1)) == 0 ||
+      tail - ring->head_cache == RING_CAPACITY ||
+      lexer->current.type == TOKEN_EOF
+    ) {
+      atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+  } while (lexer->current.type != TOKEN_EOF);
+
+  pipeline->finished = trace_now();
+  return NULL;
 }
 
 typedef enum {
@@ -314,7 +631,8 @@ typedef struct {
   precedence_t right_bind;
 } parse_rule_t;
 
-parse_rule_t parse_rules[];
+static const parse_rule_t parse_rules[TOKEN_MAXIMUM];
+static const char * parse_function_name(parse_function_t *function);
 
 static bool accept(parser_t *parser, token_type_t type) {
   if (parser->current.type == type) {
@@ -340,12 +658,162 @@ static bool accept_any(parser_t *parser, size_t count, ...) {
   return false;
 }
 
-static void consume(parser_t *parser, const char *message, token_type_t type) {
-  if (!accept(parser, type)) {
-    fprintf(stderr, "%s\n", message);
+// Adds a diagnostic at the current token. Once parsing has been stopped, the
+// errors that unwinding would otherwise cause are dropped.
+static void diagnose(parser_t *parser, const char *message) {
+  diagnostic_buffer_t *buffer = &parser->diagnostics;
+  if (parser->stopped) return;
+
+  if (buffer->size == buffer->capacity) {
+    size_t capacity = buffer->capacity == 0 ? 16 : buffer->capacity * 2;
+    diagnostic_t *diagnostics = realloc(buffer->diagnostics, capacity * sizeof(diagnostic_t));
+
+    if (diagnostics == NULL) {
+      buffer->failed = true;
+      return;
+    }
+
+    buffer->diagnostics = diagnostics;
+    buffer->capacity = capacity;
+  }
+
+  buffer->diagnostics[buffer->size++] = (diagnostic_t) {
+    .start = (size_t) (parser->current.start - parser->start),
+    .end = (size_t) (parser->current.end - parser->start),
+    .message = message
+  };
+}
+
+// Stops parsing by making the current token the end of the file, so that every
+// grammar function returns as soon as it can. The message is reported once.
+static void parser_stop(parser_t *parser, const char *message) {
+  diagnose(parser, message);
+
+  parser->stopped = true;
+  parser->current.type = TOKEN_EOF;
+  parser->lookahead.next = parser->lookahead.filled;
+  if (parser->ring != NULL) atomic_store_explicit(&parser->ring->stopped, true, memory_order_relaxed);
+}
+
+// Checks the deadline and the cancel flag once the budget of steps has run
+// out, and stops the parse if either has been reached.
+static __attribute__((noinline, cold)) void parser_expire(parser_t *parser) {
+  parser->budget = PARSE_DEADLINE_INTERVAL;
+
+  if (
+    (parser->cancel != NULL && atomic_load_explicit(parser->cancel, memory_order_relaxed)) ||
+    (parser->deadline != 0 && trace_now() >= parser->deadline)
+  ) {
+    parser->timed_out = true;
+    parser_stop(parser, "Parse timed out.");
   }
 }
 
+// Counts a step of parsing. Without a deadline or cancel flag, the budget
+// starts too high to ever run out, so this is a decrement and a branch that's
+// never taken.
+static inline void parser_step(parser_t *parser) {
+  if (__builtin_expect(--parser->budget == 0, 0)) parser_expire(parser);
+}
+
+// Saves the state of the lexer so that the parser can try parsing one way and
+// then rewind with lex_restore if it was wrong, or carry on with lex_commit if
+// it was right. Every checkpoint must be ended with exactly one of the two.
+// Only the tokens are rewound, so a grammar function that speculates should
+// decide which way to go before it builds any nodes.
+static inline lex_checkpoint_t lex_checkpoint(parser_t *parser) {
+  parser->lookahead.marks++;
+
+  return (lex_checkpoint_t) {
+    .previous = parser->previous,
+    .current = parser->current,
+    .next = parser->lookahead.next
+  };
+}
+
+// Ends a checkpoint, keeping the tokens that have been moved past since.
+static inline void lex_commit(parser_t *parser) {
+  parser->lookahead.marks--;
+}
+
+// Ends a checkpoint by rewinding to it. If no more than LOOKAHEAD_CAPACITY
+// tokens have been lexed since the checkpoint they're all still in the ring,
+// so this is constant time and they won't be lexed again. Otherwise the
+// lexer starts over from the checkpoint, except when pipelined, where the
+// tokens can't be read twice and the parse is stopped instead. Stopping a
+// parse can't be rewound.
+static inline void lex_restore(parser_t *parser, const lex_checkpoint_t *checkpoint) {
+  lookahead_t *lookahead = &parser->lookahead;
+  lookahead->marks--;
+
+  if (parser->stopped) return;
+
+  if (lookahead->filled - checkpoint->next > LOOKAHEAD_CAPACITY) {
+    if (parser->ring != NULL) {
+      parser_stop(parser, "Speculated too far ahead to rewind.");
+      return;
+    }
+
+    lookahead->filled = checkpoint->next;
+  }
+
+  lookahead->next = checkpoint->next;
+  parser->previous = checkpoint->previous;
+  parser->current = checkpoint->current;
+}
+
+#ifdef PARSE_SPECULATE
+static inline bool token_equal(const token_t *left, const token_t *right) {
+  return left->type == right->type && left->start == right->start && left->end == right->end;
+}
+
+// Exercises the lookahead ring at the start of every operand, for the
+// parse-speculate build that the tests run (see the Makefile). It peeks three
+// tokens, then lexes ahead and rewinds, once within the ring and once past it
+// (where the lexer starts over). The tokens lexed ahead have to be the ones
+// that were peeked, and rewinding has to land back on the current token, or
+// else the parse is stopped. The output is otherwise the same as a normal
+// parse. Rewinding past the ring isn't possible when pipelined.
+static void lex_speculate(parser_t *parser) {
+  static const size_t distances[] = { LOOKAHEAD_CAPACITY / 2, LOOKAHEAD_CAPACITY * 2 };
+
+  for (size_t index = 0; index < sizeof(distances) / sizeof(distances[0]); index++) {
+    if (distances[index] > LOOKAHEAD_CAPACITY && parser->ring != NULL) break;
+
+    token_t peeked[3];
+    for (size_t distance = 1; distance <= 3; distance++) {
+      peeked[distance - 1] = *lex_peek(parser, distance);
+    }
+
+    token_t current = parser->current;
+    lex_checkpoint_t checkpoint = lex_checkpoint(parser);
+    bool matched = true;
+
+    // Each token counts as a step, so that a deadline can run out while
+    // speculating, which has to end the parse like anywhere else.
+    for (size_t step = 0; step < distances[index]; step++) {
+      parser_step(parser);
+      lex_token(parser);
+
+      // Nothing can come after the end of a stopped parse, and there's no
+      // diagnostic left to report it with.
+      if (parser->stopped && parser->current.type != TOKEN_EOF) abort();
+      if (step < 3 && !token_equal(&parser->current, &peeked[step])) matched = false;
+    }
+
+    lex_restore(parser, &checkpoint);
+
+    if (!parser->stopped && (!matched || !token_equal(&parser->current, &current))) {
+      parser_stop(parser, "Speculation didn't rewind to the same tokens.");
+    }
+  }
+}
+#endif
+
+static void consume(parser_t *parser, const char *message, token_type_t type) {
+  if (!accept(parser, type)) diagnose(parser, message);
+}
+
 static void consume_any(parser_t *parser, const char *message, size_t count, ...) {
   va_list types;
   va_start(types, count);
@@ -358,11 +826,127 @@ static void consume_any(parser_t *parser, const char *message, size_t count, ...
     }
   }
 
-  fprintf(stderr, "%s", message);
+  diagnose(parser, message);
   va_end(types);
 }
 
+// Appends an event for a node to the event buffer. The children and span are
+// filled in afterward by record_subtree once the node is complete.
+static void record(parser_t *parser, node_type_t type, token_t *token, token_t *closing, size_t size) {
+  event_buffer_t *buffer = &parser->events;
+
+  if (buffer->size == buffer->capacity) {
+    size_t capacity = buffer->capacity == 0 ? 1024 : buffer->capacity * 2;
+    event_t *events = realloc(buffer->events, capacity * sizeof(event_t));
+
+    if (events == NULL) {
+      buffer->failed = true;
+      return;
+    }
+
+    buffer->events = events;
+    buffer->capacity = capacity;
+  }
+
+  buffer->events[buffer->size++] = (event_t) {
+    .type = type,
+    .token = token->type,
+    .closing = closing == NULL ? TOKEN_EOF : closing->type,
+    .size = (uint32_t) size,
+    .start = (uint32_t) (token->start - parser->start),
+    .end = (uint32_t) (token->end - parser->start),
+    .closing_start = closing == NULL ? 0 : (uint32_t) (closing->start - parser->start),
+    .closing_end = closing == NULL ? 0 : (uint32_t) (closing->end - parser->start)
+  };
+}
+
+// Once a node has been completed, the last event in the buffer is that node
+// and every event since the given mark belongs to its subtree. Here we fill in
+// the span of the subtree and count its direct children by hopping backward
+// over their spans.
+static void record_subtree(parser_t *parser, size_t mark) {
+  event_buffer_t *buffer = &parser->events;
+  if (!PARSE_BUILDING || !parser->recording || buffer->failed || buffer->size <= mark) return;
+
+  event_t *event = &buffer->events[buffer->size - 1];
+  event->span = (uint32_t) (buffer->size - mark);
+  event->children = 0;
+
+  for (size_t index = buffer->size - 1; index > mark; index -= buffer->events[index - 1].span) {
+    event->children++;
+  }
+}
+
+// When the source was copied to pad it, tokens point into the copy. This
+// returns the token moved back to point into the caller's source (using the
+// given storage), or the token itself if there was no copy.
+static inline token_t * rebase(parser_t *parser, token_t *token, token_t *storage) {
+  if (parser->source == parser->start || token == NULL) return token;
+
+  *storage = (token_t) {
+    .type = token->type,
+    .start = parser->source + (token->start - parser->start),
+    .end = parser->source + (token->end - parser->start)
+  };
+  return storage;
+}
+
+// Every node that the parser builds goes through here. Depending on the mode,
+// it's either recorded into the event buffer or dispatched to the visitor.
+// When checking, this is empty, and so are the token copies that feed it.
+static inline void visit(parser_t *parser, node_type_t type, token_t *token, token_t *closing, size_t size) {
+  token_t token_storage;
+  token_t closing_storage;
+
+  if (!PARSE_BUILDING) return;
+
+  if (parser->recording) {
+    record(parser, type, token, closing, size);
+    return;
+  }
+
+  if (!(parser->interest & (1u << type))) return;
+
+  token = rebase(parser, token, &token_storage);
+  closing = rebase(parser, closing, &closing_storage);
+
+  if (parser->detail == NULL) {
+    visitor_visit(parser->visitor, type, token, closing, size);
+  } else {
+    uint64_t start = trace_now();
+    visitor_visit(parser->visitor, type, token, closing, size);
+    trace_span(parser->detail, "visit", NULL, start, trace_now());
+  }
+}
+
+// Call a prefix or infix grammar function, timing it if detailed tracing is
+// enabled. Spans for nested calls are nested inside of their caller's span.
+// Every level of nesting in the grammar goes through here, so this is also
+// where the depth is limited.
+static inline void parse_call(parser_t *parser, parse_function_t *function) {
+  if (parser->depth == PARSE_MAXIMUM_DEPTH) {
+    parser_stop(parser, "Expression nested too deeply.");
+    return;
+  }
+
+  parser->depth++;
+
+  if (parser->detail == NULL) {
+    function(parser);
+  } else {
+    uint64_t start = trace_now();
+    function(parser);
+    trace_span(parser->detail, parse_function_name(function), NULL, start, trace_now());
+  }
+
+  parser->depth--;
+}
+
 static void parse_precedence(parser_t *parser, precedence_t precedence) {
+  // Every operand and statement starts here, so this is where parsing counts
+  // down to checking the deadline.
+  parser_step(parser);
+
   // If this is the end of the file, then return immediately.
   if (parser->current.type == TOKEN_EOF) {
     return;
@@ -382,6 +966,10 @@ static void parse_precedence(parser_t *parser, precedence_t precedence) {
       if (parser->current.type == TOKEN_END) return;
   }
 
+#ifdef PARSE_SPECULATE
+  lex_speculate(parser);
+#endif
+
   lex_token(parser);
 
   parse_function_t *prefix = parse_rules[parser->previous.type].prefix;
@@ -389,7 +977,9 @@ static void parse_precedence(parser_t *parser, precedence_t precedence) {
     return;
   }
 
-  prefix(parser);
+  size_t mark = parser->events.size;
+  parse_call(parser, prefix);
+  record_subtree(parser, mark);
 
   while (precedence <= parse_rules[parser->current.type].left_bind) {
     lex_token(parser);
@@ -399,7 +989,10 @@ static void parse_precedence(parser_t *parser, precedence_t precedence) {
       return;
     }
 
-    infix(parser);
+    // The left operand belongs to the infix node, so its subtree starts at
+    // the same mark.
+    parse_call(parser, infix);
+    record_subtree(parser, mark);
   }
 }
 
@@ -457,7 +1050,7 @@ static void parse_array(parser_t *parser) {
   }
 
   token_t closing = parser->previous;
-  parser->visitor->array(&opening, &closing, size);
+  visit(parser, NODE_ARRAY, &opening, &closing, size);
 }
 
 // Parses an assignment expression.
@@ -467,7 +1060,7 @@ static void parse_array(parser_t *parser) {
 static void parse_assign(parser_t *parser) {
   token_t operator = parser->previous;
   parse_precedence(parser, parse_rules[operator.type].right_bind);
-  parser->visitor->assign(&operator);
+  visit(parser, NODE_ASSIGN, &operator, NULL, 0);
 }
 
 // Parses a begin expression (with an optional ensure clause).
@@ -492,7 +1085,7 @@ static void parse_begin(parser_t *parser) {
 
   consume(parser, "Expected 'end' after the begin block.", TOKEN_END);
   token_t closing = parser->previous;
-  parser->visitor->begin(&opening, &closing);
+  visit(parser, NODE_BEGIN, &opening, &closing, 0);
 }
 
 // Parses a binary expression.
@@ -502,7 +1095,7 @@ static void parse_begin(parser_t *parser) {
 static void parse_binary(parser_t *parser) {
   token_t operator = parser->previous;
   parse_precedence(parser, parse_rules[operator.type].right_bind);
-  parser->visitor->binary(&operator);
+  visit(parser, NODE_BINARY, &operator, NULL, 0);
 }
 
 // Parses a defined? expression.
@@ -519,7 +1112,7 @@ static void parse_defined(parser_t *parser) {
     parse_expression(parser);
   }
 
-  parser->visitor->defined(&keyword);
+  visit(parser, NODE_DEFINED, &keyword, NULL, 0);
 }
 
 // Parses a grouped expression.
@@ -533,7 +1126,7 @@ static void parse_grouping(parser_t *parser) {
   consume(parser, "Expected ')' after expression.", TOKEN_RIGHT_PARENTHESIS);
 
   token_t closing = parser->previous;
-  parser->visitor->group(&opening, &closing);
+  visit(parser, NODE_GROUP, &opening, &closing, 0);
 }
 
 // Parses an index expression (with or without an inner expression).
@@ -546,13 +1139,13 @@ static void parse_index(parser_t *parser) {
 
   if (accept(parser, TOKEN_RIGHT_BRACKET)) {
     token_t closing = parser->previous;
-    parser->visitor->index_call(&opening, &closing);
+    visit(parser, NODE_INDEX_CALL, &opening, &closing, 0);
   } else {
     parse_precedence(parser, PRECEDENCE_MODIFIER_RESCUE + 1);
     consume(parser, "Expected ']' after expression.", TOKEN_RIGHT_BRACKET);
 
     token_t closing = parser->previous;
-    parser->visitor->index_expr(&opening, &closing);
+    visit(parser, NODE_INDEX_EXPR, &opening, &closing, 0);
   }
 }
 
@@ -569,7 +1162,7 @@ static void parse_index(parser_t *parser) {
 //     true
 //
 static void parse_literal(parser_t *parser) {
-  parser->visitor->literal(&parser->previous);
+  visit(parser, NODE_LITERAL, &parser->previous, NULL, 0);
 }
 
 // Parses a while or until loop.
@@ -584,11 +1177,7 @@ static void parse_loop(parser_t *parser) {
   consume_any(parser, "Expected separator after predicate.", 2, TOKEN_NEWLINE, TOKEN_SEMICOLON);
   parse_list(parser, CONTEXT_LOOP);
 
-  if (token.type == TOKEN_WHILE) {
-    parser->visitor->while_block(&token);
-  } else {
-    parser->visitor->until_block(&token);
-  }
+  visit(parser, token.type == TOKEN_WHILE ? NODE_WHILE_BLOCK : NODE_UNTIL_BLOCK, &token, NULL, 0);
 }
 
 // Parses a not expression.
@@ -605,7 +1194,7 @@ static void parse_not(parser_t *parser) {
     parse_expression(parser);
   }
 
-  parser->visitor->not(&keyword);
+  visit(parser, NODE_NOT, &keyword, NULL, 0);
 }
 
 // Parses a ternary expression.
@@ -613,13 +1202,14 @@ static void parse_not(parser_t *parser) {
 //     foo ? bar : baz
 //
 static void parse_ternary(parser_t *parser) {
-  precedence_t right_bind = parse_rules[parser->previous.type].right_bind;
+  token_t operator = parser->previous;
+  precedence_t right_bind = parse_rules[operator.type].right_bind;
 
   parse_precedence(parser, right_bind);
   consume(parser, "Expected ':' after expression.", TOKEN_COLON);
 
   parse_precedence(parser, right_bind);
-  parser->visitor->ternary();
+  visit(parser, NODE_TERNARY, &operator, NULL, 0);
 }
 
 // Parses a unary expression.
@@ -629,7 +1219,7 @@ static void parse_ternary(parser_t *parser) {
 static void parse_unary(parser_t *parser) {
   token_t operator = parser->previous;
   parse_precedence(parser, PRECEDENCE_UNARY);
-  parser->visitor->unary(&operator);
+  visit(parser, NODE_UNARY, &operator, NULL, 0);
 }
 
 // These macros define associativity by defining binding power for the left and right side of the token
@@ -637,7 +1227,7 @@ static void parse_unary(parser_t *parser) {
 #define RIGHT(precedence) precedence, precedence
 #define NONE RIGHT(PRECEDENCE_NONE)
 
-parse_rule_t parse_rules[] = {
+static const parse_rule_t parse_rules[TOKEN_MAXIMUM] = {
   [TOKEN_AMPERSAND_EQUAL]        = { NULL,           parse_assign,  RIGHT(PRECEDENCE_ASSIGNMENT) },
   [TOKEN_AMPERSAND]              = { NULL,           parse_binary,  LEFT(PRECEDENCE_BITWISE_AND) },
   [TOKEN_AND]                    = { NULL,           parse_binary,  LEFT(PRECEDENCE_COMPOSITION) },
@@ -715,44 +1305,617 @@ parse_rule_t parse_rules[] = {
 #undef RIGHT
 #undef NONE
 
-const char * ripper_event(token_type_t type);
-
-// Loop through every token that the parser produces and output a small
-// descriptive message describing it.
-void tokenize(off_t size, const char *source) {
-  parser_t parser = {
-    .start = source,
-    .end = source + size,
-    .current = { .start = source, .end = source },
-    .lineno = 1,
-    .encoding = &ascii
+// Returns the name of a grammar function for use in trace spans.
+static const char * parse_function_name(parse_function_t *function) {
+  if (function == parse_array) return "parse_array";
+  if (function == parse_assign) return "parse_assign";
+  if (function == parse_begin) return "parse_begin";
+  if (function == parse_binary) return "parse_binary";
+  if (function == parse_defined) return "parse_defined";
+  if (function == parse_grouping) return "parse_grouping";
+  if (function == parse_index) return "parse_index";
+  if (function == parse_literal) return "parse_literal";
+  if (function == parse_loop) return "parse_loop";
+  if (function == parse_not) return "parse_not";
+  if (function == parse_ternary) return "parse_ternary";
+  if (function == parse_unary) return "parse_unary";
+  return "parse";
+}
+
+// Resets the per-parse state of the parser to point at the given source. The
+// lexer relies on the source being followed by PARSE_PADDING zero bytes. If the
+// handle wasn't created with PARSER_OPTION_PADDED to promise that, this is the
+// checked slow path: the source is copied into a retained buffer that is
+// padded, and tokens are moved back into the caller's source before anyone
+// sees them. Returns false if the copy couldn't be allocated.
+static bool parser_reset(parser_t *parser, off_t size, const char *source) {
+  parser->source = source;
+
+  if (!(parser->options & PARSER_OPTION_PADDED)) {
+    size_t needed = (size_t) size + PARSE_PADDING;
+
+    if (needed > parser->scratch_capacity) {
+      char *scratch = realloc(parser->scratch, needed);
+      if (scratch == NULL) return false;
+
+      parser->scratch = scratch;
+      parser->scratch_capacity = needed;
+    }
+
+    if (size > 0) memcpy(parser->scratch, source, (size_t) size);
+    memset(parser->scratch + size, 0, PARSE_PADDING);
+    source = parser->scratch;
+  }
+
+  parser->start = source;
+  parser->end = source + size;
+  parser->previous = (token_t) { .type = TOKEN_EOF };
+  parser->current = (token_t) { .type = TOKEN_EOF, .start = source, .end = source };
+  parser->lineno = 1;
+  parser->visitor = NULL;
+  parser->interest = 0;
+  parser->context = NULL;
+  parser->ring = NULL;
+  parser->recording = false;
+  parser->detail = (parser->options & PARSER_OPTION_TRACE_DETAIL) ? parser->trace : NULL;
+  parser->structure = NULL;
+  parser->depth = 0;
+  parser->stopped = false;
+  parser->lexed = false;
+  parser->diagnostics.size = 0;
+  parser->diagnostics.failed = false;
+  parser->budget = (parser->deadline != 0 || parser->cancel != NULL) ? PARSE_DEADLINE_INTERVAL : SIZE_MAX;
+  parser->timed_out = false;
+  parser->lookahead.next = 0;
+  parser->lookahead.filled = 0;
+  parser->lookahead.marks = 0;
+
+  // The identifier bitmap follows the ASCII rules, so the index is only used
+  // with that encoding. If it can't be built, lexing falls back to scanning.
+  if ((parser->options & PARSER_OPTION_INDEX) && parser->encoding == &ascii) {
+    uint64_t start = parser->trace == NULL ? 0 : trace_now();
+
+    if (index_build(&parser->index, (size_t) size, source)) {
+      parser->structure = &parser->index;
+      if (parser->trace != NULL) trace_span(parser->trace, "index", NULL, start, trace_now());
+    }
+  }
+
+  return true;
+}
+
+// Frees the buffers that a handle has grown.
+static void parser_release(parser_t *parser) {
+  free(parser->ring_buffer);
+  free(parser->events.events);
+  free(parser->diagnostics.diagnostics);
+  free(parser->scratch);
+  index_free(&parser->index);
+  statements_free(&parser->statements);
+
+  for (size_t index = 0; index < parser->split_capacity; index++) {
+    parser_release(parser->splits[index].parser);
+    free(parser->splits[index].parser);
+  }
+  free(parser->splits);
+}
+
+#ifndef PARSE_CHECK
+
+// Creates a new parser handle with the given encoding (or ASCII if it's NULL)
+// and parser_option_t flags. Returns NULL if it can't be allocated.
+parser_t * parser_create(const encoding_t *encoding, unsigned int options) {
+  parser_t *parser = calloc(1, sizeof(parser_t));
+  if (parser == NULL) return NULL;
+
+  parser->encoding = encoding == NULL ? &ascii : encoding;
+  parser->options = options;
+  return parser;
+}
+
+// Attaches a trace to the handle (or detaches it if it's NULL). Every parse
+// then appends a span for its whole duration, and if the handle was created
+// with PARSER_OPTION_TRACE_DETAIL, a span for every token, grammar function,
+// and visit as well.
+void parser_set_trace(parser_t *parser, trace_t *trace) {
+  parser->trace = trace;
+}
+
+// Sets the time (from trace_now) at which parses with the handle are stopped,
+// or 0 for no deadline. A parse that reaches it stops with a diagnostic, keeps
+// whatever it had visited or recorded so far, and reports parser_timed_out.
+void parser_set_deadline(parser_t *parser, uint64_t deadline) {
+  parser->deadline = deadline;
+}
+
+// Sets a flag that another thread can set to stop parses with the handle in
+// the same way as reaching the deadline, or NULL for none.
+void parser_set_cancel(parser_t *parser, const atomic_bool *cancel) {
+  parser->cancel = cancel;
+}
+
+// Returns whether the last parse with the handle was stopped by the deadline
+// or the cancel flag before reaching the end of the source.
+bool parser_timed_out(const parser_t *parser) {
+  return parser->timed_out;
+}
+
+void parser_destroy(parser_t *parser) {
+  parser_release(parser);
+  free(parser);
+}
+
+// Loop through every token that the parser produces and pass each one to the
+// given callback. Returns false if an unpadded source couldn't be copied.
+bool parser_tokenize(parser_t *parser, off_t size, const char *source, token_callback_t *callback, void *data) {
+  if (!parser_reset(parser, size, source)) return false;
+  uint64_t start = parser->trace == NULL ? 0 : trace_now();
+  token_t storage;
+
+  for (lex_token(parser); parser->current.type != TOKEN_EOF; lex_token(parser)) {
+    callback(data, rebase(parser, &parser->current, &storage));
+
+    parser_step(parser);
+    if (parser->stopped) break;
+  }
+
+  if (parser->trace != NULL) trace_span(parser->trace, "tokenize", NULL, start, trace_now());
+  return true;
+}
+
+#endif
+
+// Parse the source with lexing happening on a separate thread that feeds
+// tokens to the parser through a lock-free ring. This is only worthwhile for
+// large sources when there's a spare core. Returns false without having
+// parsed anything if the thread can't be started (or the source is too large
+// for the compact token offsets).
+static bool parse_pipelined(parser_t *parser) {
+  if (parser->end - parser->start > UINT32_MAX) return false;
+
+  if (parser->ring_buffer == NULL) {
+    parser->ring_buffer = aligned_alloc(alignof(ring_t), sizeof(ring_t));
+    if (parser->ring_buffer == NULL) return false;
+  }
+
+  ring_t *ring = parser->ring_buffer;
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  atomic_init(&ring->stopped, false);
+  ring->tail_cache = 0;
+  ring->head_cache = 0;
+
+  pipeline_t pipeline = {
+    .lexer = {
+      .start = parser->start,
+      .end = parser->end,
+      .current = parser->current,
+      .lineno = 1,
+      .encoding = parser->encoding,
+      .ring = ring,
+      .structure = parser->structure
+    }
   };
 
-  for (lex_token(&parser); parser.current.type != TOKEN_EOF; lex_token(&parser)) {
-    printf(
-      "%ld-%ld %s %.*s\n",
-      parser.current.start - parser.start,
-      parser.current.end - parser.start,
-      ripper_event(parser.current.type),
-      (int) (parser.current.end - parser.current.start),
-      parser.current.start
-    );
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, lex_pipelined, &pipeline) != 0) return false;
+
+  parser->ring = ring;
+
+  lex_token(parser);
+  parse_list(parser, CONTEXT_MAIN);
+
+  // The parser can stop before it reaches the end of the file (or be stopped
+  // early), so keep draining until the lexer thread has pushed its final token.
+  while (!parser->lexed) {
+    ring_pop(parser);
+  }
+
+  pthread_join(thread, NULL);
+  parser->ring = NULL;
+
+  if (parser->trace != NULL) {
+    trace_span(parser->trace, "lex", "pipelined", pipeline.started, pipeline.finished);
   }
+  return true;
 }
 
+#ifndef PARSE_CHECK
+
 // Go through the entire parse process and visit each node in the tree from the
-// bottom to the top.
-void parse(off_t size, const char *source, visitor_t *visitor) {
-  parser_t parser = {
-    .start = source,
-    .end = source + size,
-    .current = { .start = source, .end = source },
-    .lineno = 1,
-    .visitor = visitor,
-    .encoding = &ascii,
-    .context = NULL
+// bottom to the top. Returns false if an unpadded source couldn't be copied.
+bool parser_parse(parser_t *parser, off_t size, const char *source, const visitor_t *visitor) {
+  if (!parser_reset(parser, size, source)) return false;
+  parser->visitor = visitor;
+  parser->interest = visitor_interest(visitor);
+  uint64_t start = parser->trace == NULL ? 0 : trace_now();
+
+  if (!(parser->options & PARSER_OPTION_PIPELINED) || !parse_pipelined(parser)) {
+    lex_token(parser);
+    parse_list(parser, CONTEXT_MAIN);
+  }
+
+  if (parser->trace != NULL) trace_span(parser->trace, "parse", NULL, start, trace_now());
+  return true;
+}
+
+// Parse the source the same way as parser_parse, but instead of visiting each
+// node, record it as an event in a flat postfix array owned by the handle. The
+// array stays valid until the next parse with the same handle. Returns NULL if
+// the source is too large for the 32-bit offsets in the events or if memory
+// couldn't be allocated.
+const event_t * parser_record(parser_t *parser, off_t size, const char *source, size_t *count) {
+  if (size > UINT32_MAX || !parser_reset(parser, size, source)) return NULL;
+
+  parser->recording = true;
+  parser->events.size = 0;
+  parser->events.failed = false;
+  uint64_t start = parser->trace == NULL ? 0 : trace_now();
+
+  if (!(parser->options & PARSER_OPTION_PIPELINED) || !parse_pipelined(parser)) {
+    lex_token(parser);
+    parse_list(parser, CONTEXT_MAIN);
+  }
+
+  if (parser->trace != NULL) trace_span(parser->trace, "record", NULL, start, trace_now());
+  parser->recording = false;
+  if (parser->events.failed) return NULL;
+
+  *count = parser->events.size;
+  return parser->events.events;
+}
+
+// Records one range of a split parse. The range is parsed on its own, so it
+// ends at the end of the range rather than running into the next one. That
+// only matches parsing it in place if it had no errors and it was the end of
+// the range that stopped it, rather than a token that the statements couldn't
+// continue with or a byte that ends the whole source early.
+static void * split_record(void *data) {
+  split_t *split = data;
+  parser_t *parser = split->parser;
+
+  split->events = parser_record(parser, (off_t) split->size, split->source, &split->count);
+  split->valid = (
+    split->events != NULL &&
+    !parser->stopped &&
+    parser->diagnostics.size == 0 &&
+    !parser->diagnostics.failed &&
+    (split->last || (parser->current.type == TOKEN_EOF && parser->current.start == parser->end))
+  );
+
+  return NULL;
+}
+
+// Makes sure there are handles for at least the given number of ranges. They
+// take the checked path, which gives each range its own padded copy that ends
+// where the range does.
+static bool split_reserve(parser_t *parser, size_t count) {
+  if (count <= parser->split_capacity) return true;
+
+  split_t *splits = realloc(parser->splits, count * sizeof(split_t));
+  if (splits == NULL) return false;
+  parser->splits = splits;
+
+  for (; parser->split_capacity < count; parser->split_capacity++) {
+    parser_t *split = parser_create(parser->encoding, parser->options & PARSER_OPTION_INDEX);
+    if (split == NULL) return false;
+
+    splits[parser->split_capacity] = (split_t) { .parser = split };
+  }
+
+  return true;
+}
+
+// Divides the source into at most the given number of ranges of whole
+// top-level statements, each of about the same size. Returns the number of
+// ranges, or 0 if the statements couldn't be found.
+static size_t split_ranges(parser_t *parser, off_t size, const char *source, unsigned int threads) {
+  statements_t *statements = &parser->statements;
+  if (!statements_scan(statements, (size_t) size, source)) return 0;
+
+  size_t ranges = 0;
+  size_t previous = 0;
+  size_t index = 1;
+
+  for (unsigned int range = 1; range < threads; range++) {
+    size_t target = (size_t) size / threads * range;
+    while (index < statements->size && statements->starts[index] < target) index++;
+    if (index == statements->size) break;
+
+    size_t next = statements->starts[index++];
+    if (!split_reserve(parser, ranges + 1)) return 0;
+
+    split_t *split = &parser->splits[ranges++];
+    *split = (split_t) {
+      .parser = split->parser,
+      .source = source + previous,
+      .offset = previous,
+      .size = next - previous
+    };
+    previous = next;
+  }
+
+  if (!split_reserve(parser, ranges + 1)) return 0;
+
+  split_t *split = &parser->splits[ranges++];
+  *split = (split_t) {
+    .parser = split->parser,
+    .source = source + previous,
+    .offset = previous,
+    .size = (size_t) size - previous,
+    .last = true
   };
 
-  lex_token(&parser);
-  parse_list(&parser, CONTEXT_MAIN);
+  return ranges;
+}
+
+// Parse the source the same way as parser_record, but split into ranges of
+// top-level statements that are recorded on up to the given number of threads
+// at once, each into its own handle. The ranges are then merged into the
+// handle's events in source order, with their offsets moved to be relative to
+// the whole source, which gives exactly the events of recording it in one go.
+// The statements are found by a quick scan that can be fooled, so if any range
+// didn't parse the way it would have in place (including any range with
+// syntax errors) the whole source is recorded again without splitting. The
+// deadline and cancel flag apply to every range.
+const event_t * parser_record_split(parser_t *parser, off_t size, const char *source, unsigned int threads, size_t *count) {
+  if (size > UINT32_MAX) return NULL;
+  if (threads < 2) return parser_record(parser, size, source, count);
+
+  uint64_t start = parser->trace == NULL ? 0 : trace_now();
+  size_t ranges = split_ranges(parser, size, source, threads);
+  if (ranges < 2) return parser_record(parser, size, source, count);
+
+  // The first ranges each get a thread and the last one is recorded here. If
+  // a thread can't be started, its range is recorded here as well.
+  pthread_t *workers = calloc(ranges - 1, sizeof(pthread_t));
+  bool *started = calloc(ranges - 1, sizeof(bool));
+  if (workers == NULL || started == NULL) {
+    free(workers);
+    free(started);
+    return parser_record(parser, size, source, count);
+  }
+
+  for (size_t index = 0; index < ranges; index++) {
+    parser->splits[index].parser->deadline = parser->deadline;
+    parser->splits[index].parser->cancel = parser->cancel;
+  }
+
+  for (size_t index = 0; index + 1 < ranges; index++) {
+    started[index] = pthread_create(&workers[index], NULL, split_record, &parser->splits[index]) == 0;
+    if (!started[index]) split_record(&parser->splits[index]);
+  }
+
+  split_record(&parser->splits[ranges - 1]);
+
+  bool valid = true;
+  size_t total = 0;
+
+  for (size_t index = 0; index < ranges; index++) {
+    if (index + 1 < ranges && started[index]) pthread_join(workers[index], NULL);
+
+    valid &= parser->splits[index].valid;
+    total += parser->splits[index].count;
+  }
+
+  free(workers);
+  free(started);
+
+  if (!valid) return parser_record(parser, size, source, count);
+
+  event_buffer_t *buffer = &parser->events;
+  if (total > buffer->capacity) {
+    event_t *events = realloc(buffer->events, total * sizeof(event_t));
+    if (events == NULL) return NULL;
+
+    buffer->events = events;
+    buffer->capacity = total;
+  }
+
+  buffer->size = 0;
+  buffer->failed = false;
+  parser->diagnostics.size = 0;
+  parser->diagnostics.failed = false;
+  parser->stopped = false;
+  parser->timed_out = false;
+
+  for (size_t index = 0; index < ranges; index++) {
+    const split_t *split = &parser->splits[index];
+    uint32_t offset = (uint32_t) split->offset;
+
+    for (size_t event = 0; event < split->count; event++) {
+      event_t merged = split->events[event];
+      merged.start += offset;
+      merged.end += offset;
+
+      // Nodes without a closing token have zero offsets for it.
+      if (merged.closing != TOKEN_EOF) {
+        merged.closing_start += offset;
+        merged.closing_end += offset;
+      }
+
+      buffer->events[buffer->size++] = merged;
+    }
+  }
+
+  if (parser->trace != NULL) trace_span(parser->trace, "record", "split", start, trace_now());
+
+  *count = buffer->size;
+  return buffer->events;
+}
+
+// Records the statements from the checkpoint onward, in place in the source,
+// until reaching the one that encloses the offset. A statement encloses the
+// bytes from its start through the end of the separator after it. Only the
+// events and diagnostics of the last statement are kept. Returns whether every
+// statement up to and including it parsed without errors and was followed by
+// a separator, which is how the caller tells a checkpoint that the scan got
+// wrong.
+static bool parse_resume(parser_t *parser, const checkpoint_t *checkpoint, size_t offset) {
+  context_t context = { .type = CONTEXT_MAIN, .parent = NULL };
+  bool clean = true;
+
+  parser->current.start = parser->current.end = parser->start + checkpoint->offset;
+  parser->context = &context;
+  parser->recording = true;
+  lex_token(parser);
+
+  for (;;) {
+    parser->events.size = 0;
+    parser->diagnostics.size = 0;
+    parse_expression(parser);
+
+    // A statement that isn't followed by a separator ends the parse, so
+    // where one turns up here the checkpoint was likely in the middle of an
+    // expression instead of at the start of one.
+    token_type_t next = parser->current.type;
+    clean &= next == TOKEN_NEWLINE || next == TOKEN_SEMICOLON || next == TOKEN_EOF;
+    clean &= parser->diagnostics.size == 0 && !parser->diagnostics.failed && !parser->stopped;
+
+    if (parser->stopped || (size_t) (parser->current.end - parser->start) > offset) break;
+    if (!accept_any(parser, 2, TOKEN_NEWLINE, TOKEN_SEMICOLON)) break;
+  }
+
+  parser->context = NULL;
+  parser->recording = false;
+  return clean;
 }
+
+// Finds the last checkpoint at or before the offset.
+static size_t checkpoint_find(const checkpoints_t *checkpoints, size_t offset) {
+  size_t low = 0;
+  size_t high = checkpoints->size;
+
+  while (high - low > 1) {
+    size_t middle = low + (high - low) / 2;
+
+    if (checkpoints->checkpoints[middle].offset <= offset) {
+      low = middle;
+    } else {
+      high = middle;
+    }
+  }
+
+  return low;
+}
+
+// Records only the top-level statement that encloses the given offset, by
+// resuming at the nearest checkpoint before it (see checkpoints_build) rather
+// than parsing from the start. The events and diagnostics have offsets
+// relative to the whole source, and are the same as that statement's in a
+// full parse whenever the full parse reaches it. A statement that ends early
+// (like one that's followed by a stray token) only encloses the offset if
+// the offset is before that point, and otherwise the statement is returned
+// anyway as the closest there is.
+//
+// Because the checkpoints come from a quick scan, a statement that doesn't
+// parse cleanly is tried again from up to PARSE_CHECKPOINT_RETRIES earlier
+// checkpoints, and the first clean parse wins. If none is clean, the
+// statement has a real error and it's recorded from the nearest checkpoint.
+// The cost depends only on the statements parsed, not the size of the
+// source, so the handle has to be created with PARSER_OPTION_PADDED (an
+// unpadded one would copy the whole source for every attempt). Pipelining and
+// the structural index are never used here. Returns NULL for an unpadded
+// handle, and otherwise under the same conditions as parser_record.
+const event_t * parser_record_statement(parser_t *parser, off_t size, const char *source, const checkpoints_t *checkpoints, size_t offset, size_t *count) {
+  if (size > UINT32_MAX || !(parser->options & PARSER_OPTION_PADDED)) return NULL;
+
+  // The statement can have no events at all (when it's a stray token), which
+  // still has to come back as an array rather than NULL.
+  event_buffer_t *buffer = &parser->events;
+  if (buffer->capacity == 0) {
+    if ((buffer->events = malloc(1024 * sizeof(event_t))) == NULL) return NULL;
+    buffer->capacity = 1024;
+  }
+
+  checkpoint_t first = { .offset = 0 };
+  const checkpoint_t *points = checkpoints->size == 0 ? &first : checkpoints->checkpoints;
+  size_t nearest = checkpoints->size == 0 ? 0 : checkpoint_find(checkpoints, offset);
+  uint64_t start = parser->trace == NULL ? 0 : trace_now();
+
+  // The index would be built over the whole source, so it's left out.
+  unsigned int options = parser->options;
+  parser->options &= ~PARSER_OPTION_INDEX;
+
+  bool clean = false;
+  size_t index = nearest;
+
+  for (size_t retry = 0; retry <= PARSE_CHECKPOINT_RETRIES; retry++) {
+    if (!parser_reset(parser, size, source)) {
+      parser->options = options;
+      return NULL;
+    }
+
+    parser->events.size = 0;
+    parser->events.failed = false;
+
+    clean = parse_resume(parser, &points[index], offset);
+    if (clean || parser->timed_out || parser->events.failed || index == 0) break;
+    index--;
+  }
+
+  if (!clean && index != nearest && !parser->timed_out && !parser->events.failed) {
+    if (!parser_reset(parser, size, source)) {
+      parser->options = options;
+      return NULL;
+    }
+
+    parser->events.size = 0;
+    parse_resume(parser, &points[nearest], offset);
+  }
+
+  parser->options = options;
+  if (parser->trace != NULL) trace_span(parser->trace, "record", "statement", start, trace_now());
+  if (parser->events.failed) return NULL;
+
+  *count = parser->events.size;
+  return parser->events.events;
+}
+
+// Returns the syntax errors found by the last parse with the handle, in the
+// order they were found. They stay valid until the next parse.
+const diagnostic_t * parser_diagnostics(const parser_t *parser, size_t *count) {
+  *count = parser->diagnostics.size;
+  return parser->diagnostics.diagnostics;
+}
+
+void tokenize(off_t size, const char *source, token_callback_t *callback, void *data) {
+  parser_t parser = { .encoding = &ascii };
+  parser_tokenize(&parser, size, source, callback, data);
+  parser_release(&parser);
+}
+
+void parse(off_t size, const char *source, const visitor_t *visitor) {
+  parser_t parser = { .encoding = &ascii };
+  parser_parse(&parser, size, source, visitor);
+  parser_release(&parser);
+}
+
+#else
+
+// Check the syntax of the source the way parser_parse would parse it, but with
+// the copy of the grammar that doesn't build nodes. The only result is the
+// diagnostics, which are read with parser_diagnostics. Returns false if an
+// unpadded source couldn't be copied.
+bool parser_check(parser_t *parser, off_t size, const char *source) {
+  if (!parser_reset(parser, size, source)) return false;
+  uint64_t start = parser->trace == NULL ? 0 : trace_now();
+
+  if (!(parser->options & PARSER_OPTION_PIPELINED) || !parse_pipelined(parser)) {
+    lex_token(parser);
+    parse_list(parser, CONTEXT_MAIN);
+  }
+
+  if (parser->trace != NULL) trace_span(parser->trace, "check", NULL, start, trace_now());
+  return true;
+}
+
+// Returns whether the source is free of syntax errors.
+bool parse_check(off_t size, const char *source) {
+  parser_t parser = { .encoding = &ascii };
+  bool valid = parser_check(&parser, size, source) && parser.diagnostics.size == 0 && !parser.diagnostics.failed;
+  parser_release(&parser);
+  return valid;
+}
+
+#endif
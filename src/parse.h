@@ -3,7 +3,9 @@
 
 #include <sys/stat.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -13,7 +15,7 @@ typedef struct {
   size_t (*alnum)(const char *);
 } encoding_t;
 
-encoding_t ascii;
+extern const encoding_t ascii;
 
 typedef enum {
   TOKEN_EOF = 0,
@@ -88,7 +90,8 @@ typedef enum {
   TOKEN_TRUE,                   // true
   TOKEN_UNLESS,                 // unless
   TOKEN_UNTIL,                  // until
-  TOKEN_WHILE                   // while
+  TOKEN_WHILE,                  // while
+  TOKEN_MAXIMUM                 // the number of token types
 } token_type_t;
 
 // This struct represents a token in the Ruby source. We use it to track both
@@ -99,26 +102,337 @@ typedef struct {
   const char *end;
 } token_t;
 
+// This struct holds the callbacks that are called for each node as it is
+// built, from the bottom of the tree to the top. The data pointer is passed
+// through as the first argument to every callback so that visitors can keep
+// their own state instead of relying on globals. Callbacks can be left NULL
+// for kinds of nodes that the visitor isn't interested in, and those nodes
+// are skipped without any call being made (see visitor_interest).
 typedef struct {
-  void (*array)(token_t *opening, token_t *closing, size_t size);
-  void (*assign)(token_t *operator);
-  void (*begin)(token_t *opening, token_t *closing);
-  void (*binary)(token_t *operator);
-  void (*defined)(token_t *keyword);
-  void (*group)(token_t *opening, token_t *closing);
-  void (*index_call)(token_t *opening, token_t *closing);
-  void (*index_expr)(token_t *opening, token_t *closing);
-  void (*literal)(token_t *value);
-  void (*not)(token_t *keyword);
-  void (*ternary)(void);
-  void (*unary)(token_t *operator);
-  void (*until_block)(token_t *keyword);
-  void (*while_block)(token_t *keyword);
+  void *data;
+  void (*array)(void *data, token_t *opening, token_t *closing, size_t size);
+  void (*assign)(void *data, token_t *operator);
+  void (*begin)(void *data, token_t *opening, token_t *closing);
+  void (*binary)(void *data, token_t *operator);
+  void (*defined)(void *data, token_t *keyword);
+  void (*group)(void *data, token_t *opening, token_t *closing);
+  void (*index_call)(void *data, token_t *opening, token_t *closing);
+  void (*index_expr)(void *data, token_t *opening, token_t *closing);
+  void (*literal)(void *data, token_t *value);
+  void (*not)(void *data, token_t *keyword);
+  void (*ternary)(void *data);
+  void (*unary)(void *data, token_t *operator);
+  void (*until_block)(void *data, token_t *keyword);
+  void (*while_block)(void *data, token_t *keyword);
 } visitor_t;
 
-visitor_t printer;
+// The kinds of nodes that the parser builds. There is one for each callback on
+// the visitor.
+typedef enum {
+  NODE_ARRAY,
+  NODE_ASSIGN,
+  NODE_BEGIN,
+  NODE_BINARY,
+  NODE_DEFINED,
+  NODE_GROUP,
+  NODE_INDEX_CALL,
+  NODE_INDEX_EXPR,
+  NODE_LITERAL,
+  NODE_NOT,
+  NODE_TERNARY,
+  NODE_UNARY,
+  NODE_UNTIL_BLOCK,
+  NODE_WHILE_BLOCK,
+  NODE_MAXIMUM // the number of node types
+} node_type_t;
+
+// This struct represents a single node when a parse is recorded as a flat
+// array of events instead of being visited. Events are in postfix order, so a
+// node's subtree is the span of events ending with the node itself, and its
+// last child immediately precedes it. Offsets are relative to the start of the
+// source. For nodes with a closing token (arrays, begin, groups, and indices),
+// the primary token is the opening one.
+typedef struct {
+  uint8_t type;           // the node_type_t of the node
+  uint8_t token;          // the token_type_t of the primary token
+  uint8_t closing;        // the token_type_t of the closing token, if any
+  uint8_t reserved;
+  uint32_t children;      // the number of direct children
+  uint32_t span;          // the number of events in the subtree
+  uint32_t size;          // the size passed to the visitor (array elements)
+  uint32_t start;         // the offset of the start of the primary token
+  uint32_t end;           // the offset of the end of the primary token
+  uint32_t closing_start; // the offset of the start of the closing token
+  uint32_t closing_end;   // the offset of the end of the closing token
+} event_t;
+
+unsigned int visitor_interest(const visitor_t *visitor);
+void visitor_visit(const visitor_t *visitor, node_type_t type, token_t *token, token_t *closing, size_t size);
+void events_replay(const event_t *events, size_t count, const char *source, const visitor_t *visitor);
+size_t events_subtrees(const event_t *events, size_t start, size_t end, size_t *indices);
+
+// A token as a range of offsets into its source, which is what the packed
+// token format stores.
+typedef struct {
+  uint32_t start;         // the offset of the start of the token
+  uint32_t end;           // the offset of the end of the token
+  uint8_t type;           // the token_type_t of the token
+} packed_token_t;
+
+// The packed token format is a compact, position-independent encoding of a
+// token stream, laid out as:
+//
+//   header       "RBPK", version (u32), token count (u64), block count (u64)
+//   block index  for each block: data offset (u64), base offset (u32), data
+//                size (u32)
+//   blocks       for each block: one type byte per token, then for each token
+//                the gap since the end of the previous token and its length,
+//                both as LEB128 varints
+//
+// Integers in the header and index are little-endian. Every block holds
+// PACKED_BLOCK tokens except for the last. The base offset of a block is the
+// end of the token before it, so any block can be decoded on its own.
+#define PACKED_BLOCK 256
+#define PACKED_VERSION 1
+
+typedef struct {
+  const uint8_t *data;    // the start of the encoded stream
+  size_t size;            // the number of bytes in the stream
+  uint64_t count;         // the number of tokens
+  uint64_t blocks;        // the number of blocks
+} packed_reader_t;
+
+size_t packed_bound(size_t count);
+size_t packed_encode(const packed_token_t *tokens, size_t count, uint8_t *output);
+bool packed_open(packed_reader_t *reader, const uint8_t *data, size_t size);
+size_t packed_decode(const packed_reader_t *reader, size_t block, packed_token_t *tokens);
+
+// A node in a hash-consed tree. Nodes are immutable and shared, so any two
+// structurally identical subtrees built into the same tree_t are the same
+// pointer. The hash covers the node's type, tokens, text, and the hashes of
+// its children, so it identifies the whole subtree. Because nodes are shared
+// they don't have source offsets. The root of a built tree has the type
+// NODE_MAXIMUM and the top-level statements as its children.
+typedef struct tree_node tree_node_t;
+
+struct tree_node {
+  uint64_t hash;                    // the structural hash of the subtree
+  uint8_t type;                     // the node_type_t of the node
+  uint8_t token;                    // the token_type_t of the primary token
+  uint8_t closing;                  // the token_type_t of the closing token
+  uint32_t length;                  // the length of the text
+  const char *text;                 // the text of the primary token
+  size_t size;                      // the number of children
+  const tree_node_t *children[];
+};
+
+// The arena that owns the nodes, along with the table used to find existing
+// copies of nodes as they're built.
+typedef struct tree tree_t;
+
+// Called by tree_diff for each pair of subtrees that differ. One side is NULL
+// if the subtree was only present on the other side.
+typedef void (tree_diff_callback_t)(void *data, const tree_node_t *left, const tree_node_t *right);
+
+tree_t * tree_create(void);
+void tree_destroy(tree_t *tree);
+const tree_node_t * tree_build(tree_t *tree, const event_t *events, size_t count, const char *source);
+void tree_stats(const tree_t *tree, size_t *nodes, size_t *bytes);
+size_t tree_diff(const tree_node_t *left, const tree_node_t *right, tree_diff_callback_t *callback, void *data);
+void tree_print(const tree_node_t *node, FILE *stream);
+
+// A set of structural patterns over the nodes of a parse, compiled together so
+// that all of them are matched in a single pass over the recorded events (see
+// pattern.c for the syntax). Compiled patterns are read-only and can be shared
+// between threads, each of which matches with its own matcher_t.
+typedef struct patterns patterns_t;
+typedef struct matcher matcher_t;
+
+// Why a pattern didn't compile. The message is NULL if memory ran out.
+typedef struct {
+  const char *message;  // a description of the error, with static storage
+  size_t pattern;       // the index of the pattern that didn't compile
+  size_t offset;        // the offset in that pattern where it was found
+} pattern_error_t;
+
+// Called for every node that matches a pattern, with the index of the pattern,
+// the index of the node's event, and the offset of the leftmost token in the
+// node's subtree.
+typedef void (pattern_callback_t)(void *data, size_t pattern, const event_t *events, size_t index, size_t start);
+
+patterns_t * patterns_compile(const char *const *sources, size_t count, pattern_error_t *error);
+void patterns_destroy(patterns_t *patterns);
+matcher_t * matcher_create(const patterns_t *patterns);
+void matcher_destroy(matcher_t *matcher);
+size_t matcher_run(matcher_t *matcher, const event_t *events, size_t count, const char *source, pattern_callback_t *callback, void *data);
+
+// The printer visitor writes a line for each node to the stream given as its
+// data, or to stdout if it doesn't have one.
+extern const visitor_t printer;
+
+typedef void (token_callback_t)(void *data, token_t *token);
+
+typedef enum {
+  PARSER_OPTION_NONE = 0,
+  PARSER_OPTION_PIPELINED = 1 << 0,   // lex on a separate thread
+  PARSER_OPTION_TRACE_DETAIL = 1 << 1, // trace every grammar function, token, and visit
+  PARSER_OPTION_INDEX = 1 << 2,        // build a structural index before lexing
+  PARSER_OPTION_PADDED = 1 << 3        // sources are followed by PARSE_PADDING zero bytes
+} parser_option_t;
+
+// The number of zero bytes that must follow a source passed to a handle with
+// PARSER_OPTION_PADDED. The bytes aren't part of the source (they aren't
+// counted in its size) but the lexer is allowed to read them, which is what
+// lets it skip checking for the end of the source on every byte. Sources
+// without padding are copied into a padded buffer first.
+#define PARSE_PADDING 64
+
+// The classes of bytes that the structural index keeps a bitmap for.
+typedef enum {
+  INDEX_NEWLINE,    // \n
+  INDEX_WHITESPACE, // space \t \f \r \v
+  INDEX_BRACKET,    // ( ) [ ]
+  INDEX_OPERATOR,   // any character that can start an operator
+  INDEX_IDENTIFIER, // A-Z a-z 0-9 _
+  INDEX_DOLLAR,     // $
+  INDEX_DIGIT,      // 0-9
+  INDEX_MAXIMUM     // the number of classes
+} index_class_t;
+
+// The number of words of the newline bitmap between each of the index's
+// running counts of lines.
+#define INDEX_LINE_STRIDE 8
+
+// A structural index of a source. For each class there's one bit per byte of
+// the source, stored in 64-bit words so that bit i of word j describes byte
+// j * 64 + i. Bits past the end of the source are always clear, so scanning
+// for the first byte outside of a class always stops at the end.
+typedef struct {
+  uint64_t *bitmaps[INDEX_MAXIMUM];
+  size_t *lines;    // the newlines before every INDEX_LINE_STRIDE words
+  size_t blocks;    // the number of 64-bit words in each bitmap
+  size_t capacity;  // the number of words allocated for each bitmap
+} index_t;
+
+bool index_build(index_t *index, size_t size, const char *source);
+void index_free(index_t *index);
+size_t index_line(const index_t *index, size_t offset, size_t *start);
+
+// The offsets where each top-level statement of a source starts, in order,
+// as found by statements_scan. The first statement always starts at 0.
+typedef struct {
+  size_t *starts;
+  size_t size;      // the number of statements
+  size_t capacity;  // the number of offsets allocated
+} statements_t;
+
+bool statements_scan(statements_t *statements, size_t size, const char *source);
+void statements_free(statements_t *statements);
+
+// A place where a parse can resume: the start of a top-level statement along
+// with the state that the lexer is in there. Between top-level statements the
+// parser itself has no state beyond being in the main context, and the lexer
+// only has its position.
+typedef struct {
+  size_t offset;  // the offset where the statement starts
+} checkpoint_t;
+
+// The checkpoints of a source, in order. The first is always at offset 0.
+typedef struct {
+  checkpoint_t *checkpoints;
+  size_t size;      // the number of checkpoints
+  size_t capacity;  // the number of checkpoints allocated
+} checkpoints_t;
+
+bool checkpoints_build(checkpoints_t *checkpoints, size_t size, const char *source);
+void checkpoints_free(checkpoints_t *checkpoints);
+
+// A single timed span of work, like lexing a file or a call to a grammar
+// function. Times are in nanoseconds on the monotonic clock.
+typedef struct {
+  const char *name;   // what the span measures
+  const char *label;  // optional extra detail, like a file path
+  uint64_t start;
+  uint64_t duration;
+} span_t;
+
+// A growable list of spans. A trace is written to by a single thread.
+typedef struct {
+  span_t *spans;
+  size_t size;
+  size_t capacity;
+} trace_t;
+
+uint64_t trace_now(void);
+void trace_span(trace_t *trace, const char *name, const char *label, uint64_t start, uint64_t end);
+void trace_free(trace_t *trace);
+void trace_write(const trace_t *traces, size_t count, FILE *stream);
+
+// The hardware events that counters_t counts.
+typedef enum {
+  COUNTER_CYCLES,
+  COUNTER_INSTRUCTIONS,
+  COUNTER_BRANCH_MISSES,
+  COUNTER_L1D_MISSES,   // L1 data cache read misses
+  COUNTER_LLC_MISSES,   // last level cache misses
+  COUNTER_MAXIMUM       // the number of counters
+} counter_type_t;
+
+// A group of hardware performance counters for the calling thread, through
+// perf_event_open. Only the counters that could be opened are in the group.
+typedef struct {
+  int leader;                           // the fd that leads the group, or -1
+  int fds[COUNTER_MAXIMUM];             // the fd of each counter in the group
+  counter_type_t types[COUNTER_MAXIMUM]; // which counter each fd is
+  size_t size;                          // the number of counters in the group
+  int error;                            // why no counter opened, as an errno
+} counters_t;
+
+// The counts over one stretch of work. A counter that's unavailable is -1.
+typedef struct {
+  long long values[COUNTER_MAXIMUM];
+} counts_t;
+
+bool counters_open(counters_t *counters);
+void counters_close(counters_t *counters);
+void counters_start(counters_t *counters);
+void counters_stop(counters_t *counters, counts_t *counts);
+void counts_add(counts_t *total, const counts_t *counts);
+const char * counter_name(counter_type_t type);
+
+// A syntax error found while parsing. Diagnostics are kept in the handle
+// rather than printed, so that callers can report them however they like.
+typedef struct {
+  size_t start;         // the offset of the start of the token where it was found
+  size_t end;           // the offset of the end of that token
+  const char *message;  // a description of the error, with static storage
+} diagnostic_t;
+
+// The parser handle is opaque. It's meant to be created once per thread and
+// reused for many parses, keeping any buffers it has grown along the way. A
+// handle must only be used by one thread at a time, but any number of handles
+// can be used concurrently.
+typedef struct parser parser_t;
+
+parser_t * parser_create(const encoding_t *encoding, unsigned int options);
+void parser_destroy(parser_t *parser);
+void parser_set_trace(parser_t *parser, trace_t *trace);
+void parser_set_deadline(parser_t *parser, uint64_t deadline);
+void parser_set_cancel(parser_t *parser, const atomic_bool *cancel);
+bool parser_timed_out(const parser_t *parser);
+bool parser_tokenize(parser_t *parser, off_t size, const char *source, token_callback_t *callback, void *data);
+bool parser_parse(parser_t *parser, off_t size, const char *source, const visitor_t *visitor);
+const event_t * parser_record(parser_t *parser, off_t size, const char *source, size_t *count);
+const event_t * parser_record_split(parser_t *parser, off_t size, const char *source, unsigned int threads, size_t *count);
+const event_t * parser_record_statement(parser_t *parser, off_t size, const char *source, const checkpoints_t *checkpoints, size_t offset, size_t *count);
+bool parser_check(parser_t *parser, off_t size, const char *source);
+const diagnostic_t * parser_diagnostics(const parser_t *parser, size_t *count);
+
+// These are conveniences for one-off calls that create and destroy a handle.
+void tokenize(off_t size, const char *source, token_callback_t *callback, void *data);
+void parse(off_t size, const char *source, const visitor_t *visitor);
+bool parse_check(off_t size, const char *source);
 
-void tokenize(off_t, const char *);
-void parse(off_t, const char *, visitor_t *);
+const char * ripper_event(token_type_t type);
 
 #endif
@@ -0,0 +1,530 @@
+#include "parse.h"
+
+// Patterns are compiled into the states of a bottom-up tree automaton. Each
+// state tests one node (its kind, its token, and optionally its text) along
+// with the states that its children have to be in. Identical subpatterns are
+// shared, so a state is only ever tested once per node no matter how many
+// patterns use it. Matching walks the recorded events in postfix order,
+// keeping a stack of the set of states that each pending subtree is in. When
+// a node completes, its children's sets are popped and its own set is pushed,
+// so nothing more than that stack is ever built.
+
+// The state or token that matches anything.
+#define PATTERN_ANY UINT16_MAX
+
+typedef struct {
+  uint8_t type;         // the node_type_t, or NODE_MAXIMUM for any kind of node
+  uint16_t token;       // the token_type_t, or PATTERN_ANY
+  bool rest;            // whether more children than are listed are allowed
+  const char *text;     // the text the primary token must have, if any
+  size_t length;        // the length of the text
+  size_t size;          // the number of children
+  uint32_t *children;   // the state each child must be in
+} pattern_state_t;
+
+struct patterns {
+  pattern_state_t *states;
+  size_t size;
+  size_t capacity;
+  uint32_t *roots;      // the state for each pattern
+  size_t count;         // the number of patterns
+  size_t words;         // the number of 64-bit words in a set of states
+  uint32_t *buckets;    // the states to test for each kind of node, flattened
+  size_t offsets[NODE_MAXIMUM + 1]; // where each kind's states start in buckets
+};
+
+struct matcher {
+  const patterns_t *patterns;
+  uint64_t *sets;       // the stack of state sets, words at a time
+  uint32_t *starts;     // the leftmost start of each subtree on the stack
+  size_t capacity;      // the number of sets the stack can hold
+};
+
+// The names that patterns use for nodes. The uppercase ones are the names the
+// printer uses, which pin down the token as well as the kind. The lowercase
+// ones are the kinds themselves, which match any token.
+typedef struct {
+  const char *name;
+  uint8_t type;
+  uint16_t token;
+} pattern_name_t;
+
+static const pattern_name_t pattern_names[] = {
+  { "array", NODE_ARRAY, PATTERN_ANY },
+  { "assign", NODE_ASSIGN, PATTERN_ANY },
+  { "begin", NODE_BEGIN, PATTERN_ANY },
+  { "binary", NODE_BINARY, PATTERN_ANY },
+  { "defined", NODE_DEFINED, PATTERN_ANY },
+  { "group", NODE_GROUP, PATTERN_ANY },
+  { "index", NODE_INDEX_EXPR, PATTERN_ANY },
+  { "index_call", NODE_INDEX_CALL, PATTERN_ANY },
+  { "literal", NODE_LITERAL, PATTERN_ANY },
+  { "not", NODE_NOT, PATTERN_ANY },
+  { "ternary", NODE_TERNARY, PATTERN_ANY },
+  { "unary", NODE_UNARY, PATTERN_ANY },
+  { "until", NODE_UNTIL_BLOCK, PATTERN_ANY },
+  { "while", NODE_WHILE_BLOCK, PATTERN_ANY },
+
+  { "ARRAY", NODE_ARRAY, PATTERN_ANY },
+  { "BEGIN", NODE_BEGIN, PATTERN_ANY },
+  { "DEFINED", NODE_DEFINED, PATTERN_ANY },
+  { "GROUP", NODE_GROUP, PATTERN_ANY },
+  { "INDEX", NODE_INDEX_EXPR, PATTERN_ANY },
+  { "INDEX_CALL", NODE_INDEX_CALL, PATTERN_ANY },
+  { "NOT", NODE_NOT, PATTERN_ANY },
+  { "TERNARY", NODE_TERNARY, PATTERN_ANY },
+  { "UNTIL", NODE_UNTIL_BLOCK, PATTERN_ANY },
+  { "WHILE", NODE_WHILE_BLOCK, PATTERN_ANY },
+
+  { "ADD_ASSIGN", NODE_ASSIGN, TOKEN_PLUS_EQUAL },
+  { "ASSIGN", NODE_ASSIGN, TOKEN_EQUAL },
+  { "BITWISE_AND_ASSIGN", NODE_ASSIGN, TOKEN_AMPERSAND_EQUAL },
+  { "BITWISE_OR_ASSIGN", NODE_ASSIGN, TOKEN_PIPE_EQUAL },
+  { "BITWISE_XOR_ASSIGN", NODE_ASSIGN, TOKEN_CARET_EQUAL },
+  { "DIVIDE_ASSIGN", NODE_ASSIGN, TOKEN_SLASH_EQUAL },
+  { "EXPONENT_ASSIGN", NODE_ASSIGN, TOKEN_DOUBLE_STAR_EQUAL },
+  { "LOGICAL_AND_ASSIGN", NODE_ASSIGN, TOKEN_DOUBLE_AMPERSAND_EQUAL },
+  { "LOGICAL_OR_ASSIGN", NODE_ASSIGN, TOKEN_DOUBLE_PIPE_EQUAL },
+  { "MODULO_ASSIGN", NODE_ASSIGN, TOKEN_PERCENT_EQUAL },
+  { "MULTIPLY_ASSIGN", NODE_ASSIGN, TOKEN_STAR_EQUAL },
+  { "SHIFT_LEFT_ASSIGN", NODE_ASSIGN, TOKEN_SHIFT_LEFT_EQUAL },
+  { "SHIFT_RIGHT_ASSIGN", NODE_ASSIGN, TOKEN_SHIFT_RIGHT_EQUAL },
+  { "SUBTRACT_ASSIGN", NODE_ASSIGN, TOKEN_MINUS_EQUAL },
+
+  { "ADD", NODE_BINARY, TOKEN_PLUS },
+  { "BANG_EQUAL", NODE_BINARY, TOKEN_BANG_EQUAL },
+  { "BANG_TILDE", NODE_BINARY, TOKEN_BANG_TILDE },
+  { "BITWISE_AND", NODE_BINARY, TOKEN_AMPERSAND },
+  { "BITWISE_OR", NODE_BINARY, TOKEN_PIPE },
+  { "BITWISE_XOR", NODE_BINARY, TOKEN_CARET },
+  { "COMPARE", NODE_BINARY, TOKEN_COMPARE },
+  { "COMPOSITION_AND", NODE_BINARY, TOKEN_AND },
+  { "COMPOSITION_OR", NODE_BINARY, TOKEN_OR },
+  { "DIVIDE", NODE_BINARY, TOKEN_SLASH },
+  { "DOUBLE_EQUAL", NODE_BINARY, TOKEN_DOUBLE_EQUAL },
+  { "EQUAL_TILDE", NODE_BINARY, TOKEN_EQUAL_TILDE },
+  { "EXPONENT", NODE_BINARY, TOKEN_DOUBLE_STAR },
+  { "GREATER", NODE_BINARY, TOKEN_GREATER },
+  { "GREATER_EQUAL", NODE_BINARY, TOKEN_GREATER_EQUAL },
+  { "IF_MODIFIER", NODE_BINARY, TOKEN_IF },
+  { "LESS", NODE_BINARY, TOKEN_LESS },
+  { "LESS_EQUAL", NODE_BINARY, TOKEN_LESS_EQUAL },
+  { "LOGICAL_AND", NODE_BINARY, TOKEN_DOUBLE_AMPERSAND },
+  { "LOGICAL_OR", NODE_BINARY, TOKEN_DOUBLE_PIPE },
+  { "MODULO", NODE_BINARY, TOKEN_PERCENT },
+  { "MULTIPLY", NODE_BINARY, TOKEN_STAR },
+  { "RANGE_EXCLUSIVE", NODE_BINARY, TOKEN_TRIPLE_DOT },
+  { "RANGE_INCLUSIVE", NODE_BINARY, TOKEN_DOUBLE_DOT },
+  { "RESCUE_MODIFIER", NODE_BINARY, TOKEN_RESCUE },
+  { "SHIFT_LEFT", NODE_BINARY, TOKEN_SHIFT_LEFT },
+  { "SHIFT_RIGHT", NODE_BINARY, TOKEN_SHIFT_RIGHT },
+  { "SUBTRACT", NODE_BINARY, TOKEN_MINUS },
+  { "TRIPLE_EQUAL", NODE_BINARY, TOKEN_TRIPLE_EQUAL },
+  { "UNLESS_MODIFIER", NODE_BINARY, TOKEN_UNLESS },
+  { "UNTIL_MODIFIER", NODE_BINARY, TOKEN_UNTIL },
+  { "WHILE_MODIFIER", NODE_BINARY, TOKEN_WHILE },
+
+  { "BACK_REFERENCE", NODE_LITERAL, TOKEN_BACK_REFERENCE },
+  { "FALSE", NODE_LITERAL, TOKEN_FALSE },
+  { "FCALL", NODE_LITERAL, TOKEN_METHOD_IDENTIFIER },
+  { "GLOBAL_VARIABLE", NODE_LITERAL, TOKEN_GLOBAL_VARIABLE },
+  { "INTEGER", NODE_LITERAL, TOKEN_INTEGER },
+  { "NIL", NODE_LITERAL, TOKEN_NIL },
+  { "NTH_REFERENCE", NODE_LITERAL, TOKEN_NTH_REFERENCE },
+  { "SELF", NODE_LITERAL, TOKEN_SELF },
+  { "TRUE", NODE_LITERAL, TOKEN_TRUE },
+  { "VCALL", NODE_LITERAL, TOKEN_IDENTIFIER },
+
+  { "BEGINLESS_RANGE_EXCLUSIVE", NODE_UNARY, TOKEN_TRIPLE_DOT },
+  { "BEGINLESS_RANGE_INCLUSIVE", NODE_UNARY, TOKEN_DOUBLE_DOT },
+  { "UBANG", NODE_UNARY, TOKEN_BANG },
+  { "UMINUS", NODE_UNARY, TOKEN_MINUS },
+  { "UPLUS", NODE_UNARY, TOKEN_PLUS },
+  { "UTILDE", NODE_UNARY, TOKEN_TILDE }
+};
+
+// The state of compiling a single pattern.
+typedef struct {
+  patterns_t *patterns;
+  const char *source;
+  const char *cursor;
+  pattern_error_t *error;
+} pattern_compiler_t;
+
+static bool pattern_fail(pattern_compiler_t *compiler, const char *message) {
+  compiler->error->message = message;
+  compiler->error->offset = (size_t) (compiler->cursor - compiler->source);
+  return false;
+}
+
+static inline bool pattern_word(char value) {
+  return (value >= 'a' && value <= 'z') || (value >= 'A' && value <= 'Z') || (value >= '0' && value <= '9') || value == '_';
+}
+
+static inline bool pattern_space(char value) {
+  return value == ' ' || value == '\t' || value == '\n' || value == '\r';
+}
+
+static void pattern_skip(pattern_compiler_t *compiler) {
+  while (pattern_space(*compiler->cursor)) compiler->cursor++;
+}
+
+// Adds the state to the set, or finds the identical state that's already
+// there, returning its index in either case. On success the children belong
+// to the set. Returns false if it can't be allocated.
+static bool pattern_intern(patterns_t *patterns, pattern_state_t *state, uint32_t *index) {
+  for (size_t existing = 0; existing < patterns->size; existing++) {
+    const pattern_state_t *other = &patterns->states[existing];
+
+    if (
+      other->type == state->type &&
+      other->token == state->token &&
+      other->rest == state->rest &&
+      other->length == state->length &&
+      (state->text == NULL) == (other->text == NULL) &&
+      (state->text == NULL || memcmp(other->text, state->text, state->length) == 0) &&
+      other->size == state->size &&
+      (state->size == 0 || memcmp(other->children, state->children, state->size * sizeof(uint32_t)) == 0)
+    ) {
+      free(state->children);
+      *index = (uint32_t) existing;
+      return true;
+    }
+  }
+
+  if (patterns->size == patterns->capacity) {
+    size_t capacity = patterns->capacity == 0 ? 16 : patterns->capacity * 2;
+    pattern_state_t *states = realloc(patterns->states, capacity * sizeof(pattern_state_t));
+    if (states == NULL) return false;
+
+    patterns->states = states;
+    patterns->capacity = capacity;
+  }
+
+  *index = (uint32_t) patterns->size;
+  patterns->states[patterns->size++] = *state;
+  return true;
+}
+
+// Compiles the head of a pattern, which is either _ or a node name optionally
+// followed by =text, into the node tests of the state.
+static bool pattern_head(pattern_compiler_t *compiler, pattern_state_t *state) {
+  const char *start = compiler->cursor;
+  while (pattern_word(*compiler->cursor)) compiler->cursor++;
+
+  size_t length = (size_t) (compiler->cursor - start);
+  if (length == 0) return pattern_fail(compiler, "Expected a pattern.");
+
+  if (length == 1 && *start == '_') {
+    state->type = NODE_MAXIMUM;
+    state->token = PATTERN_ANY;
+  } else {
+    const pattern_name_t *name = NULL;
+
+    for (size_t index = 0; index < sizeof(pattern_names) / sizeof(pattern_name_t); index++) {
+      if (strlen(pattern_names[index].name) == length && memcmp(pattern_names[index].name, start, length) == 0) {
+        name = &pattern_names[index];
+        break;
+      }
+    }
+
+    if (name == NULL) {
+      compiler->cursor = start;
+      return pattern_fail(compiler, "Unknown node name.");
+    }
+
+    state->type = name->type;
+    state->token = name->token;
+  }
+
+  if (*compiler->cursor == '=') {
+    const char *text = ++compiler->cursor;
+
+    while (*compiler->cursor != '\0' && !pattern_space(*compiler->cursor) && *compiler->cursor != '(' && *compiler->cursor != ')') {
+      compiler->cursor++;
+    }
+
+    if (compiler->cursor == text) return pattern_fail(compiler, "Expected text after '='.");
+    state->text = text;
+    state->length = (size_t) (compiler->cursor - text);
+  }
+
+  return true;
+}
+
+// Compiles a pattern:
+//
+//     _                  any node
+//     NAME               a node with that name, and any children
+//     NAME=text          the same, whose primary token is exactly the text
+//     (NAME a b)         a node with exactly the children a and b
+//     (NAME a b ...)     a node whose first children are a and b
+//
+static bool pattern_compile(pattern_compiler_t *compiler, uint32_t *index) {
+  pattern_skip(compiler);
+  pattern_state_t state = { .rest = true };
+
+  if (*compiler->cursor != '(') {
+    return pattern_head(compiler, &state) && (pattern_intern(compiler->patterns, &state, index) || pattern_fail(compiler, NULL));
+  }
+
+  compiler->cursor++;
+  pattern_skip(compiler);
+  if (!pattern_head(compiler, &state)) return false;
+
+  state.rest = false;
+  size_t capacity = 0;
+
+  for (;;) {
+    pattern_skip(compiler);
+
+    if (*compiler->cursor == ')') {
+      compiler->cursor++;
+      break;
+    }
+
+    if (strncmp(compiler->cursor, "...", 3) == 0) {
+      compiler->cursor += 3;
+      pattern_skip(compiler);
+      state.rest = true;
+
+      if (*compiler->cursor != ')') {
+        free(state.children);
+        return pattern_fail(compiler, "Expected ')' after '...'.");
+      }
+
+      compiler->cursor++;
+      break;
+    }
+
+    if (*compiler->cursor == '\0') {
+      free(state.children);
+      return pattern_fail(compiler, "Expected ')' after the pattern.");
+    }
+
+    if (state.size == capacity) {
+      capacity = capacity == 0 ? 4 : capacity * 2;
+      uint32_t *children = realloc(state.children, capacity * sizeof(uint32_t));
+
+      if (children == NULL) {
+        free(state.children);
+        return pattern_fail(compiler, NULL);
+      }
+
+      state.children = children;
+    }
+
+    if (!pattern_compile(compiler, &state.children[state.size])) {
+      free(state.children);
+      return false;
+    }
+
+    state.size++;
+  }
+
+  if (!pattern_intern(compiler->patterns, &state, index)) {
+    free(state.children);
+    return pattern_fail(compiler, NULL);
+  }
+
+  return true;
+}
+
+void patterns_destroy(patterns_t *patterns) {
+  for (size_t index = 0; index < patterns->size; index++) {
+    free(patterns->states[index].children);
+  }
+
+  free(patterns->states);
+  free(patterns->roots);
+  free(patterns->buckets);
+  free(patterns);
+}
+
+// Groups the states by the kind of node that they test, so that a node is
+// only ever tested against the states that could match it. States that match
+// any kind of node are in every group.
+static bool patterns_bucket(patterns_t *patterns) {
+  size_t total = 0;
+
+  for (size_t type = 0; type < NODE_MAXIMUM; type++) {
+    patterns->offsets[type] = total;
+
+    for (size_t index = 0; index < patterns->size; index++) {
+      uint8_t tested = patterns->states[index].type;
+      if (tested == type || tested == NODE_MAXIMUM) total++;
+    }
+  }
+
+  patterns->offsets[NODE_MAXIMUM] = total;
+  if ((patterns->buckets = malloc((total == 0 ? 1 : total) * sizeof(uint32_t))) == NULL) return false;
+
+  size_t position = 0;
+  for (size_t type = 0; type < NODE_MAXIMUM; type++) {
+    for (size_t index = 0; index < patterns->size; index++) {
+      uint8_t tested = patterns->states[index].type;
+      if (tested == type || tested == NODE_MAXIMUM) patterns->buckets[position++] = (uint32_t) index;
+    }
+  }
+
+  return true;
+}
+
+// Compiles every pattern into one automaton. The text of the patterns is
+// referenced rather than copied, so it has to outlive the result. Returns
+// NULL with the error filled in if a pattern doesn't compile. An error without
+// a message means that memory ran out.
+patterns_t * patterns_compile(const char *const *sources, size_t count, pattern_error_t *error) {
+  *error = (pattern_error_t) { .message = NULL };
+
+  patterns_t *patterns = calloc(1, sizeof(patterns_t));
+  if (patterns == NULL) return NULL;
+
+  if ((patterns->roots = malloc((count == 0 ? 1 : count) * sizeof(uint32_t))) == NULL) {
+    patterns_destroy(patterns);
+    return NULL;
+  }
+
+  for (size_t index = 0; index < count; index++) {
+    pattern_compiler_t compiler = {
+      .patterns = patterns,
+      .source = sources[index],
+      .cursor = sources[index],
+      .error = error
+    };
+
+    error->pattern = index;
+    bool compiled = pattern_compile(&compiler, &patterns->roots[index]);
+
+    if (compiled) {
+      pattern_skip(&compiler);
+      if (*compiler.cursor != '\0') compiled = pattern_fail(&compiler, "Unexpected input after the pattern.");
+    }
+
+    if (!compiled) {
+      patterns_destroy(patterns);
+      return NULL;
+    }
+  }
+
+  patterns->count = count;
+  patterns->words = (patterns->size + 63) / 64;
+
+  if (!patterns_bucket(patterns)) {
+    patterns_destroy(patterns);
+    return NULL;
+  }
+
+  return patterns;
+}
+
+// A matcher holds the stack that a single thread matches with. Any number of
+// matchers can share the same patterns.
+matcher_t * matcher_create(const patterns_t *patterns) {
+  matcher_t *matcher = calloc(1, sizeof(matcher_t));
+  if (matcher != NULL) matcher->patterns = patterns;
+  return matcher;
+}
+
+void matcher_destroy(matcher_t *matcher) {
+  free(matcher->sets);
+  free(matcher->starts);
+  free(matcher);
+}
+
+static inline bool matcher_has(const uint64_t *set, uint32_t state) {
+  return (set[state / 64] >> (state % 64)) & 1;
+}
+
+// Tests whether the node of the event is in the state, given the sets of
+// states that its children are in.
+static inline bool matcher_test(const pattern_state_t *state, const event_t *event, const char *source, const uint64_t *children, size_t words) {
+  if (state->token != PATTERN_ANY && state->token != event->token) return false;
+  if (state->rest ? event->children < state->size : event->children != state->size) return false;
+
+  if (state->text != NULL && (
+    event->end - event->start != state->length ||
+    memcmp(source + event->start, state->text, state->length) != 0
+  )) {
+    return false;
+  }
+
+  for (size_t index = 0; index < state->size; index++) {
+    if (!matcher_has(children + index * words, state->children[index])) return false;
+  }
+
+  return true;
+}
+
+// Runs every pattern over the events of a parse in a single pass, calling the
+// callback for each node that a pattern matches, with the index of the pattern
+// and of the node's event. Matches come out in postfix order, so a node is
+// reported after everything inside of it. Alongside the sets, the stack keeps
+// the leftmost start of each subtree (which isn't always its first event,
+// since prefix operators come after their operands), so that every match
+// comes with where it starts without looking back through its subtree. The
+// source must be the one that was recorded. Returns the number of matches, or
+// SIZE_MAX if the stack couldn't be allocated.
+size_t matcher_run(matcher_t *matcher, const event_t *events, size_t count, const char *source, pattern_callback_t *callback, void *data) {
+  const patterns_t *patterns = matcher->patterns;
+  size_t words = patterns->words;
+  size_t depth = 0;
+  size_t matches = 0;
+
+  if (words == 0) return 0;
+
+  for (size_t index = 0; index < count; index++) {
+    const event_t *event = &events[index];
+    size_t children = event->children <= depth ? event->children : depth;
+
+    // Every node pushes one set, so there's always room for the result once
+    // its children have been popped unless the stack is at capacity.
+    if (depth + 1 > matcher->capacity) {
+      size_t capacity = matcher->capacity == 0 ? 64 : matcher->capacity * 2;
+      uint64_t *sets = realloc(matcher->sets, (capacity + 1) * words * sizeof(uint64_t));
+      if (sets == NULL) return SIZE_MAX;
+      matcher->sets = sets;
+
+      uint32_t *starts = realloc(matcher->starts, capacity * sizeof(uint32_t));
+      if (starts == NULL) return SIZE_MAX;
+      matcher->starts = starts;
+
+      matcher->capacity = capacity;
+    }
+
+    // The result is built in the slot just past the top of the stack, and
+    // then moved down into the place of the first child.
+    uint64_t *base = matcher->sets + (depth - children) * words;
+    uint64_t *result = matcher->sets + matcher->capacity * words;
+    memset(result, 0, words * sizeof(uint64_t));
+    bool matched = false;
+
+    for (size_t position = patterns->offsets[event->type]; position < patterns->offsets[event->type + 1]; position++) {
+      uint32_t state = patterns->buckets[position];
+
+      if (matcher_test(&patterns->states[state], event, source, base, words)) {
+        result[state / 64] |= 1ULL << (state % 64);
+        matched = true;
+      }
+    }
+
+    uint32_t start = event->start;
+    for (size_t child = depth - children; child < depth; child++) {
+      if (matcher->starts[child] < start) start = matcher->starts[child];
+    }
+
+    memcpy(base, result, words * sizeof(uint64_t));
+    matcher->starts[depth - children] = start;
+    depth = depth - children + 1;
+    if (!matched) continue;
+
+    for (size_t pattern = 0; pattern < patterns->count; pattern++) {
+      if (matcher_has(result, patterns->roots[pattern])) {
+        matches++;
+        callback(data, pattern, events, index, start);
+      }
+    }
+  }
+
+  return matches;
+}
@@ -0,0 +1,222 @@
+#include "parse.h"
+
+// The statement scanner is a cut-down lexer that only tracks what it needs to
+// find the separators between top-level statements: how deeply nested it is
+// in brackets and blocks, and whether the last token could end an operand. It
+// splits the source into tokens exactly the way the lexer does, but keywords
+// are only told apart where they matter.
+
+// Whether each byte can continue an identifier in ASCII.
+static const bool statements_words[256] = {
+  ['0'] = 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  ['A'] = 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  ['_'] = 1,
+  ['a'] = 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1
+};
+
+static inline bool statements_word(unsigned char value) {
+  return statements_words[value];
+}
+
+static inline bool statements_keyword(const char *word, size_t length, const char *keyword, size_t size) {
+  return length == size && memcmp(word, keyword, size) == 0;
+}
+
+static bool statements_push(statements_t *statements, size_t start) {
+  if (statements->size == statements->capacity) {
+    size_t capacity = statements->capacity == 0 ? 256 : statements->capacity * 2;
+    size_t *starts = realloc(statements->starts, capacity * sizeof(size_t));
+    if (starts == NULL) return false;
+
+    statements->starts = starts;
+    statements->capacity = capacity;
+  }
+
+  statements->starts[statements->size++] = start;
+  return true;
+}
+
+// Skips past the name of a global variable, whose $ has already been skipped,
+// the same way lex_global_variable does. Some of these are punctuation (like
+// $; and $,) that would otherwise look like separators.
+static size_t statements_global(size_t size, const char *source, size_t offset) {
+  if (offset == size) return offset;
+
+  switch (source[offset++]) {
+    case '_':
+      if (offset < size && statements_word((unsigned char) source[offset])) break;
+      return offset;
+    case '~': case '*': case '$': case '?': case '!': case '@': case '/':
+    case '\\': case ';': case ',': case '.': case '=': case ':': case '<':
+    case '>': case '&': case '`': case '\'': case '+':
+      return offset;
+    case '-':
+      if (offset < size && statements_word((unsigned char) source[offset])) offset++;
+      return offset;
+    case '1': case '2': case '3': case '4': case '5':
+    case '6': case '7': case '8': case '9':
+      while (offset < size && source[offset] >= '0' && source[offset] <= '9') offset++;
+      return offset;
+    default:
+      offset--;
+      break;
+  }
+
+  while (offset < size && statements_word((unsigned char) source[offset])) offset++;
+  return offset;
+}
+
+// Finds where each top-level statement of the source starts. A statement ends
+// at a newline or semicolon that isn't nested in brackets, parentheses, or a
+// begin, while, or until block, and that comes right after something that can
+// end an operand (so that it isn't the continuation of an expression). The
+// next statement starts just past the separator, and the first one starts at
+// 0. Like the lexer, the scan stops at a byte that ends the source or can't
+// start a token.
+//
+// This is a fast approximation of what the parser would see: while and until
+// are only counted as blocks when they start an operand, and anything the
+// lexer handles for other encodings ends the scan early. Callers that need the
+// statements to be exact should check them against a parse of each one. The
+// offsets stay valid until the next scan. Returns false if they can't be
+// allocated.
+bool statements_scan(statements_t *statements, size_t size, const char *source) {
+  statements->size = 0;
+  if (!statements_push(statements, 0)) return false;
+
+  size_t depth = 0;
+  bool operand = false;
+  size_t offset = 0;
+
+  while (offset < size) {
+    unsigned char value = (unsigned char) source[offset++];
+
+    switch (value) {
+      case '\0':
+      case '\004':
+      case '\032':
+        return true;
+      case ' ': case '\t': case '\f': case '\r': case '\v':
+        break;
+      case '\n':
+      case ';':
+        if (value == '\n') {
+          while (offset < size && source[offset] == '\n') offset++;
+        }
+
+        if (depth == 0 && operand && offset < size && !statements_push(statements, offset)) return false;
+        operand = false;
+        break;
+      case '(': case '[':
+        depth++;
+        operand = false;
+        break;
+      case ')': case ']':
+        if (depth > 0) depth--;
+        operand = true;
+        break;
+      case ',': case ':': case '?': case '~': case '=': case '<': case '>':
+      case '+': case '-': case '*': case '/': case '%': case '&': case '|':
+      case '^': case '.': case '!':
+        operand = false;
+        break;
+      case '$':
+        offset = statements_global(size, source, offset);
+        operand = true;
+        break;
+      case '0': case '1': case '2': case '3': case '4':
+      case '5': case '6': case '7': case '8': case '9':
+        while (offset < size && source[offset] >= '0' && source[offset] <= '9') offset++;
+        operand = true;
+        break;
+      default: {
+        if (!statements_word(value)) return true;
+
+        const char *word = source + offset - 1;
+        while (offset < size && statements_word((unsigned char) source[offset])) offset++;
+        size_t length = (size_t) (source + offset - word);
+
+        // Method names like foo? and foo!, and the defined? operator.
+        if (
+          offset < size && (source[offset] == '?' || source[offset] == '!') &&
+          (offset + 1 == size || source[offset + 1] != '=')
+        ) {
+          offset++;
+          operand = !statements_keyword(word, length, "defined", 7);
+          break;
+        }
+
+        if (statements_keyword(word, length, "begin", 5)) {
+          depth++;
+          operand = false;
+        } else if (statements_keyword(word, length, "while", 5) || statements_keyword(word, length, "until", 5)) {
+          // After an operand, these are modifiers rather than blocks.
+          if (!operand) depth++;
+          operand = false;
+        } else if (statements_keyword(word, length, "end", 3)) {
+          if (depth > 0) depth--;
+          operand = true;
+        } else if (
+          statements_keyword(word, length, "and", 3) ||
+          statements_keyword(word, length, "ensure", 6) ||
+          statements_keyword(word, length, "if", 2) ||
+          statements_keyword(word, length, "not", 3) ||
+          statements_keyword(word, length, "or", 2) ||
+          statements_keyword(word, length, "rescue", 6) ||
+          statements_keyword(word, length, "unless", 6)
+        ) {
+          operand = false;
+        } else {
+          // Identifiers, along with true, false, nil, and self.
+          operand = true;
+        }
+        break;
+      }
+    }
+  }
+
+  return true;
+}
+
+void statements_free(statements_t *statements) {
+  free(statements->starts);
+  *statements = (statements_t) { .size = 0 };
+}
+
+// Builds the checkpoints that parser_record_statement resumes from, which are
+// the statements found by statements_scan. This is a single cheap pass over
+// the source, so it's meant to be done once and reused for every lookup until
+// the source changes. Returns false if the checkpoints can't be allocated.
+bool checkpoints_build(checkpoints_t *checkpoints, size_t size, const char *source) {
+  statements_t statements = { .size = 0 };
+  checkpoints->size = 0;
+
+  if (!statements_scan(&statements, size, source)) {
+    statements_free(&statements);
+    return false;
+  }
+
+  if (statements.size > checkpoints->capacity) {
+    checkpoint_t *resized = realloc(checkpoints->checkpoints, statements.size * sizeof(checkpoint_t));
+
+    if (resized == NULL) {
+      statements_free(&statements);
+      return false;
+    }
+
+    checkpoints->checkpoints = resized;
+    checkpoints->capacity = statements.size;
+  }
+
+  for (size_t index = 0; index < statements.size; index++) {
+    checkpoints->checkpoints[checkpoints->size++] = (checkpoint_t) { .offset = statements.starts[index] };
+  }
+
+  statements_free(&statements);
+  return true;
+}
+
+void checkpoints_free(checkpoints_t *checkpoints) {
+  free(checkpoints->checkpoints);
+  *checkpoints = (checkpoints_t) { .size = 0 };
+}
@@ -0,0 +1,103 @@
+#include <time.h>
+
+#include "parse.h"
+
+// Returns the current time on the monotonic clock in nanoseconds.
+uint64_t trace_now(void) {
+  struct timespec spec;
+  clock_gettime(CLOCK_MONOTONIC, &spec);
+  return (uint64_t) spec.tv_sec * 1000000000 + (uint64_t) spec.tv_nsec;
+}
+
+// Appends a span to the trace. The name and label must outlive the trace. If
+// the trace can't grow then the span is dropped.
+void trace_span(trace_t *trace, const char *name, const char *label, uint64_t start, uint64_t end) {
+  if (trace->size == trace->capacity) {
+    size_t capacity = trace->capacity == 0 ? 1024 : trace->capacity * 2;
+    span_t *spans = realloc(trace->spans, capacity * sizeof(span_t));
+    if (spans == NULL) return;
+
+    trace->spans = spans;
+    trace->capacity = capacity;
+  }
+
+  trace->spans[trace->size++] = (span_t) {
+    .name = name,
+    .label = label,
+    .start = start,
+    .duration = end - start
+  };
+}
+
+void trace_free(trace_t *trace) {
+  free(trace->spans);
+  trace->spans = NULL;
+  trace->size = 0;
+  trace->capacity = 0;
+}
+
+// Writes a JSON string with the necessary characters escaped.
+static void write_string(FILE *stream, const char *value) {
+  fputc('"', stream);
+
+  for (const char *cursor = value; *cursor != '\0'; cursor++) {
+    switch (*cursor) {
+      case '"': fputs("\\\"", stream); break;
+      case '\\': fputs("\\\\", stream); break;
+      case '\n': fputs("\\n", stream); break;
+      default:
+        if ((unsigned char) *cursor < 0x20) {
+          fprintf(stream, "\\u%04x", *cursor);
+        } else {
+          fputc(*cursor, stream);
+        }
+    }
+  }
+
+  fputc('"', stream);
+}
+
+// Writes the spans from the given traces in the Chrome trace event format, so
+// that they can be loaded into chrome://tracing or Perfetto. Each trace is
+// shown as its own thread, and timestamps are relative to the earliest span.
+void trace_write(const trace_t *traces, size_t count, FILE *stream) {
+  uint64_t origin = UINT64_MAX;
+
+  for (size_t index = 0; index < count; index++) {
+    for (size_t span = 0; span < traces[index].size; span++) {
+      if (traces[index].spans[span].start < origin) origin = traces[index].spans[span].start;
+    }
+  }
+
+  fputs("{\"traceEvents\":[\n", stream);
+  bool first = true;
+
+  for (size_t index = 0; index < count; index++) {
+    for (size_t offset = 0; offset < traces[index].size; offset++) {
+      const span_t *span = &traces[index].spans[offset];
+
+      if (!first) fputs(",\n", stream);
+      first = false;
+
+      fputs("{\"name\":", stream);
+      write_string(stream, span->name);
+      fprintf(
+        stream,
+        ",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f",
+        index,
+        (span->start - origin) / 1e3,
+        span->duration / 1e3
+      );
+
+      if (span->label != NULL) {
+        fputs(",\"args\":{\"label\":", stream);
+        write_string(stream, span->label);
+        fputc('}', stream);
+      }
+
+      fputc('}', stream);
+    }
+  }
+
+  fputs("\n]}\n", stream);
+}
@@ -0,0 +1,331 @@
+#include <stddef.h>
+
+#include "parse.h"
+
+#define TREE_CHUNK (64 * 1024)
+
+// A chunk of memory that nodes are bump allocated out of. Chunks are never
+// freed individually, only all at once when the tree is destroyed.
+typedef struct chunk {
+  struct chunk *next;
+  size_t size;
+  size_t capacity;
+  max_align_t data[];
+} chunk_t;
+
+struct tree {
+  chunk_t *chunks;              // the chunk being allocated from, then older ones
+  tree_node_t **table;          // open-addressed table of every unique node
+  size_t nodes;                 // the number of unique nodes
+  size_t capacity;              // the number of slots in the table
+  size_t bytes;                 // the number of bytes allocated for nodes
+  const tree_node_t **stack;    // the retained stack used while building
+  size_t depth;                 // the number of entries the stack can hold
+};
+
+tree_t * tree_create(void) {
+  return calloc(1, sizeof(tree_t));
+}
+
+void tree_destroy(tree_t *tree) {
+  chunk_t *chunk = tree->chunks;
+
+  while (chunk != NULL) {
+    chunk_t *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+
+  free(tree->table);
+  free(tree->stack);
+  free(tree);
+}
+
+// Returns the number of unique nodes in the tree and the number of bytes that
+// they take up.
+void tree_stats(const tree_t *tree, size_t *nodes, size_t *bytes) {
+  *nodes = tree->nodes;
+  *bytes = tree->bytes;
+}
+
+static void * tree_allocate(tree_t *tree, size_t size) {
+  size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+  chunk_t *chunk = tree->chunks;
+
+  if (chunk == NULL || chunk->capacity - chunk->size < size) {
+    size_t capacity = size > TREE_CHUNK ? size : TREE_CHUNK;
+    if ((chunk = malloc(sizeof(chunk_t) + capacity)) == NULL) return NULL;
+
+    chunk->next = tree->chunks;
+    chunk->size = 0;
+    chunk->capacity = capacity;
+    tree->chunks = chunk;
+  }
+
+  void *pointer = (char *) chunk->data + chunk->size;
+  chunk->size += size;
+  tree->bytes += size;
+  return pointer;
+}
+
+static inline uint64_t hash_mix(uint64_t hash, uint64_t value) {
+  hash = (hash ^ value) * 0x9e3779b97f4a7c15ULL;
+  return hash ^ (hash >> 32);
+}
+
+static uint64_t hash_text(const char *text, size_t length) {
+  uint64_t hash = length;
+  size_t index = 0;
+
+  for (; index + 8 <= length; index += 8) {
+    uint64_t word;
+    memcpy(&word, text + index, 8);
+    hash = hash_mix(hash, word);
+  }
+
+  uint64_t tail = 0;
+  memcpy(&tail, text + index, length - index);
+  return hash_mix(hash, tail);
+}
+
+// Compares everything about two nodes except for their children.
+static bool tree_node_shallow_equal(const tree_node_t *left, const tree_node_t *right) {
+  return (
+    left->type == right->type &&
+    left->token == right->token &&
+    left->closing == right->closing &&
+    left->length == right->length &&
+    memcmp(left->text, right->text, left->length) == 0
+  );
+}
+
+// Doubles the size of the table and reinserts every node.
+static bool tree_grow(tree_t *tree) {
+  size_t capacity = tree->capacity == 0 ? 1024 : tree->capacity * 2;
+  tree_node_t **table = calloc(capacity, sizeof(tree_node_t *));
+  if (table == NULL) return false;
+
+  for (size_t index = 0; index < tree->capacity; index++) {
+    tree_node_t *node = tree->table[index];
+    if (node == NULL) continue;
+
+    size_t slot = node->hash & (capacity - 1);
+    while (table[slot] != NULL) slot = (slot + 1) & (capacity - 1);
+    table[slot] = node;
+  }
+
+  free(tree->table);
+  tree->table = table;
+  tree->capacity = capacity;
+  return true;
+}
+
+// Returns the unique node with the given contents, creating it if this is the
+// first time it has been seen. Since the children are already unique, they
+// can be compared by pointer, so checking for an existing copy never has to
+// walk a subtree.
+static const tree_node_t * tree_intern(tree_t *tree, node_type_t type, token_type_t token, token_type_t closing, const char *text, size_t length, const tree_node_t **children, size_t size) {
+  if (tree->nodes * 2 >= tree->capacity && !tree_grow(tree)) return NULL;
+
+  uint64_t hash = hash_mix(hash_mix(hash_mix(type, token), closing), hash_text(text, length));
+  for (size_t index = 0; index < size; index++) {
+    hash = hash_mix(hash, children[index]->hash);
+  }
+
+  size_t slot = hash & (tree->capacity - 1);
+  for (tree_node_t *node; (node = tree->table[slot]) != NULL; slot = (slot + 1) & (tree->capacity - 1)) {
+    if (
+      node->hash == hash &&
+      node->type == type &&
+      node->token == token &&
+      node->closing == closing &&
+      node->length == length &&
+      node->size == size &&
+      memcmp(node->text, text, length) == 0 &&
+      memcmp(node->children, children, size * sizeof(tree_node_t *)) == 0
+    ) {
+      return node;
+    }
+  }
+
+  tree_node_t *node = tree_allocate(tree, sizeof(tree_node_t) + size * sizeof(tree_node_t *) + length);
+  if (node == NULL) return NULL;
+
+  char *copy = (char *) &node->children[size];
+  memcpy(copy, text, length);
+  memcpy(node->children, children, size * sizeof(tree_node_t *));
+
+  node->hash = hash;
+  node->type = (uint8_t) type;
+  node->token = (uint8_t) token;
+  node->closing = (uint8_t) closing;
+  node->length = (uint32_t) length;
+  node->text = copy;
+  node->size = size;
+
+  tree->table[slot] = node;
+  tree->nodes++;
+  return node;
+}
+
+// Builds a tree out of recorded events, reusing any nodes that are already in
+// the tree. Each event pops its children off of a stack and pushes itself, so
+// the hashes are computed bottom-up in the same order the visitor would see.
+// Returns the root, or NULL if memory couldn't be allocated.
+const tree_node_t * tree_build(tree_t *tree, const event_t *events, size_t count, const char *source) {
+  if (tree->depth < count + 1) {
+    const tree_node_t **stack = realloc(tree->stack, (count + 1) * sizeof(tree_node_t *));
+    if (stack == NULL) return NULL;
+
+    tree->stack = stack;
+    tree->depth = count + 1;
+  }
+
+  const tree_node_t **stack = tree->stack;
+  size_t depth = 0;
+
+  for (size_t index = 0; index < count; index++) {
+    const event_t *event = &events[index];
+    depth -= event->children;
+
+    const tree_node_t *node = tree_intern(
+      tree,
+      event->type,
+      event->token,
+      event->closing,
+      source + event->start,
+      event->end - event->start,
+      &stack[depth],
+      event->children
+    );
+
+    if (node == NULL) return NULL;
+    stack[depth++] = node;
+  }
+
+  return tree_intern(tree, NODE_MAXIMUM, TOKEN_EOF, TOKEN_EOF, "", 0, stack, depth);
+}
+
+// Diffs two lists of children. Children that match at the front and back are
+// skipped, and what's left in the middle is paired up in order. When one side
+// has more children left than the other, a child that doesn't line up with its
+// counterpart but does line up with the one after it is treated as inserted
+// (or removed) rather than changed.
+static size_t tree_diff_children(const tree_node_t *left, const tree_node_t *right, tree_diff_callback_t *callback, void *data) {
+  const tree_node_t *const *lefts = left->children;
+  const tree_node_t *const *rights = right->children;
+  size_t left_size = left->size;
+  size_t right_size = right->size;
+  size_t left_index = 0;
+  size_t right_index = 0;
+
+  while (left_index < left_size && right_index < right_size && lefts[left_index]->hash == rights[right_index]->hash) {
+    left_index++;
+    right_index++;
+  }
+
+  while (left_size > left_index && right_size > right_index && lefts[left_size - 1]->hash == rights[right_size - 1]->hash) {
+    left_size--;
+    right_size--;
+  }
+
+  size_t differences = 0;
+  while (left_index < left_size && right_index < right_size) {
+    const tree_node_t *before = lefts[left_index];
+    const tree_node_t *after = rights[right_index];
+    size_t left_remaining = left_size - left_index;
+    size_t right_remaining = right_size - right_index;
+
+    if (
+      right_remaining > left_remaining &&
+      !tree_node_shallow_equal(before, after) &&
+      tree_node_shallow_equal(before, rights[right_index + 1])
+    ) {
+      differences += tree_diff(NULL, after, callback, data);
+      right_index++;
+    } else if (
+      left_remaining > right_remaining &&
+      !tree_node_shallow_equal(before, after) &&
+      tree_node_shallow_equal(lefts[left_index + 1], after)
+    ) {
+      differences += tree_diff(before, NULL, callback, data);
+      left_index++;
+    } else {
+      differences += tree_diff(before, after, callback, data);
+      left_index++;
+      right_index++;
+    }
+  }
+
+  for (; left_index < left_size; left_index++) {
+    differences += tree_diff(lefts[left_index], NULL, callback, data);
+  }
+
+  for (; right_index < right_size; right_index++) {
+    differences += tree_diff(NULL, rights[right_index], callback, data);
+  }
+
+  return differences;
+}
+
+// Calls the callback for each of the smallest subtrees that differ between the
+// two trees and returns how many there were. Any subtree whose hash matches on
+// both sides is skipped without being looked at, so diffing two versions of a
+// file costs time in proportion to what changed rather than to its size. When
+// both trees were built into the same tree_t, matching subtrees are the same
+// pointer.
+size_t tree_diff(const tree_node_t *left, const tree_node_t *right, tree_diff_callback_t *callback, void *data) {
+  if (left == right) return 0;
+
+  if (left == NULL || right == NULL || !tree_node_shallow_equal(left, right)) {
+    callback(data, left, right);
+    return 1;
+  }
+
+  if (left->hash == right->hash) return 0;
+  return tree_diff_children(left, right, callback, data);
+}
+
+static const char * tree_node_name(const tree_node_t *node) {
+  switch (node->type) {
+    case NODE_ARRAY: return "array";
+    case NODE_ASSIGN: return "assign";
+    case NODE_BEGIN: return "begin";
+    case NODE_BINARY: return "binary";
+    case NODE_DEFINED: return "defined";
+    case NODE_GROUP: return "group";
+    case NODE_INDEX_CALL: return "index_call";
+    case NODE_INDEX_EXPR: return "index_expr";
+    case NODE_LITERAL: return "literal";
+    case NODE_NOT: return "not";
+    case NODE_TERNARY: return "ternary";
+    case NODE_UNARY: return "unary";
+    case NODE_UNTIL_BLOCK: return "until";
+    case NODE_WHILE_BLOCK: return "while";
+    default: return "program";
+  }
+}
+
+// Prints the subtree as an s-expression, like (binary + (literal 1) (literal
+// 2)). The text is only shown for nodes where the name doesn't imply it.
+void tree_print(const tree_node_t *node, FILE *stream) {
+  fprintf(stream, "(%s", tree_node_name(node));
+
+  switch (node->type) {
+    case NODE_ASSIGN:
+    case NODE_BINARY:
+    case NODE_LITERAL:
+    case NODE_UNARY:
+      fprintf(stream, " %.*s", (int) node->length, node->text);
+      break;
+    default:
+      break;
+  }
+
+  for (size_t index = 0; index < node->size; index++) {
+    fputc(' ', stream);
+    tree_print(node->children[index], stream);
+  }
+
+  fputc(')', stream);
+}
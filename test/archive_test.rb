@@ -0,0 +1,109 @@
+# frozen_string_literal: true
+
+require "open3"
+require "rubygems/package"
+require "tempfile"
+require "test/unit"
+
+class ArchiveTest < Test::Unit::TestCase
+  MEMBERS = {
+    "a.rb" => "a = 1 + 2\n",
+    "lib/b.rb" => "[1, foo, $bar]\n",
+    "README" => "not ruby\n",
+    "#{"long/" * 30}c.rb" => "-baz if qux\n",
+    # Too close to the end of its block to be followed by the parser's
+    # padding, so it goes through the checked path. The member after it keeps
+    # the end of the archive's zero blocks from counting as padding.
+    "unpadded.rb" => "#{"foo + bar\n" * 45}x",
+    "d.rb" => "d\n"
+  }
+
+  def test_members
+    ["", "-j3"].each do |mode|
+      sections, status = parse_archive(mode)
+
+      assert_equal(0, status.exitstatus)
+      assert_equal(MEMBERS.keys.grep(/\.rb\z/).sort, sections.keys.sort)
+
+      sections.each do |path, output|
+        assert_equal(parse(MEMBERS.fetch(path)), output, "Expected #{path} to parse the same as on its own")
+      end
+    end
+  end
+
+  # The statement at an offset is only parsed from padded sources, so the
+  # unpadded member has to be copied first.
+  def test_members_at
+    ["--at=12", "--at=400"].each do |mode|
+      sections, status = parse_archive(mode)
+
+      assert_equal(0, status.exitstatus)
+      assert_equal(MEMBERS.keys.grep(/\.rb\z/).sort, sections.keys.sort)
+
+      sections.each do |path, output|
+        assert_equal(parse(MEMBERS.fetch(path), mode), output, "Expected #{path} to parse the same as on its own with #{mode}")
+      end
+    end
+  end
+
+  def test_not_an_archive
+    _, stderr, status = Open3.capture3(script, "parse", "--tar", __FILE__)
+
+    assert_equal(1, status.exitstatus)
+    assert_equal("#{__FILE__}: not a tar archive\n", stderr)
+  end
+
+  # Anything that isn't made up of whole blocks starting with a header (or the
+  # end of the archive) is rejected the same way, however short it is.
+  def test_not_an_archive_short
+    ["", "a = 1\n", "\0" * 511, "\0" * 1025, "a" * 1024].each do |contents|
+      Tempfile.create(["short", ".tar"]) do |file|
+        file.write(contents)
+        file.flush
+
+        stdout, stderr, status = Open3.capture3(script, "parse", "--tar", file.path)
+        assert_equal([1, "", "#{file.path}: not a tar archive\n"], [status.exitstatus, stdout, stderr], "Expected #{contents[0, 8].inspect} (#{contents.bytesize} bytes) not to be an archive")
+      end
+    end
+  end
+
+  # An archive with nothing in it is still an archive.
+  def test_empty_archive
+    Tempfile.create(["empty", ".tar"]) do |file|
+      file.write("\0" * 10_240)
+      file.flush
+
+      stdout, stderr, status = Open3.capture3(script, "parse", "--tar", file.path)
+      assert_equal([0, "", ""], [status.exitstatus, stdout, stderr])
+    end
+  end
+
+  private
+
+  def script
+    File.expand_path("../build/parse", __dir__)
+  end
+
+  def parse(source, *arguments)
+    stdout, = Open3.capture2(script, "parse", *arguments, stdin_data: source)
+    stdout
+  end
+
+  # Writes the members into a tar archive and parses it, splitting the output
+  # up by the path that each section is keyed by.
+  def parse_archive(mode)
+    Tempfile.create(["archive", ".tar"]) do |file|
+      Gem::Package::TarWriter.new(file) do |tar|
+        MEMBERS.each do |path, source|
+          tar.add_file_simple(path, 0o644, source.bytesize) { |io| io.write(source) }
+        end
+      end
+
+      file.flush
+      stdout, status = Open3.capture2(*[script, "parse", "--tar", mode, file.path].reject(&:empty?))
+      sections = stdout.split(/^==> (.+) <==\n/, -1).drop(1).each_slice(2).to_h
+
+      [sections, status]
+    end
+  end
+end
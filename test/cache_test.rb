@@ -0,0 +1,192 @@
+# frozen_string_literal: true
+
+require "open3"
+require "tmpdir"
+require "test/unit"
+
+class CacheTest < Test::Unit::TestCase
+  SOURCE = "a = [1, 2] + (b - 1) if c\nd = [3,\n"
+
+  def test_parse
+    Dir.mktmpdir do |directory|
+      expected = Open3.capture3(script, "parse", stdin_data: SOURCE)
+
+      stdout, stderr, status = cached(directory, "parse")
+      assert_equal(expected[0], stdout)
+      assert_equal([expected[1], stats(0, 1, 1)], split_stats(stderr))
+      assert_equal(expected[2].exitstatus, status.exitstatus)
+      assert_equal(1, entries(directory).length)
+
+      stdout, stderr, = cached(directory, "parse")
+      assert_equal(expected[0], stdout)
+      assert_equal([expected[1], stats(1, 0, 0)], split_stats(stderr))
+    end
+  end
+
+  def test_check
+    Dir.mktmpdir do |directory|
+      expected = Open3.capture2(script, "check", stdin_data: SOURCE)
+
+      2.times do |hits|
+        stdout, stderr, status = cached(directory, "check")
+
+        assert_equal(expected[0], stdout)
+        assert_equal(1, status.exitstatus)
+        assert_equal(["", stats(hits, 1 - hits, 1 - hits)], split_stats(stderr))
+      end
+    end
+  end
+
+  def test_kinds
+    Dir.mktmpdir do |directory|
+      cached(directory, "parse")
+      _, stderr, = cached(directory, "check")
+
+      assert_equal(stats(0, 1, 1), split_stats(stderr)[1])
+      assert_equal(2, entries(directory).length)
+    end
+  end
+
+  def test_split
+    Dir.mktmpdir do |directory|
+      expected, = Open3.capture3(script, "parse", stdin_data: SOURCE)
+      cached(directory, "parse", "--split=2")
+      stdout, stderr, = cached(directory, "parse")
+
+      assert_equal(expected, stdout)
+      assert_equal(stats(1, 0, 0), split_stats(stderr)[1])
+    end
+  end
+
+  def test_corrupted
+    Dir.mktmpdir do |directory|
+      expected, = Open3.capture3(script, "parse", stdin_data: SOURCE)
+      cached(directory, "parse")
+
+      entries(directory).each { |entry| File.write(entry, File.binread(entry)[0...-3]) }
+      stdout, stderr, = cached(directory, "parse")
+      assert_equal(expected, stdout)
+      assert_equal(stats(0, 1, 1), split_stats(stderr)[1])
+
+      entries(directory).each { |entry| File.write(entry, "RBPC" + "\0" * 100) }
+      stdout, stderr, = cached(directory, "parse")
+      assert_equal(expected, stdout)
+      assert_equal(stats(0, 1, 1), split_stats(stderr)[1])
+    end
+  end
+
+  # Each event is 32 bytes after the 40-byte header. Damaging any one field
+  # that's used to index into the source or the events makes the entry a miss
+  # rather than something that's replayed.
+  def test_damaged_events
+    {
+      "type" => [0, "C", 40],
+      "children" => [4, "L<", 2],
+      "span" => [8, "L<", 100],
+      "start" => [16, "L<", 30],
+      "end" => [20, "L<", 0x7fffffff],
+      "closing_start" => [24, "L<", 0x7fffffff],
+      "closing_end" => [28, "L<", 1000]
+    }.each do |field, (offset, format, value)|
+      Dir.mktmpdir do |directory|
+        expected, = Open3.capture3(script, "parse", stdin_data: SOURCE)
+        cached(directory, "parse")
+
+        entries(directory).each do |entry|
+          data = File.binread(entry)
+          data[40 + offset, [value].pack(format).bytesize] = [value].pack(format)
+          File.binwrite(entry, data)
+        end
+
+        stdout, stderr, = cached(directory, "parse")
+        assert_equal(expected, stdout, "Expected a damaged #{field} to be ignored")
+        assert_equal(stats(0, 1, 1), split_stats(stderr)[1], "Expected a damaged #{field} to miss")
+      end
+    end
+  end
+
+  def test_damaged_diagnostics
+    Dir.mktmpdir do |directory|
+      expected = Open3.capture3(script, "parse", stdin_data: SOURCE)
+      cached(directory, "parse")
+
+      # The diagnostics come last, and the only one's message is known.
+      entries(directory).each do |entry|
+        data = File.binread(entry)
+        record = data.rindex([expected[1].chomp.bytesize].pack("L<") + expected[1].chomp) - 16
+        data[record, 8] = [SOURCE.bytesize + 1].pack("Q<")
+        File.binwrite(entry, data)
+      end
+
+      stdout, stderr, = cached(directory, "parse")
+      assert_equal(expected[0], stdout)
+      assert_equal([expected[1], stats(0, 1, 1)], split_stats(stderr))
+    end
+  end
+
+  def test_eviction
+    Dir.mktmpdir do |directory|
+      cached(directory, "parse")
+      _, stderr, = cached(directory, "parse", "--cache-size=0", source: "a + b\n")
+
+      assert_match(/, 2 evicted,/, stderr)
+      assert_empty(entries(directory))
+    end
+  end
+
+  # Temporary files sit next to the entries while they're written, and ones
+  # left behind by a process that died first are cleaned up once they're old.
+  def test_temporaries
+    Dir.mktmpdir do |directory|
+      cached(directory, "parse")
+      prefix = File.dirname(entries(directory).first)
+
+      stale = File.join(prefix, ".tmp-1-0")
+      fresh = File.join(prefix, ".tmp-1-1")
+      File.write(stale, "RBPC")
+      File.write(fresh, "RBPC")
+      File.utime(Time.now - 7200, Time.now - 7200, stale)
+
+      _, stderr, = cached(directory, "parse", source: "a + b\n")
+
+      assert_equal(stats(0, 1, 1), split_stats(stderr)[1])
+      assert_equal([false, true], [File.exist?(stale), File.exist?(fresh)])
+      assert_equal([], Dir.children(directory).grep_v(/\A\h\h\z/))
+    end
+  end
+
+  def test_timeout
+    Dir.mktmpdir do |directory|
+      _, _, status = cached(directory, "check", "--timeout=1", source: "a + b\n" * 2_000_000)
+
+      assert_equal(1, status.exitstatus)
+      assert_empty(entries(directory))
+    end
+  end
+
+  private
+
+  def script
+    File.expand_path("../build/parse", __dir__)
+  end
+
+  def cached(directory, command, *options, source: SOURCE)
+    Open3.capture3(script, command, "--cache", directory, "--cache-stats", *options, stdin_data: source)
+  end
+
+  # Splits the statistics, which are always printed last, from the rest of
+  # stderr.
+  def split_stats(stderr)
+    lines = stderr.lines
+    [lines[0...-1].join, lines.last.sub(/, [\d.]+ MB read.*/m, "")]
+  end
+
+  def stats(hits, misses, stored)
+    rate = (hits + misses).zero? ? 0.0 : 100.0 * hits / (hits + misses)
+    format("cache: %d hits (%.1f%%), %d misses, %d stored, 0 evicted", hits, rate, misses, stored)
+  end
+
+  def entries(directory)
+    Dir.glob(File.join(directory, "*", "*"))
+  end
+end
@@ -0,0 +1,93 @@
+# frozen_string_literal: true
+
+require "open3"
+require "tempfile"
+require "test/unit"
+
+class CheckTest < Test::Unit::TestCase
+  def test_valid
+    stdout, status = check("a = [1, 2] + (b - 1) if c\n")
+
+    assert_equal(0, status.exitstatus)
+    assert_equal("-: Syntax OK\n", stdout)
+  end
+
+  def test_diagnostics
+    stdout, status = check("a = 1\nb = [1, 2\n")
+
+    assert_equal(1, status.exitstatus)
+    assert_equal("-:2:10: Expected ']' after the array elements.\n", stdout)
+  end
+
+  def test_diagnostics_in_order
+    stdout, status = check("(a\n[b\n")
+
+    assert_equal(1, status.exitstatus)
+    assert_equal(
+      "-:1:3: Expected ')' after expression.\n-:2:3: Expected ']' after the array elements.\n",
+      stdout
+    )
+  end
+
+  def test_diagnostics_far_in
+    stdout, status = check("#{"x\n" * 1000}#{" " * 600}(a\n#{"y\n" * 63}#{" " * 70}[b\n")
+
+    assert_equal(1, status.exitstatus)
+    assert_equal(
+      "-:1001:603: Expected ')' after expression.\n-:1065:73: Expected ']' after the array elements.\n",
+      stdout
+    )
+  end
+
+  def test_nested_too_deeply
+    stdout, status = check("#{"(" * 100_000}a")
+
+    assert_equal(1, status.exitstatus)
+    assert_equal("-:1:1026: Expression nested too deeply.\n", stdout)
+  end
+
+  def test_files
+    Tempfile.create(["valid", ".rb"]) do |valid|
+      Tempfile.create(["invalid", ".rb"]) do |invalid|
+        valid.write("a + b\n")
+        valid.flush
+        invalid.write("begin\na\n")
+        invalid.flush
+
+        stdout, status = Open3.capture2(script, "check", "-j2", valid.path, invalid.path)
+
+        assert_equal(1, status.exitstatus)
+        assert_equal(
+          ["#{valid.path}: Syntax OK", "#{invalid.path}:3:1: Expected 'end' after the begin block."],
+          stdout.lines(chomp: true).sort_by { |line| line.start_with?(valid.path) ? 0 : 1 }
+        )
+      end
+    end
+  end
+
+  def test_timeout
+    source = "a + b\n" * 2_000_000
+
+    stdout, status = Open3.capture2(script, "check", "--timeout", "1", stdin_data: source)
+    assert_equal(1, status.exitstatus)
+    assert_match(/\A-:\d+:\d+: Parse timed out\.\n\z/, stdout)
+
+    ["", "--pipelined", "--events"].each do |mode|
+      stdout, stderr, status = Open3.capture3(*[script, "parse", mode, "--timeout", "1"].reject(&:empty?), stdin_data: source)
+
+      assert_equal(1, status.exitstatus, "Expected parse #{mode} to fail")
+      assert_equal("Parse timed out.\n", stderr)
+      assert_operator(stdout.lines.length, :<, 6_000_000, "Expected parse #{mode} to stop early")
+    end
+  end
+
+  private
+
+  def script
+    File.expand_path("../build/parse", __dir__)
+  end
+
+  def check(source)
+    Open3.capture2(script, "check", stdin_data: source)
+  end
+end
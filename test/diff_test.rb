@@ -0,0 +1,59 @@
+# frozen_string_literal: true
+
+require "open3"
+require "tempfile"
+require "test/unit"
+
+class DiffTest < Test::Unit::TestCase
+  def test_same
+    stdout, status = diff("a = 1 + 2\nb\n", "a = 1 + 2\nb\n")
+
+    assert_equal(0, status.exitstatus)
+    assert_equal("", stdout)
+  end
+
+  def test_changed_literal
+    stdout, status = diff("a = [1, 2, 3]\n", "a = [1, 5, 3]\n")
+
+    assert_equal(1, status.exitstatus)
+    assert_equal("- (literal 2)\n+ (literal 5)\n", stdout)
+  end
+
+  def test_changed_operator
+    stdout, status = diff("a = b + c\n", "a = b - c\n")
+
+    assert_equal(1, status.exitstatus)
+    assert_equal("- (binary + (literal b) (literal c))\n+ (binary - (literal b) (literal c))\n", stdout)
+  end
+
+  def test_inserted_statement
+    stdout, status = diff("a\nb\n", "a\nc = d\nb\n")
+
+    assert_equal(1, status.exitstatus)
+    assert_equal("+ (assign = (literal c) (literal d))\n", stdout)
+  end
+
+  def test_removed_statement
+    stdout, status = diff("a\nc = d\nb\n", "a\nb\n")
+
+    assert_equal(1, status.exitstatus)
+    assert_equal("- (assign = (literal c) (literal d))\n", stdout)
+  end
+
+  private
+
+  def diff(before, after)
+    script = File.expand_path("../build/parse", __dir__)
+
+    Tempfile.create(["before", ".rb"]) do |left|
+      Tempfile.create(["after", ".rb"]) do |right|
+        left.write(before)
+        left.flush
+        right.write(after)
+        right.flush
+
+        Open3.capture2(script, "diff", left.path, right.path)
+      end
+    end
+  end
+end
@@ -3,6 +3,7 @@
 require "open3"
 require "ripper"
 require "stringio"
+require "tmpdir"
 require "test/unit"
 
 class ParseTest < Test::Unit::TestCase
@@ -197,6 +198,9 @@ class ParseTest < Test::Unit::TestCase
     end
   end
 
+  # Every mode of parsing should produce exactly the same output.
+  MODES = ["", "--pipelined", "--events", "--index", "--split=4"]
+
   script = File.expand_path("../build/parse", __dir__)
   fixture = File.expand_path("fixtures/parse.rb", __dir__)
 
@@ -206,11 +210,13 @@ class ParseTest < Test::Unit::TestCase
     define_method(:"test_line_#{index}") do
       source, expected = line.split(" # ")
 
-      stdout, status = Open3.capture2("#{script} parse", stdin_data: source)
-      actual = stdout.chomp.tr("\n", " ")
+      MODES.each do |mode|
+        stdout, status = Open3.capture2("#{script} parse #{mode}", stdin_data: source)
+        actual = stdout.chomp.tr("\n", " ")
 
-      assert_equal(0, status, "Expected parse to exit cleanly")
-      assert_equal(expected, actual, "Expected to match the comment")
+        assert_equal(0, status, "Expected parse #{mode} to exit cleanly")
+        assert_equal(expected, actual, "Expected parse #{mode} to match the comment")
+      end
 
       output = Parser.parse(source)
       actual = output.string.chomp.tr("\n", " ")
@@ -218,4 +224,222 @@ class ParseTest < Test::Unit::TestCase
       assert_equal(expected, actual, "Expected to match the ripper output")
     end
   end
+
+  # Nesting past the depth limit stops the parse instead of overflowing the
+  # stack, and reports the error once.
+  define_method(:test_nested_too_deeply) do
+    source = "#{"(" * 100_000}a#{")" * 100_000}\n"
+
+    MODES.each do |mode|
+      _, stderr, status = Open3.capture3("#{script} parse #{mode}", stdin_data: source)
+
+      assert_equal(0, status, "Expected parse #{mode} to exit cleanly")
+      assert_equal("Expression nested too deeply.\n", stderr)
+    end
+  end
+
+  # The speculating build peeks, lexes ahead, and rewinds at every operand (see
+  # lex_speculate), and should give exactly the same output as a normal parse,
+  # including when the parse is stopped part of the way through.
+  define_method(:test_speculate) do
+    speculate = File.expand_path("../build/parse-speculate", __dir__)
+    sources = File.foreach(fixture, chomp: true).reject(&:empty?).map { |line| line.split(" # ").first }
+    sources << sources.join("\n") << "#{"(" * 100_000}a#{")" * 100_000}\n" << "a\n(b\nc\nd\n"
+
+    sources.each do |source|
+      MODES.each do |mode|
+        expected = Open3.capture3("#{script} parse #{mode}", stdin_data: source)
+        actual = Open3.capture3("#{speculate} parse #{mode}", stdin_data: source)
+
+        assert_equal(expected, actual, "Expected parse #{mode} to match when speculating for #{source[0, 40].inspect}")
+      end
+    end
+  end
+
+  # A deadline that runs out while speculating stops the parse there, and
+  # nothing but the end of the file comes after it (the speculating build
+  # aborts if anything does).
+  define_method(:test_speculate_timeout) do
+    speculate = File.expand_path("../build/parse-speculate", __dir__)
+    source = "a = [1, 2] + (b - 1) if c\n" * 40_000
+
+    MODES.each do |mode|
+      _, stderr, status = Open3.capture3("#{speculate} parse #{mode} --timeout=5", stdin_data: source)
+
+      assert_equal(1, status.exitstatus, "Expected parse #{mode} to time out")
+      assert_equal("Parse timed out.\n", stderr)
+    end
+  end
+
+  # Splitting the top-level statements of a source across threads should give
+  # the same output as parsing it in one go, however many ranges it's split
+  # into. Every fixture goes into one source, except for the loops, since the
+  # parser stops at the end of a loop at the top level.
+  define_method(:test_split) do
+    lines = File.foreach(fixture, chomp: true).reject(&:empty?).map { |line| line.split(" # ") }
+    lines.reject! { |(source, _)| source.match?(/\A(while|until) /) }
+
+    source = lines.map(&:first).join("\n")
+    expected = lines.map(&:last).join(" ")
+
+    [2, 3, 8, 64].each do |threads|
+      stdout, status = Open3.capture2("#{script} parse --split=#{threads}", stdin_data: source)
+
+      assert_equal(0, status, "Expected parse --split=#{threads} to exit cleanly")
+      assert_equal(expected, stdout.chomp.tr("\n", " "), "Expected parse --split=#{threads} to match")
+    end
+  end
+
+  # These are places where the scan for statements can't tell where they end,
+  # which should fall back to parsing in one go.
+  define_method(:test_split_fallback) do
+    [
+      "a = $;\nb\nc\n",
+      "a +\nb\nc\n",
+      "a ? b\n: c\nd\n",
+      "a\n  \nb\nc\n",
+      "foo while x\nbar\nend\nbaz\n",
+      "x = (while a\nb\nend)\nc\nd\n",
+      "[1,\n2]\nb = 3\nc\n",
+      "begin\na\nensure\nb\nend\nc\nd\n",
+      "a\n(b\nc\nd\n",
+      "a\nb\x00c\nd\n"
+    ].each do |source|
+      expected = Open3.capture3("#{script} parse", stdin_data: source)
+      actual = Open3.capture3("#{script} parse --split=4", stdin_data: source)
+
+      assert_equal(expected, actual, "Expected parse --split=4 to match for #{source.inspect}")
+    end
+  end
+
+  # A printer with only some of its callbacks set should print exactly those
+  # nodes, whether the parser visits it directly or the events are replayed
+  # into it, and skip the rest rather than calling through NULL.
+  define_method(:test_only) do
+    lines = File.foreach(fixture, chomp: true).reject(&:empty?).map { |line| line.split(" # ") }
+    kept = ->(name) { name.end_with?("ASSIGN") || %w[FALSE NIL SELF TRUE].include?(name) || (name.include?("=") && !name.start_with?("ARRAY=")) }
+
+    lines.each do |(source, expected)|
+      MODES.each do |mode|
+        stdout, status = Open3.capture2("#{script} parse #{mode} --only=assign,literal", stdin_data: source)
+
+        assert_equal(0, status, "Expected parse #{mode} --only to exit cleanly for #{source.inspect}")
+        assert_equal(expected.split(" ").select(&kept), stdout.split("\n"), "Expected parse #{mode} --only to match #{source.inspect}")
+      end
+    end
+
+    _, stderr, status = Open3.capture3("#{script} parse --only=assign,call", stdin_data: "a\n")
+    assert_equal([1, "Unknown kind of node: call\n"], [status.exitstatus, stderr])
+  end
+
+  # Parsing only the statement around an offset should give that statement's
+  # part of parsing it in one go, from anywhere in the statement up to and
+  # including the newline after it.
+  define_method(:test_at) do
+    lines = File.foreach(fixture, chomp: true).reject(&:empty?).map { |line| line.split(" # ") }
+    lines.reject! { |(source, _)| source.match?(/\A(while|until) /) }
+
+    source = lines.map(&:first).join("\n")
+    offset = 0
+
+    lines.each do |(line, expected)|
+      [offset, offset + line.length / 2, offset + line.length].each do |at|
+        stdout, stderr, status = Open3.capture3("#{script} parse --at=#{at}", stdin_data: source)
+
+        assert_equal(0, status, "Expected parse --at=#{at} to exit cleanly")
+        assert_equal(["", expected], [stderr, stdout.chomp.tr("\n", " ")], "Expected parse --at=#{at} to match #{line.inspect}")
+      end
+
+      offset += line.length + 1
+    end
+  end
+
+  # These are places where the scan for statements can't tell where they end
+  # (the same ones as for splitting), which should still give the statement
+  # around the offset along with its errors.
+  define_method(:test_at_fallback) do
+    {
+      ["a ? b\n: c\nd\n", 4] => ["Expected ':' after expression.\n", "VCALL=a VCALL=b TERNARY"],
+      ["a = $;\nb\nc\n", 7] => ["", "VCALL=b"],
+      ["a +\nb\nc\n", 4] => ["", "VCALL=a ADD"],
+      ["foo while x\nbar\nend\nbaz\n", 12] => ["", "VCALL=bar"],
+      ["x = (while a\nb\nend)\nc\n", 13] => ["Expected ')' after expression.\n", "VCALL=x VCALL=a VCALL=b WHILE GROUP ASSIGN"],
+      ["begin\na\nensure\nb\nend\nc\nd\n", 9] => ["", "VCALL=a VCALL=b BEGIN"],
+      ["a\n(b\nc\nd\n", 3] => ["Expected ')' after expression.\n", "VCALL=b GROUP"]
+    }.each do |(source, at), expected|
+      stdout, stderr, status = Open3.capture3("#{script} parse --at=#{at}", stdin_data: source)
+
+      assert_equal(0, status, "Expected parse --at=#{at} to exit cleanly for #{source.inspect}")
+      assert_equal(expected, [stderr, stdout.chomp.tr("\n", " ")], "Expected parse --at=#{at} to match for #{source.inspect}")
+    end
+  end
+
+  # The scan reads $| as $ followed by an operator, so it takes the while
+  # modifier after it for a loop and finds no more statements in the rest of
+  # the source. Every one of them still has to come out the same as a full
+  # parse of it, however many statements come before.
+  define_method(:test_at_fooled_scan) do
+    lines = File.foreach(fixture, chomp: true).reject(&:empty?).map { |line| line.split(" # ").first }
+    lines.reject! { |line| line.match?(/\A(while|until) /) }
+
+    [1, 1000].each do |count|
+      prefix = "a = 1\n" * count + "x = $| while y\n"
+      source = prefix + lines.join("\n")
+      offset = prefix.length
+
+      lines.each do |line|
+        expected = Open3.capture3("#{script} parse", stdin_data: line)
+
+        [offset, offset + line.length / 2, offset + line.length].each do |at|
+          actual = Open3.capture3("#{script} parse --at=#{at}", stdin_data: source)
+
+          assert_equal(expected, actual, "Expected parse --at=#{at} to match #{line.inspect} after #{count} statements")
+        end
+
+        offset += line.length + 1
+      end
+    end
+  end
+
+  # With a single job, files are printed in the order they were given even
+  # though they finish loading in any order. With more, they're all printed.
+  define_method(:test_files_in_order) do
+    Dir.mktmpdir do |directory|
+      paths = 100.times.map do |index|
+        File.join(directory, "#{index}.rb").tap do |path|
+          File.write(path, "a = b + #{index}\n" * ((index * 7919) % 3000 + 1))
+        end
+      end
+
+      ["", "-j4"].each do |mode|
+        stdout, status = Open3.capture2(*[script, "parse", mode, *paths].reject(&:empty?))
+        keys = stdout.scan(/^==> (.+) <==$/).flatten
+
+        assert_equal(0, status, "Expected parse #{mode} to exit cleanly")
+        assert_equal(mode.empty? ? paths : paths.sort, mode.empty? ? keys : keys.sort, "Expected parse #{mode} to print every file")
+      end
+    end
+  end
+
+  # Counting doesn't change the output. Where the counters can't be opened
+  # (which is often the case in containers and VMs) it says so instead of
+  # failing.
+  define_method(:test_perf_counters) do
+    source = "a = [1, 2] + (b - 1) if c\n"
+    expected, = Open3.capture2("#{script} parse", stdin_data: source)
+
+    ["tokenize", "parse"].each do |command|
+      stdout, stderr, status = Open3.capture3("#{script} #{command} --perf-counters", stdin_data: source)
+
+      assert_equal(0, status, "Expected #{command} --perf-counters to exit cleanly")
+      assert_equal(expected, stdout) if command == "parse"
+
+      if stderr.start_with?("perf: hardware counters are unavailable: ")
+        assert_equal(1, stderr.lines.length)
+      else
+        assert_match(/\Aperf: 1 sources, 26 bytes, 16 tokens\n.*#{command}\/token\n/, stderr)
+        assert_match(/^cycles /, stderr)
+      end
+    end
+  end
 end
@@ -1,4 +1,10 @@
 # frozen_string_literal: true
 
+require_relative "archive_test"
+require_relative "cache_test"
+require_relative "check_test"
+require_relative "diff_test"
 require_relative "parse_test"
+require_relative "search_test"
 require_relative "tokenize_test"
+require_relative "trace_test"
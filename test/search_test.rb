@@ -0,0 +1,137 @@
+# frozen_string_literal: true
+
+require "open3"
+require "tempfile"
+require "tmpdir"
+require "test/unit"
+
+class SearchTest < Test::Unit::TestCase
+  SOURCE = <<~RUBY
+    a = defined?(b)
+    x = foo rescue nil
+    $g[1] = 2
+    -a + b
+    c = 1; d = e if f
+  RUBY
+
+  def test_patterns
+    assert_equal(
+      [
+        "-:1:1: (ASSIGN _ DEFINED)",
+        "-:2:5: RESCUE_MODIFIER",
+        "-:3:1: (ASSIGN (INDEX GLOBAL_VARIABLE _) _)"
+      ],
+      search(SOURCE, "(ASSIGN _ DEFINED)", "RESCUE_MODIFIER", "(ASSIGN (INDEX GLOBAL_VARIABLE _) _)")
+    )
+  end
+
+  def test_source_order
+    # The match for the addition starts at the unary minus before it, and
+    # outer nodes come before the nodes inside of them.
+    assert_equal(
+      ["-:1:1: binary", "-:1:1: UMINUS", "-:1:2: VCALL=a", "-:1:7: binary", "-:1:7: VCALL=a"],
+      search("-a + (a * b)\n", "binary", "UMINUS", "VCALL=a")
+    )
+  end
+
+  def test_text
+    assert_equal(["-:1:5: INTEGER=22"], search("1 + 22 + 222\n", "INTEGER=22"))
+    assert_equal(["-:1:1: GLOBAL_VARIABLE=$;"], search("$; + 1\n", "GLOBAL_VARIABLE=$;"))
+  end
+
+  # Lines and columns come from the structural index, so the lines here
+  # straddle its words and running counts in every way.
+  def test_positions
+    lines = Array.new(300) { |index| "#{" " * (index * 37 % 150)}a#{index} + 1#{"\n" * (index % 3)}" }
+    expected = []
+
+    lines.join("\n").lines.each_with_index do |line, index|
+      expected << "-:#{index + 1}:#{line.index("a") + 1}: binary" if line.include?("+")
+    end
+
+    assert_equal(expected, search("#{lines.join("\n")}\n", "binary"))
+  end
+
+  def test_children
+    source = "[1, 2, 3]\n[1]\n[]\n"
+
+    assert_equal(["-:1:1: (ARRAY _ _ _)"], search(source, "(ARRAY _ _ _)"))
+    assert_equal(["-:1:1: (ARRAY INTEGER=1 ...)", "-:2:1: (ARRAY INTEGER=1 ...)"], search(source, "(ARRAY INTEGER=1 ...)"))
+    assert_equal(["-:3:1: (ARRAY)"], search(source, "(ARRAY)"))
+    assert_equal(["-:1:1: ARRAY", "-:2:1: ARRAY", "-:3:1: ARRAY"], search(source, "ARRAY"))
+  end
+
+  def test_shared_subpatterns
+    patterns = ["(ADD (ADD _ _) _)", "(ADD _ _)", "(SUBTRACT (ADD _ _) _)"]
+
+    assert_equal(
+      ["-:1:1: (ADD (ADD _ _) _)", "-:1:1: (ADD _ _)", "-:1:1: (ADD _ _)", "-:2:1: (SUBTRACT (ADD _ _) _)", "-:2:1: (ADD _ _)"],
+      search("a + b + c\na + b - c\n", *patterns)
+    )
+  end
+
+  def test_errors
+    {
+      "(ASSIGN" => "pattern 1:8: Expected ')' after the pattern.\n",
+      "FOO" => "pattern 1:1: Unknown node name.\n",
+      "(ARRAY ... _)" => "pattern 1:12: Expected ')' after '...'.\n",
+      "INTEGER=" => "pattern 1:9: Expected text after '='.\n",
+      "ASSIGN )" => "pattern 1:8: Unexpected input after the pattern.\n",
+      "" => "pattern 1:1: Expected a pattern.\n"
+    }.each do |pattern, message|
+      _, stderr, status = Open3.capture3(script, "search", "--pattern", "_", "--pattern", pattern, stdin_data: "")
+
+      assert_equal(1, status.exitstatus)
+      assert_equal(message.sub("pattern 1", "pattern 2"), stderr, pattern)
+    end
+  end
+
+  def test_diagnostics
+    stdout, stderr, status = Open3.capture3(script, "search", "--pattern", "VCALL", stdin_data: "a + [b\n")
+
+    assert_equal(0, status.exitstatus)
+    assert_equal("-:1:1: VCALL\n-:1:6: VCALL\n", stdout)
+    assert_equal("-:1:7: Expected ']' after the array elements.\n", stderr)
+  end
+
+  def test_files
+    Tempfile.create(["first", ".rb"]) do |first|
+      Tempfile.create(["second", ".rb"]) do |second|
+        first.write("a = 1\n")
+        first.flush
+        second.write("b\nc = 2\n")
+        second.flush
+
+        ["-j1", "-j2", "--split=2"].each do |option|
+          stdout, status = Open3.capture2(script, "search", option, "--pattern", "(ASSIGN VCALL _)", first.path, second.path)
+
+          assert_equal(0, status.exitstatus)
+          assert_equal(["#{first.path}:1:1: (ASSIGN VCALL _)", "#{second.path}:2:1: (ASSIGN VCALL _)"], stdout.lines(chomp: true).sort, option)
+        end
+      end
+    end
+  end
+
+  def test_cache
+    Dir.mktmpdir do |directory|
+      expected = search(SOURCE, "binary", "VCALL")
+      Open3.capture3(script, "parse", "--cache", directory, stdin_data: SOURCE)
+
+      stdout, stderr, = Open3.capture3(script, "search", "--cache", directory, "--cache-stats", "--pattern", "binary", "--pattern", "VCALL", stdin_data: SOURCE)
+      assert_equal(expected, stdout.lines(chomp: true))
+      assert_match(/\Acache: 1 hits/, stderr)
+    end
+  end
+
+  private
+
+  def script
+    File.expand_path("../build/parse", __dir__)
+  end
+
+  def search(source, *patterns)
+    stdout, status = Open3.capture2(script, "search", *patterns.flat_map { |pattern| ["--pattern", pattern] }, stdin_data: source)
+    assert_equal(0, status.exitstatus)
+    stdout.lines(chomp: true)
+  end
+end
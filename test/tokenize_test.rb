@@ -5,6 +5,9 @@ require "ripper"
 require "test/unit"
 
 class TokenizeTest < Test::Unit::TestCase
+  # Every mode of lexing should produce exactly the same tokens.
+  MODES = ["", "--index"]
+
   script = File.expand_path("../build/parse", __dir__)
   fixture = File.expand_path("fixtures/tokenize.rb", __dir__)
 
@@ -14,11 +17,13 @@ class TokenizeTest < Test::Unit::TestCase
     define_method(:"test_line_#{index}") do
       source, expected = line.split(" # ")
 
-      stdout, status = Open3.capture2("#{script} tokenize", stdin_data: source)
-      actual = stdout.chomp.tr("\n", " ")
+      MODES.each do |mode|
+        stdout, status = Open3.capture2("#{script} tokenize #{mode}", stdin_data: source)
+        actual = stdout.chomp.tr("\n", " ")
 
-      assert_equal(0, status, "Expected parse to exit cleanly")
-      assert_equal(expected, actual, "Expected to match the comment")
+        assert_equal(0, status, "Expected tokenize #{mode} to exit cleanly")
+        assert_equal(expected, actual, "Expected tokenize #{mode} to match the comment")
+      end
 
       actual = lex(source).join(" ")
 
@@ -26,8 +31,58 @@ class TokenizeTest < Test::Unit::TestCase
     end
   end
 
+  # The packed format should hold exactly the same tokens as the text output.
+  define_method(:test_packed) do
+    sources = File.foreach(fixture, chomp: true).reject(&:empty?)
+    # Repeat the fixture so that the tokens span more than one block.
+    source = (sources.map { |line| line.split(" # ").first } * 3).join("\n")
+
+    text, = Open3.capture2("#{script} tokenize", stdin_data: source)
+    packed, status = Open3.capture2("#{script} tokenize --format=packed", stdin_data: source, binmode: true)
+
+    assert_equal(0, status, "Expected tokenize --format=packed to exit cleanly")
+    assert_equal(text.scan(/^\d+-\d+(?= )/), unpack(packed))
+  end
+
   private
 
+  # Decodes the packed token format into start-end offset pairs.
+  def unpack(packed)
+    magic, version, count, blocks = packed.unpack("a4VQ<Q<")
+    assert_equal(["RBPK", 1], [magic, version])
+
+    data = 24 + blocks * 16
+    offsets = []
+
+    blocks.times do |block|
+      offset, previous, = packed.unpack("Q<VV", offset: 24 + block * 16)
+      size = [count - block * 256, 256].min
+      bytes = packed.byteslice(data + offset + size..).bytes
+
+      size.times do
+        gap, width = 2.times.map do
+          value = 0
+          shift = 0
+
+          loop do
+            byte = bytes.shift
+            value |= (byte & 0x7f) << shift
+            shift += 7
+            break if byte < 0x80
+          end
+
+          value
+        end
+
+        start = previous + gap
+        previous = start + width
+        offsets << "#{start}-#{previous}"
+      end
+    end
+
+    offsets
+  end
+
   def lex(source)
     line_counts = []
     last_index = 0
@@ -0,0 +1,132 @@
+# frozen_string_literal: true
+
+require "json"
+require "open3"
+require "tmpdir"
+require "test/unit"
+
+class TraceTest < Test::Unit::TestCase
+  SOURCES = {
+    "a.rb" => "a = 1 + foo(2)\n",
+    "b.rb" => "[b, -c] if d\n",
+    "c.rb" => "e = [3, 4] - f\n"
+  }
+
+  def test_trace
+    within_sources do |paths|
+      spans = traced(paths)
+
+      assert_equal(paths.sort, spans.select { |span| span["name"] == "load" }.map { |span| span.dig("args", "label") }.sort)
+      assert_equal(paths.length, spans.count { |span| span["name"] == "parse" })
+      assert_equal([], spans.select { |span| span["name"].start_with?("parse_") })
+    end
+  end
+
+  def test_trace_pipelined
+    within_sources do |paths|
+      spans = traced(paths, "--pipelined")
+
+      assert_equal(paths.length, spans.count { |span| span["name"] == "lex" && span.dig("args", "label") == "pipelined" })
+      assert_equal(paths.length, spans.count { |span| span["name"] == "parse" })
+    end
+  end
+
+  def test_trace_detail
+    within_sources do |paths|
+      spans = traced(paths, "--trace-detail")
+      names = spans.map { |span| span["name"] }.uniq
+
+      assert_equal([], %w[load lex parse parse_assign parse_binary parse_literal visit] - names)
+      assert_equal(paths.length, spans.count { |span| span["name"] == "parse" })
+
+      # The detailed spans of a file are all nested inside of its parse.
+      spans.select { |span| span["name"] == "parse" }.each do |parse|
+        lexes = spans.select { |span| span["name"] == "lex" && span["ts"] >= parse["ts"] && span["ts"] + span["dur"] <= parse["ts"] + parse["dur"] }
+        assert_not_empty(lexes)
+      end
+    end
+  end
+
+  def test_trace_threads
+    within_sources do |paths|
+      spans = traced(paths, "-j3")
+
+      assert_equal(paths.sort, spans.select { |span| span["name"] == "load" }.map { |span| span.dig("args", "label") }.sort)
+      assert(spans.all? { |span| span["ph"] == "X" && span["pid"] == 1 && span["tid"].between?(0, 2) })
+    end
+  end
+
+  def test_histogram
+    within_sources do |paths|
+      ["", "-j3"].each do |mode|
+        _, stderr, = Open3.capture3(*[script, "parse", "--histogram", mode, *paths].reject(&:empty?))
+        lines = stderr.lines(chomp: true)
+
+        %w[load parse].each do |name|
+          line = lines.find { |candidate| candidate.start_with?("#{name} ") }
+
+          assert_not_nil(line, "Expected a #{name} histogram with #{mode.inspect}")
+          assert_match(/\A#{name}\s+count=#{paths.length} min=\S+ p50=\S+ p99=\S+ p999=\S+ max=\S+\z/, line)
+        end
+      end
+    end
+  end
+
+  # The flags only add output to stderr and the trace file, so what's parsed
+  # has to come out the same as without them.
+  def test_unchanged
+    within_sources do |paths|
+      ["", "-j3", "--pipelined"].each do |mode|
+        expected = Open3.capture3(*[script, "parse", mode, *paths].reject(&:empty?))
+
+        trace = "--trace=#{File.join(File.dirname(paths[0]), "trace.json")}"
+
+        [["--histogram"], [trace], [trace, "--trace-detail"]].each do |flags|
+          stdout, stderr, status = Open3.capture3(*[script, "parse", mode, *flags, *paths].reject(&:empty?))
+
+          assert_equal(sections(expected[0]), sections(stdout), "Expected #{flags.join(" ")} not to change the output with #{mode.inspect}")
+          assert_equal(expected[2].exitstatus, status.exitstatus)
+          assert_equal(expected[1], stderr) unless flags.include?("--histogram")
+        end
+      end
+
+      source = SOURCES.values.join
+      expected = Open3.capture3(script, "parse", stdin_data: source)
+      actual = Open3.capture3(script, "parse", "--trace=#{File.join(File.dirname(paths[0]), "trace.json")}", "--trace-detail", stdin_data: source)
+
+      assert_equal(expected[0..1], actual[0..1])
+    end
+  end
+
+  private
+
+  def script
+    File.expand_path("../build/parse", __dir__)
+  end
+
+  def within_sources
+    Dir.mktmpdir do |directory|
+      paths = SOURCES.map do |name, source|
+        File.join(directory, name).tap { |path| File.write(path, source) }
+      end
+
+      yield paths
+    end
+  end
+
+  # Splits the output of a run into the sections for each path, which come
+  # out in whatever order the threads finish them.
+  def sections(stdout)
+    stdout.split(/^==> (.+) <==\n/).drop(1).each_slice(2).sort
+  end
+
+  # Parses the paths with a trace written alongside them, and returns the
+  # spans that it holds.
+  def traced(paths, *arguments)
+    trace = File.join(File.dirname(paths[0]), "trace.json")
+    _, stderr, = Open3.capture3(script, "parse", "--trace=#{trace}", *arguments, *paths)
+
+    assert_equal("", stderr)
+    JSON.parse(File.read(trace)).fetch("traceEvents")
+  end
+end